@@ -0,0 +1,242 @@
+// Checks that backups taken from read views are consistent while writers
+// keep changing the store. The writers only ever write or delete whole
+// groups of keys in one command, with the same value for every key of the
+// group, so a backup that holds part of a group, two values in one group or
+// a key twice saw the store between two changes. The pairs of a backup must
+// also come in key order. The store runs in the
+// lock-based mode: in the sharded mode a command spanning several shards is
+// not atomic, so neither are the backups.
+//
+// Usage: backup_consistency [-t writers] [-B backups] [-s stripes] [-e chains|swiss] [-b] <dir>
+//   -b writes the backups as snapshots instead of text.
+// The backups are written to <dir>/job-N.bck (or .snap) and checked once
+// the writers stop.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/constants.h"
+#include "../server/operations.h"
+#include "../server/snapshot.h"
+#include "bench.h"
+
+#define GROUP_KEYS 12    // keys of a group, all written or deleted by one command
+#define MAX_GROUPS 4096  // groups the writers create at most
+
+static atomic_int stopping = 0;
+static atomic_int num_groups = 0;
+static int null_fd;
+
+// Writes or deletes random groups, some of them with values long enough to
+// be kept out of line, until the backups are done.
+static void *run_writer(void *arg) {
+  uint64_t state = (uint64_t) (size_t) arg * 7919 + 1;
+  char keys[GROUP_KEYS][MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE * 2];
+  char *values[GROUP_KEYS];
+  for (size_t i = 0; i < GROUP_KEYS; i++) {
+    values[i] = value;
+  }
+
+  for (size_t n = 0; !atomic_load(&stopping); n++) {
+    uint64_t r = bench_random(&state) % 10;
+    int group = atomic_load(&num_groups);
+    if ((r < 3 || group == 0) && group < MAX_GROUPS) {
+      group = atomic_fetch_add(&num_groups, 1);
+    } else {
+      group = (int) (bench_random(&state) % (uint64_t) group);
+    }
+    if (group >= MAX_GROUPS) {
+      continue;
+    }
+    for (size_t i = 0; i < GROUP_KEYS; i++) {
+      snprintf(keys[i], MAX_STRING_SIZE, "g%d_%zu", group, i);
+    }
+    if (r == 9) {
+      kvs_delete(GROUP_KEYS, keys, null_fd);
+      continue;
+    }
+    const char *padding = n % 5 == 0 ? "_a_value_longer_than_a_key_can_be" : "";
+    snprintf(value, sizeof(value), "%zu_%zu%s", (size_t) arg, n, padding);
+    kvs_write(GROUP_KEYS, keys, values, NULL);
+  }
+  return NULL;
+}
+
+// What a backup holds of every group.
+typedef struct BackupCheck {
+  unsigned int seen[MAX_GROUPS];  // bit i set once key i of the group was found
+  char *values[MAX_GROUPS];       // value of the first key found of the group
+  char last[MAX_STRING_SIZE];     // key of the previous pair
+  int errors;
+} BackupCheck;
+
+static void check_pair(const char *key, size_t key_len, const char *value, size_t value_len, uint64_t deadline,
+                       void *arg) {
+  (void) deadline;
+  BackupCheck *check = arg;
+  int group;
+  unsigned int index;
+  char name[MAX_STRING_SIZE];
+  snprintf(name, sizeof(name), "%.*s", (int) key_len, key);
+  if (check->last[0] != '\0' && strcmp(check->last, name) >= 0) {
+    fprintf(stderr, "Key %s comes after %s\n", name, check->last);
+    check->errors++;
+  }
+  memcpy(check->last, name, sizeof(name));
+  if (sscanf(name, "g%d_%u", &group, &index) != 2 || group < 0 || group >= MAX_GROUPS || index >= GROUP_KEYS) {
+    fprintf(stderr, "Unexpected key %s\n", name);
+    check->errors++;
+    return;
+  }
+  if (check->seen[group] & (1u << index)) {
+    fprintf(stderr, "Key %s is in the backup twice\n", name);
+    check->errors++;
+  }
+  check->seen[group] |= 1u << index;
+  if (check->values[group] == NULL) {
+    check->values[group] = strndup(value, value_len);
+  } else if (strlen(check->values[group]) != value_len || memcmp(check->values[group], value, value_len) != 0) {
+    fprintf(stderr, "Group %d has values %s and %.*s\n", group, check->values[group], (int) value_len, value);
+    check->errors++;
+  }
+}
+
+// Reads a text backup, a "(key, value)" line per pair.
+static int read_text_backup(const char *path, BackupCheck *check) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return 1;
+  }
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, file)) > 0) {
+    char *separator = strstr(line, ", ");
+    if (line[0] != '(' || separator == NULL || len < 3 || line[len - 2] != ')') {
+      fprintf(stderr, "Malformed line in %s: %s", path, line);
+      check->errors++;
+      continue;
+    }
+    char *value = separator + 2;
+    check_pair(line + 1, (size_t) (separator - line - 1), value, (size_t) (line + len - 2 - value), 0, check);
+  }
+  free(line);
+  fclose(file);
+  return 0;
+}
+
+// Checks one backup.
+// @return Number of problems found.
+static int check_backup(const char *path, int binary) {
+  BackupCheck *check = calloc(1, sizeof(BackupCheck));
+  if (check == NULL) {
+    return 1;
+  }
+  uint64_t log_offset;
+  int failed = binary ? snapshot_load(path, &log_offset, check_pair, check) : read_text_backup(path, check);
+  int errors = failed + check->errors;
+  for (int group = 0; group < MAX_GROUPS; group++) {
+    if (check->seen[group] != 0 && check->seen[group] != (1u << GROUP_KEYS) - 1) {
+      fprintf(stderr, "%s holds part of group %d\n", path, group);
+      errors++;
+    }
+    free(check->values[group]);
+  }
+  free(check);
+  return errors;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_writers = 4;
+  size_t num_backups = 20;
+  size_t num_stripes = 64;
+  enum TableEngine engine = ENGINE_CHAINS;
+  int binary = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:B:s:e:b")) != -1) {
+    switch (opt) {
+      case 't':
+        num_writers = bench_count(optarg);
+        break;
+      case 'B':
+        num_backups = bench_count(optarg);
+        break;
+      case 's':
+        num_stripes = bench_count(optarg);
+        break;
+      case 'e':
+        if (strcmp(optarg, "chains") == 0) {
+          engine = ENGINE_CHAINS;
+        } else if (strcmp(optarg, "swiss") == 0) {
+          engine = ENGINE_SWISS;
+        } else {
+          fprintf(stderr, "Invalid engine: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'b':
+        binary = 1;
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-t writers] [-B backups] [-s stripes] [-e chains|swiss] [-b] <dir>\n", argv[0]);
+    return 1;
+  }
+  char job[FILENAME_MAX];
+  snprintf(job, sizeof(job), "%s/job", argv[optind]);
+
+  null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0 || kvs_init(num_stripes, 0, 0, engine) != 0) {
+    fprintf(stderr, "Failed to initialize the KVS state\n");
+    return 1;
+  }
+  if (binary) {
+    kvs_set_backup_format(BACKUP_BINARY);
+  }
+
+  pthread_t *writers = malloc(num_writers * sizeof(pthread_t));
+  if (writers == NULL) {
+    return 1;
+  }
+  for (size_t i = 0; i < num_writers; i++) {
+    pthread_create(&writers[i], NULL, run_writer, (void *) i);
+  }
+  int active_backups = 0;
+  int total_backups = 1;
+  pthread_mutex_t backups_mutex = PTHREAD_MUTEX_INITIALIZER;
+  for (size_t b = 0; b < num_backups; b++) {
+    kvs_wait(20);
+    // a chain of its own per backup, so that every one is a full backup
+    BackupChain chain = {.deltas = -1, .position = 0};
+    kvs_backup(2, &active_backups, &total_backups, &chain, job, &backups_mutex);
+  }
+  atomic_store(&stopping, 1);
+  for (size_t i = 0; i < num_writers; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  kvs_wait_backup(1, &active_backups, &backups_mutex);
+  kvs_terminate();
+  free(writers);
+  close(null_fd);
+
+  int errors = 0;
+  for (int b = 1; b < total_backups; b++) {
+    char path[FILENAME_MAX + 16];
+    snprintf(path, sizeof(path), "%s-%d.%s", job, b, binary ? "snap" : "bck");
+    errors += check_backup(path, binary);
+  }
+  int groups = atomic_load(&num_groups) < MAX_GROUPS ? atomic_load(&num_groups) : MAX_GROUPS;
+  printf("%d backups of %d groups: %s\n", total_backups - 1, groups, errors == 0 ? "consistent" : "INCONSISTENT");
+  return errors != 0;
+}
@@ -0,0 +1,94 @@
+// Times multi-key WRITE and DELETE commands, the paths the batch planner
+// groups by stripe before any lock is taken. Every command has random keys,
+// some of them repeated, and the deletes report their missing keys to
+// /dev/null as a session would to its client.
+//
+// Usage: batch [-k keys_per_command] [-c commands] [-s stripes] [-S shards] [-u distinct_keys]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../common/constants.h"
+#include "../server/operations.h"
+#include "bench.h"
+
+// Fills the keys of a command with random ones.
+static void pick_keys(char keys[][MAX_STRING_SIZE], size_t num_keys, size_t distinct, uint64_t *state) {
+  for (size_t i = 0; i < num_keys; i++) {
+    bench_key(keys[i], bench_random(state) % distinct);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t keys_per_command = 1024;
+  size_t num_commands = 500;
+  size_t num_stripes = 64;
+  size_t num_shards = 0;
+  size_t distinct = 100000;
+  int opt;
+  while ((opt = getopt(argc, argv, "k:c:s:S:u:")) != -1) {
+    switch (opt) {
+      case 'k':
+        keys_per_command = bench_count(optarg);
+        break;
+      case 'c':
+        num_commands = bench_count(optarg);
+        break;
+      case 's':
+        num_stripes = bench_count(optarg);
+        break;
+      case 'S':
+        num_shards = bench_count(optarg);
+        break;
+      case 'u':
+        distinct = bench_count(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-k keys_per_command] [-c commands] [-s stripes] [-S shards] [-u distinct_keys]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  char (*keys)[MAX_STRING_SIZE] = calloc(keys_per_command, MAX_STRING_SIZE);
+  char **values = malloc(keys_per_command * sizeof(char *));
+  if (null_fd < 0 || keys == NULL || values == NULL) {
+    fprintf(stderr, "Failed to set up the benchmark\n");
+    return 1;
+  }
+  for (size_t i = 0; i < keys_per_command; i++) {
+    values[i] = "value";
+  }
+  if (kvs_init(num_stripes, num_shards, 0, ENGINE_CHAINS) != 0) {
+    fprintf(stderr, "Failed to initialize the KVS state\n");
+    return 1;
+  }
+
+  // the keys are picked outside of the timed calls
+  uint64_t state = 7;
+  uint64_t write_time = 0;
+  for (size_t c = 0; c < num_commands; c++) {
+    pick_keys(keys, keys_per_command, distinct, &state);
+    uint64_t start = bench_now();
+    kvs_write(keys_per_command, keys, values, NULL);
+    write_time += bench_now() - start;
+  }
+  uint64_t delete_time = 0;
+  for (size_t c = 0; c < num_commands; c++) {
+    pick_keys(keys, keys_per_command, distinct, &state);
+    uint64_t start = bench_now();
+    kvs_delete(keys_per_command, keys, null_fd);
+    delete_time += bench_now() - start;
+  }
+
+  printf("%zu keys/command: write %.1f us/command, delete %.1f us/command\n", keys_per_command,
+         (double) write_time / (double) num_commands / 1000, (double) delete_time / (double) num_commands / 1000);
+  kvs_terminate();
+  free(keys);
+  free(values);
+  close(null_fd);
+  return 0;
+}
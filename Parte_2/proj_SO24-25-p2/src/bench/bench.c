@@ -0,0 +1,35 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../common/constants.h"
+
+uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+uint64_t bench_random(uint64_t *state) {
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1Dull;
+}
+
+void bench_key(char *key, size_t index) {
+  snprintf(key, MAX_STRING_SIZE, "user:profile:%08zu", index);
+}
+
+size_t bench_count(const char *arg) {
+  char *end;
+  unsigned long long count = strtoull(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || count == 0) {
+    fprintf(stderr, "Invalid count: %s\n", arg);
+    exit(1);
+  }
+  return (size_t) count;
+}
@@ -0,0 +1,31 @@
+#ifndef KVS_BENCH_H
+#define KVS_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers shared by the benchmarks in this directory. They are built with
+// `make bench` and link the objects of the server, so their timings follow
+// the flags the server is built with.
+
+/// Gets the time of the monotonic clock.
+/// @return Nanoseconds since an unspecified point.
+uint64_t bench_now();
+
+/// Advances a pseudo-random sequence, the same on every run for a seed.
+/// @param state State of the sequence, set to any value other than 0 first.
+/// @return Next number of the sequence.
+uint64_t bench_random(uint64_t *state);
+
+/// Formats the key of an index, in the shape of the keys of a real store
+/// ("user:profile:00001234"), so that keys share a long prefix.
+/// @param key Buffer of MAX_STRING_SIZE bytes.
+/// @param index Index of the key.
+void bench_key(char *key, size_t index);
+
+/// Parses a count given on the command line, exiting on a bad one.
+/// @param arg Argument to parse.
+/// @return Count, greater than 0.
+size_t bench_count(const char *arg);
+
+#endif  // KVS_BENCH_H
@@ -0,0 +1,116 @@
+// Times read_pair on a table, the path of READ and of every chain walk.
+// The lookups are of keys that share a long prefix, so that the cost of
+// comparing keys along a chain shows, and by default half of them miss.
+// The misses the Bloom filter of the table answered are counted apart.
+//
+// Usage: read_pair [-n keys] [-r reads] [-s stripes] [-m miss_percent] [-e chains|swiss] [-f]
+//   -e picks the engine of the table, chains by default.
+//   -f keeps a table of chains at its first size, for long chains.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/constants.h"
+#include "../server/kvs.h"
+#include "bench.h"
+
+// Picks the index of the key of a lookup: the stored keys are 0 to
+// num_keys - 1, and the ones past them were never written.
+static size_t pick_key(uint64_t *state, size_t num_keys, unsigned int miss_percent) {
+  uint64_t r = bench_random(state);
+  size_t index = (size_t) (r >> 8) % num_keys;
+  return r % 100 < miss_percent ? num_keys + index : index;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = 200000;
+  size_t num_reads = 4000000;
+  size_t num_stripes = 64;
+  unsigned int miss_percent = 50;
+  enum TableEngine engine = ENGINE_CHAINS;
+  int fixed_size = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:s:m:e:f")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_keys = bench_count(optarg);
+        break;
+      case 'r':
+        num_reads = bench_count(optarg);
+        break;
+      case 's':
+        num_stripes = bench_count(optarg);
+        break;
+      case 'm':
+        miss_percent = (unsigned int) strtoul(optarg, NULL, 10);
+        if (miss_percent > 100) {
+          fprintf(stderr, "Invalid miss percentage: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'e':
+        if (strcmp(optarg, "chains") == 0) {
+          engine = ENGINE_CHAINS;
+        } else if (strcmp(optarg, "swiss") == 0) {
+          engine = ENGINE_SWISS;
+        } else {
+          fprintf(stderr, "Invalid engine: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'f':
+        fixed_size = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n keys] [-r reads] [-s stripes] [-m miss_percent] [-e chains|swiss] [-f]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  HashTable *ht = create_hash_table(num_stripes, engine);
+  if (ht == NULL) {
+    fprintf(stderr, "Failed to create the table\n");
+    return 1;
+  }
+  char key[MAX_STRING_SIZE];
+  for (size_t i = 0; i < num_keys; i++) {
+    bench_key(key, i);
+    reserve_pairs(ht, 1);
+    write_pair(ht, key, "value", 0);
+    release_pairs(ht, 1);
+    if (!fixed_size) {
+      rehash_step(ht);
+    }
+  }
+  // finish the resize still under way
+  for (size_t i = 0; !fixed_size && i < num_keys; i++) {
+    rehash_step(ht);
+  }
+
+  char value[MAX_STRING_SIZE];
+  size_t hits = 0;
+  uint64_t state = 1;
+  uint64_t start = bench_now();
+  for (size_t i = 0; i < num_reads; i++) {
+    bench_key(key, pick_key(&state, num_keys, miss_percent));
+    hits += read_pair(ht, key, value, sizeof(value), NULL) == 0;
+  }
+  uint64_t elapsed = bench_now() - start;
+
+  // the same keys again without the reads, to take their formatting out
+  state = 1;
+  start = bench_now();
+  for (size_t i = 0; i < num_reads; i++) {
+    bench_key(key, pick_key(&state, num_keys, miss_percent));
+  }
+  uint64_t overhead = bench_now() - start;
+
+  double per_read = elapsed > overhead ? (double) (elapsed - overhead) / (double) num_reads : 0;
+  printf("%zu keys, %zu reads: %.1f ns/read, %zu hits, %zu misses answered by the filter\n", num_keys, num_reads,
+         per_read, hits, atomic_load(&ht->filtered));
+  free_table(ht);
+  return 0;
+}
@@ -1,7 +1,10 @@
+#include <arpa/inet.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -20,10 +23,28 @@ int running = 1;
 pthread_t notif_thread;
 
 void* print_notifications() {
-    char buffer[MAX_STRING_SIZE*2 + 3] = {0};
-    
     while (running) {
-        int result = read_all(notif_fd, buffer, sizeof(buffer), 0);
+        // each notification is its length followed by "(key,value)"
+        uint32_t len;
+        char *buffer = NULL;
+        int result = read_all(notif_fd, &len, sizeof(len), 0);
+        if (result == 1) {
+            // a longer length can only come from a broken stream
+            len = ntohl(len);
+            if (len > MAX_NOTIFICATION_SIZE) {
+                fprintf(stderr, "Notification of %u bytes is longer than allowed\n", len);
+                result = 0;
+            }
+        }
+        if (result == 1) {
+            buffer = malloc((size_t) len + 1);
+            if (!buffer) {
+                perror("Failed to allocate notification");
+                exit(1);
+            }
+            result = read_all(notif_fd, buffer, len, 0);
+            buffer[len] = '\0';
+        }
         
         // Error handling
         if (result == -1) {
@@ -42,6 +63,7 @@ void* print_notifications() {
 
         // Successfully read notification, print it
         printf("%s\n", buffer);
+        free(buffer);
     }
     
     return NULL;
@@ -58,23 +80,35 @@ char* get_operation(int op_code) {
       return "subscribe";
     case 4:
       return "unsubscribe";
+    case 5:
+      return "cas";
     default:
       return "unknown";
   }
 }
 
 void print_response() {
-  char response[7] = {0};
+  char response[MAX_STRING_SIZE] = {0};
   
   if (read_string(resp_fd, response) < 0) {
     perror("Error reading from response pipe");
   }
 
-  int op_code;
-  char response_code[5];
-  sscanf(response,"%d|%s", &op_code, response_code);
-  char* operation = get_operation(op_code); 
-  printf("Server returned %s for operation: %s\n", response_code, operation);
+  // "op_code|response_code", and cas responses also carry "|version"
+  char *code = strchr(response, '|');
+  char* operation = get_operation(atoi(response));
+  if (code == NULL) {
+    printf("Server returned an invalid response for operation: %s\n", operation);
+    return;
+  }
+  code++;
+  size_t code_len = strcspn(code, "|");
+  if (code[code_len] == '|') {
+    unsigned long long version = strtoull(code + code_len + 1, NULL, 10);
+    printf("Server returned %.*s for operation: %s, version %llu\n", (int) code_len, code, operation, version);
+  } else {
+    printf("Server returned %.*s for operation: %s\n", (int) code_len, code, operation);
+  }
 }
 
 int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
@@ -241,3 +275,39 @@ int kvs_unsubscribe(const char* key) {
   //perror(key);
   return 0;
 }
+
+int kvs_cas(const char* key, unsigned long long version, const char* value) {
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  if (key_len == 0 || key_len >= MAX_STRING_SIZE || value_len > MAX_VALUE_SIZE) {
+    fprintf(stderr, "Key or value too long for cas\n");
+    return 1;
+  }
+
+  // the request carries the lengths, then the key and the value follow it
+  char request[MAX_REQUEST_SIZE] = {0};
+  snprintf(request, MAX_REQUEST_SIZE, "5|%llu|%zu|%zu", version, key_len, value_len);
+  int result = write_all(req_fd, request, MAX_REQUEST_SIZE);
+  if (result == 1) {
+    result = write_all(req_fd, key, key_len);
+  }
+  if (result == 1) {
+    result = write_all(req_fd, value, value_len);
+  }
+
+  // write the message through the request pipe
+  if (result == -1) {
+    perror("Error writing to request pipe");
+    return 1;
+  } else if (result == -2) {
+    printf("Pipe is compromised, disconnecting client...\n");
+    close(req_fd);
+    close(resp_fd);
+    close(notif_fd);
+    exit(1);
+  }
+
+  // print response from the server
+  print_response();
+  return 0;
+}
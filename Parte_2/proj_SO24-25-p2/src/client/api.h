@@ -25,5 +25,12 @@ int kvs_subscribe(const char* key);
 /// @return 0 if the key was unsubscribed successfully  (subscription existed and was removed), 1 otherwise.
 
 int kvs_unsubscribe(const char* key);
+
+/// Writes a value only if the key is at an expected version
+/// @param key Key to be written
+/// @param version Version the key must be at, 0 if it must not exist
+/// @param value Value to be written
+/// @return 0 if the request was sent and answered, 1 otherwise.
+int kvs_cas(const char* key, unsigned long long version, const char* value);
  
 #endif  // CLIENT_API_H
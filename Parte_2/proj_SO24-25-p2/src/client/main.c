@@ -2,6 +2,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -80,6 +81,22 @@ int main(int argc, char* argv[]) {
 
         break;
 
+      case CMD_CAS: {
+        unsigned long long version;
+        char *value;
+        if (parse_cas(STDIN_FILENO, keys[0], &version, &value) != 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_cas(keys[0], version, value)) {
+            fprintf(stderr, "Command cas failed\n");
+        }
+
+        free(value);
+        break;
+      }
+
       case CMD_DELAY:
         if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
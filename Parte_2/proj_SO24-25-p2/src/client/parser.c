@@ -11,14 +11,16 @@
 // extracted, based on the KVS specification.
 // @param fd File to read from.
 // @param buffer To write the string in.
-// @param max Maximum string size.
+// @param max Maximum length of the string, not counting the null terminator.
 static int read_string(int fd, char *buffer, size_t max) {
   ssize_t bytes_read;
   char ch;
   size_t i = 0;
   int value = -1;
 
-  while (i < max) {
+  // one character more than max, so that a string of max characters is
+  // still followed by its separator
+  while (i <= max) {
     bytes_read = read(fd, &ch, 1);
 
     if (bytes_read <= 0) {
@@ -40,6 +42,10 @@ static int read_string(int fd, char *buffer, size_t max) {
       break;
     }
 
+    if (i == max) {
+      // too long
+      return -1;
+    }
     buffer[i++] = ch;
   }
 
@@ -115,6 +121,14 @@ enum Command get_next(int fd) {
 
       return CMD_UNSUBSCRIBE;
 
+    case 'C':
+      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
     case 'D':
       if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
         if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
@@ -155,7 +169,7 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t
   int output = 2;
   char key[max_string_size];
   while (num_keys < max_keys) {
-    output = read_string(fd, key, max_string_size);
+    output = read_string(fd, key, max_string_size - 1);
     if (output < 0 || output == 1) {
       cleanup(fd);
       return 0;
@@ -181,6 +195,77 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t
   return num_keys;
 }
 
+// Reads a value of any length up to MAX_VALUE_SIZE, until the ')' that
+// closes it.
+// @param fd File to read from.
+// @return The value, to be freed by the caller, or NULL if it is malformed
+//         or too long.
+static char *read_value(int fd) {
+  size_t size = MAX_STRING_SIZE;
+  size_t len = 0;
+  char *value = malloc(size);
+  char ch;
+
+  while (value != NULL) {
+    if (read(fd, &ch, 1) != 1 || ch == ' ' || ch == ',' || ch == ']' || len == MAX_VALUE_SIZE) {
+      break;
+    }
+    if (ch == ')') {
+      value[len] = '\0';
+      return value;
+    }
+    if (len + 1 == size) {
+      char *grown = realloc(value, size * 2);
+      if (!grown) {
+        break;
+      }
+      value = grown;
+      size *= 2;
+    }
+    value[len++] = ch;
+  }
+
+  free(value);
+  return NULL;
+}
+
+int parse_cas(int fd, char key[MAX_STRING_SIZE], unsigned long long *version, char **value) {
+  char ch;
+  char number[MAX_STRING_SIZE];
+
+  if (read(fd, &ch, 1) != 1 || ch != '[' || read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 1;
+  }
+
+  if (read_string(fd, key, MAX_STRING_SIZE - 1) != 0 ||
+      read_string(fd, number, MAX_STRING_SIZE - 1) != 0) {
+    cleanup(fd);
+    return 1;
+  }
+
+  char *end;
+  *version = strtoull(number, &end, 10);
+  if (number[0] < '0' || number[0] > '9' || *end != '\0') {
+    cleanup(fd);
+    return 1;
+  }
+
+  *value = read_value(fd);
+  if (*value == NULL) {
+    cleanup(fd);
+    return 1;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != ']' || read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    free(*value);
+    cleanup(fd);
+    return 1;
+  }
+
+  return 0;
+}
+
 int parse_delay(int fd, unsigned int *delay) {
   char ch;
 
@@ -9,6 +9,7 @@ enum Command {
   CMD_DISCONNECT,
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
+  CMD_CAS,
   CMD_DELAY,
   CMD_EMPTY,
   CMD_INVALID,
@@ -30,6 +31,15 @@ enum Command get_next(int fd);
 //          of keys parsed
 size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
+// Parses a CAS command with a single (key,version,value) triple.
+// @param fd File descriptor to read from.
+// @param key To store the key in.
+// @param version Pointer to the variable to store the expected version in.
+// @param value Set to the value, of up to MAX_VALUE_SIZE characters,
+//              allocated on the heap and freed by the caller.
+// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_cas(int fd, char key[MAX_STRING_SIZE], unsigned long long *version, char **value);
+
 // Parses a DELAY command.
 // @param fd File descriptor to read from.
 // @param delay Pointer to the variable to store the wait delay in.
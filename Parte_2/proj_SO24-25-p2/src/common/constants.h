@@ -3,5 +3,7 @@
 #define STATE_ACCESS_DELAY_US  // delay a aplicar no server
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
 #define MAX_STRING_SIZE 40
+#define MAX_VALUE_SIZE (1 << 20)  // tamanho max de um valor enviado num pedido CAS
+#define MAX_NOTIFICATION_SIZE (MAX_STRING_SIZE + MAX_VALUE_SIZE + 3)  // tamanho max de "(key,value)" numa notificacao
 #define MAX_NUMBER_SUB 10
 #define MAX_REQUEST_SIZE 125
\ No newline at end of file
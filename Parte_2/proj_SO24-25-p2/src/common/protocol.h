@@ -9,6 +9,18 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
   OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_CAS = 5,
 };
 
+// A CAS request is the usual fixed-size request "5|version|key_len|value_len",
+// followed by key_len bytes of key and value_len bytes of value, with no
+// separators or null terminators. key_len is below MAX_STRING_SIZE and
+// value_len at most MAX_VALUE_SIZE.
+
+// A notification is a uint32_t in network byte order with the length of the
+// message, followed by the message itself, "(key,value)", with no null
+// terminator. The length is at most MAX_NOTIFICATION_SIZE: the server never
+// sends a longer message, its values being longer than MAX_VALUE_SIZE, and a
+// client treats a longer length as a broken pipe.
+
 #endif  // COMMON_PROTOCOL_H
@@ -0,0 +1,129 @@
+#include "batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include "epoch.h"
+
+// Marks the positions of the keys that are planned, dropping the repeated
+// ones. The positions are filed in an open addressing set, keyed by hash, so
+// the work stays linear in the number of keys.
+// @param slots Array of num_slots entries, a power of two above num_keys.
+// @param kept Set to 1 for each position that is planned.
+static void drop_duplicates(char keys[][MAX_STRING_SIZE], const uint64_t hashes[], size_t num_keys,
+                            enum BatchDuplicates duplicates, size_t slots[], size_t num_slots,
+                            unsigned char kept[]) {
+    memset(slots, 0, num_slots * sizeof(size_t));
+    for (size_t n = 0; n < num_keys; n++) {
+        size_t i = duplicates == BATCH_KEEP_LAST ? num_keys - 1 - n : n;
+        size_t slot = (size_t) hashes[i] & (num_slots - 1);
+        kept[i] = 1;
+        // slots hold a position plus one, 0 marks a free slot
+        while (slots[slot] != 0) {
+            size_t other = slots[slot] - 1;
+            if (hashes[other] == hashes[i] && strcmp(keys[other], keys[i]) == 0) {
+                kept[i] = 0;
+                break;
+            }
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        if (kept[i]) {
+            slots[slot] = i + 1;
+        }
+    }
+}
+
+// Stable LSD radix sort of positions by the stripe of their keys.
+// @param tmp Array with room for num positions.
+static void sort_by_stripe(size_t positions[], size_t tmp[], size_t num, const uint64_t hashes[],
+                           size_t num_stripes) {
+    size_t mask = num_stripes - 1;
+    for (int shift = 0; (mask >> shift) != 0; shift += BATCH_RADIX_BITS) {
+        size_t count[(1 << BATCH_RADIX_BITS) + 1] = {0};
+        for (size_t i = 0; i < num; i++) {
+            count[(((size_t) hashes[positions[i]] & mask) >> shift & ((1 << BATCH_RADIX_BITS) - 1)) + 1]++;
+        }
+        for (size_t d = 0; d < (1 << BATCH_RADIX_BITS); d++) {
+            count[d + 1] += count[d];
+        }
+        for (size_t i = 0; i < num; i++) {
+            size_t digit = ((size_t) hashes[positions[i]] & mask) >> shift & ((1 << BATCH_RADIX_BITS) - 1);
+            tmp[count[digit]++] = positions[i];
+        }
+        memcpy(positions, tmp, num * sizeof(size_t));
+    }
+}
+
+int plan_batch(BatchPlan *plan, HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE],
+               enum BatchDuplicates duplicates) {
+    size_t num_slots = 1;
+    while (num_slots < 2 * num_keys) {
+        num_slots *= 2;
+    }
+
+    // everything the plan needs comes from a single allocation
+    plan->ht = ht;
+    plan->lock_words = (ht->num_stripes + 63) / 64;
+    plan->hashes = malloc(num_keys * sizeof(uint64_t) + plan->lock_words * sizeof(uint64_t) +
+                          (2 * num_keys + num_slots) * sizeof(size_t) + num_keys);
+    if (!plan->hashes) {
+        return 1;
+    }
+    plan->locks = plan->hashes + num_keys;
+    plan->order = (size_t *) (plan->locks + plan->lock_words);
+    size_t *tmp = plan->order + num_keys;
+    size_t *slots = tmp + num_keys;
+    unsigned char *kept = (unsigned char *) (slots + num_slots);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        plan->hashes[i] = hash(keys[i]);
+    }
+    if (duplicates == BATCH_KEEP_ALL) {
+        memset(kept, 1, num_keys);
+    } else {
+        drop_duplicates(keys, plan->hashes, num_keys, duplicates, slots, num_slots, kept);
+    }
+
+    plan->num_planned = 0;
+    memset(plan->locks, 0, plan->lock_words * sizeof(uint64_t));
+    for (size_t i = 0; i < num_keys; i++) {
+        if (kept[i]) {
+            size_t stripe = (size_t) plan->hashes[i] & (ht->num_stripes - 1);
+            plan->locks[stripe / 64] |= 1ULL << (stripe % 64);
+            plan->order[plan->num_planned++] = i;
+        }
+    }
+    sort_by_stripe(plan->order, tmp, plan->num_planned, plan->hashes, ht->num_stripes);
+    return 0;
+}
+
+void lock_batch(BatchPlan *plan) {
+    HashTable *ht = plan->ht;
+
+    // the chains are brought into the cache while no lock is held yet
+    epoch_enter();
+    for (size_t i = 0; i < plan->num_planned; i++) {
+        prefetch_bucket(ht, plan->hashes[plan->order[i]]);
+    }
+    epoch_exit();
+
+    for (size_t w = 0; w < plan->lock_words; w++) {
+        for (uint64_t bits = plan->locks[w]; bits != 0; bits &= bits - 1) {
+            size_t stripe = w * 64 + (size_t) __builtin_ctzll(bits);
+            pthread_rwlock_wrlock(&ht->stripes[stripe].rwlock);
+        }
+    }
+}
+
+void unlock_batch(BatchPlan *plan) {
+    HashTable *ht = plan->ht;
+    for (size_t w = 0; w < plan->lock_words; w++) {
+        for (uint64_t bits = plan->locks[w]; bits != 0; bits &= bits - 1) {
+            size_t stripe = w * 64 + (size_t) __builtin_ctzll(bits);
+            pthread_rwlock_unlock(&ht->stripes[stripe].rwlock);
+        }
+    }
+}
+
+void free_batch(BatchPlan *plan) {
+    free(plan->hashes);
+    plan->hashes = NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef KVS_BATCH_H
+#define KVS_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+#define BATCH_RADIX_BITS 8  // bits of the stripe index sorted per pass
+
+// How a plan treats a key given more than once in a command.
+enum BatchDuplicates {
+    BATCH_KEEP_ALL,    // every occurrence is planned, for commands whose pairs depend on each other
+    BATCH_KEEP_FIRST,  // only the first one, the later ones find the key gone
+    BATCH_KEEP_LAST,   // only the last one, whose value is the one that stays
+};
+
+// Execution plan of a multi-key command on the lock-based table. Each key is
+// hashed once; the planned keys are grouped by lock stripe with a radix sort
+// of the stripe indices, which is linear in the number of keys, and the
+// stripes to take are kept in a bitmap. Locks are always taken in increasing
+// stripe order, so commands cannot deadlock each other.
+typedef struct BatchPlan {
+    HashTable *ht;
+    size_t num_planned;  // keys kept by the plan
+    size_t *order;       // their positions in the command, grouped by stripe
+    uint64_t *hashes;    // hash of the key at each position of the command
+    uint64_t *locks;     // bitmap of the stripes to lock
+    size_t lock_words;   // words of the bitmap
+} BatchPlan;
+
+/// Plans a command.
+/// @param plan Plan to be filled, released with free_batch.
+/// @param ht Table the command runs on.
+/// @param num_keys Number of keys of the command.
+/// @param keys Array of keys' strings, left untouched.
+/// @param duplicates Keys kept when one is given more than once.
+/// @return 0 if the plan was made, 1 otherwise.
+int plan_batch(BatchPlan *plan, HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE],
+               enum BatchDuplicates duplicates);
+
+/// Prefetches the buckets of the planned keys and then write locks their
+/// stripes, in increasing order.
+/// @param plan Plan of the command.
+void lock_batch(BatchPlan *plan);
+
+/// Releases the locks taken by lock_batch.
+/// @param plan Plan of the command.
+void unlock_batch(BatchPlan *plan);
+
+/// Frees the memory of a plan.
+/// @param plan Plan to be freed.
+void free_batch(BatchPlan *plan);
+
+#endif  // KVS_BATCH_H
@@ -0,0 +1,96 @@
+#include "bloom.h"
+#include <limits.h>
+#include <stdlib.h>
+
+// Finds the counters of a key. The hash is mixed again first: its low bits
+// pick the bucket and the stripe of the key and its high bits the shard.
+static atomic_uchar *key_counters(BloomFilter *filter, uint64_t h, size_t offsets[BLOOM_HASHES]) {
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        offsets[i] = (size_t) (h >> (6 * i)) & (BLOOM_BLOCK - 1);
+    }
+    size_t block = (size_t) (h >> 32) & (filter->num_blocks - 1);
+    return &filter->counters[block * BLOOM_BLOCK];
+}
+
+size_t bloom_counters(size_t num_keys) {
+    size_t num_counters = BLOOM_BLOCK;
+    while (num_counters < num_keys * BLOOM_COUNTERS_PER_KEY) {
+        num_counters *= 2;
+    }
+    return num_counters;
+}
+
+BloomFilter *bloom_create(size_t num_counters) {
+    BloomFilter *filter = aligned_alloc(_Alignof(BloomFilter), sizeof(BloomFilter) + num_counters);
+    if (!filter) return NULL;
+    filter->num_blocks = num_counters / BLOOM_BLOCK;
+    atomic_init(&filter->counters_set, 0);
+    atomic_init(&filter->counters_stuck, 0);
+    for (size_t i = 0; i < num_counters; i++) {
+        atomic_init(&filter->counters[i], 0);
+    }
+    return filter;
+}
+
+void bloom_add(BloomFilter *filter, uint64_t h) {
+    size_t offsets[BLOOM_HASHES];
+    atomic_uchar *block = key_counters(filter, h, offsets);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        atomic_uchar *counter = &block[offsets[i]];
+        unsigned char count = atomic_load_explicit(counter, memory_order_relaxed);
+        while (count < UCHAR_MAX &&
+               !atomic_compare_exchange_weak_explicit(counter, &count, (unsigned char) (count + 1),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+        }
+        // count is the value before the increment, unless the counter was already stuck
+        if (count == 0) {
+            atomic_fetch_add_explicit(&filter->counters_set, 1, memory_order_relaxed);
+        } else if (count == UCHAR_MAX - 1) {
+            atomic_fetch_add_explicit(&filter->counters_stuck, 1, memory_order_relaxed);
+        }
+    }
+}
+
+void bloom_remove(BloomFilter *filter, uint64_t h) {
+    size_t offsets[BLOOM_HASHES];
+    atomic_uchar *block = key_counters(filter, h, offsets);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        atomic_uchar *counter = &block[offsets[i]];
+        unsigned char count = atomic_load_explicit(counter, memory_order_relaxed);
+        // a saturated counter no longer knows how many keys it counts
+        while (count > 0 && count < UCHAR_MAX &&
+               !atomic_compare_exchange_weak_explicit(counter, &count, (unsigned char) (count - 1),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+        }
+        if (count == 1) {
+            atomic_fetch_sub_explicit(&filter->counters_set, 1, memory_order_relaxed);
+        }
+    }
+}
+
+int bloom_may_contain(BloomFilter *filter, uint64_t h) {
+    size_t offsets[BLOOM_HASHES];
+    atomic_uchar *block = key_counters(filter, h, offsets);
+
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (atomic_load_explicit(&block[offsets[i]], memory_order_relaxed) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_stats(BloomFilter *filter, BloomStats *stats) {
+    stats->counters += filter->num_blocks * BLOOM_BLOCK;
+    stats->counters_set += atomic_load_explicit(&filter->counters_set, memory_order_relaxed);
+    stats->counters_stuck += atomic_load_explicit(&filter->counters_stuck, memory_order_relaxed);
+}
+
+void bloom_free(BloomFilter *filter) {
+    free(filter);
+}
@@ -0,0 +1,76 @@
+#ifndef KVS_BLOOM_H
+#define KVS_BLOOM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOOM_COUNTERS_PER_KEY 8  // counters per key a filter is sized for, about 2% false positives
+#define BLOOM_BLOCK 64            // counters of a block, one cache line
+#define BLOOM_HASHES 4            // counters a key maps to
+
+// Counting Bloom filter kept in front of a table, so that lookups of keys
+// that were never written, or were deleted, end before any lock or chain
+// walk. A key maps to BLOOM_HASHES counters of a single block, taken from
+// its hash, so a lookup touches one cache line. Counters are atomic and are
+// changed without locks; one that reaches its maximum stays there, which
+// only makes the filter less precise.
+//
+// A key is added before its node is published and removed after its node is
+// unlinked, so the filter never rules out a key that a lookup could find.
+//
+// A filter is sized for the keys its table holds before it grows, and is
+// replaced by a larger one whenever the table grows. Between two rebuilds a
+// filter past the keys it was sized for answers fewer and fewer lookups.
+// STATS reports the counters that are set and the ones stuck at their
+// maximum, so that a filter that saturated can be told apart.
+typedef struct BloomFilter {
+    size_t num_blocks;                   // power of two
+    atomic_size_t counters_set;          // counters other than 0
+    atomic_size_t counters_stuck;        // counters that reached their maximum and stay there
+    _Alignas(BLOOM_BLOCK) atomic_uchar counters[];
+} BloomFilter;
+
+typedef struct BloomStats {
+    size_t counters;        // counters of the filters
+    size_t counters_set;    // counters other than 0, each a key may map to
+    size_t counters_stuck;  // counters that no longer go down
+} BloomStats;
+
+/// Gets the number of counters of a filter for a number of keys.
+/// @param num_keys Number of keys the filter is expected to hold.
+/// @return At least BLOOM_COUNTERS_PER_KEY counters per key, a power of two
+/// multiple of BLOOM_BLOCK.
+size_t bloom_counters(size_t num_keys);
+
+/// Creates an empty filter.
+/// @param num_counters Number of counters, a power of two multiple of BLOOM_BLOCK.
+/// @return Newly created filter, NULL on failure.
+BloomFilter *bloom_create(size_t num_counters);
+
+/// Adds a key to the filter.
+/// @param filter Filter to be modified.
+/// @param h Hash of the key.
+void bloom_add(BloomFilter *filter, uint64_t h);
+
+/// Removes a key added before.
+/// @param filter Filter to be modified.
+/// @param h Hash of the key.
+void bloom_remove(BloomFilter *filter, uint64_t h);
+
+/// Checks whether a key may have been added.
+/// @param filter Filter to be checked.
+/// @param h Hash of the key.
+/// @return 0 if the key is certainly not in the filter, 1 otherwise.
+int bloom_may_contain(BloomFilter *filter, uint64_t h);
+
+/// Adds the usage counters of a filter to stats.
+/// @param filter Filter to be looked at.
+/// @param stats Structure the counters are added to.
+void bloom_stats(BloomFilter *filter, BloomStats *stats);
+
+/// Frees a filter.
+/// @param filter Filter to be freed.
+void bloom_free(BloomFilter *filter);
+
+#endif  // KVS_BLOOM_H
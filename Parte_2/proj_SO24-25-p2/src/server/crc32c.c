@@ -0,0 +1,48 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78u  // reversed Castagnoli polynomial
+
+// tables[k][b] is the checksum of byte b followed by k zero bytes
+static uint32_t tables[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables() {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        tables[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = tables[k - 1][b];
+            tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&tables_once, build_tables);
+    const unsigned char *p = data;
+    crc = ~crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        // little endian: the first byte is the lowest one
+        word ^= crc;
+        crc = tables[7][word & 0xff] ^ tables[6][(word >> 8) & 0xff] ^
+              tables[5][(word >> 16) & 0xff] ^ tables[4][(word >> 24) & 0xff] ^
+              tables[3][(word >> 32) & 0xff] ^ tables[2][(word >> 40) & 0xff] ^
+              tables[1][(word >> 48) & 0xff] ^ tables[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
@@ -0,0 +1,17 @@
+#ifndef KVS_CRC32C_H
+#define KVS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of the records the server writes to disk, computed
+// eight bytes at a time with sliced lookup tables.
+
+/// Extends a checksum with more data.
+/// @param crc Checksum of the data before, 0 to start a new one.
+/// @param data Data to add.
+/// @param len Number of bytes of data.
+/// @return Checksum of all the data.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif  // KVS_CRC32C_H
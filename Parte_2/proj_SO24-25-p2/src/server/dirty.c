@@ -0,0 +1,91 @@
+#include "dirty.h"
+#include <stdlib.h>
+#include <string.h>
+
+static DirtySlot ring[DIRTY_LOG_SIZE];
+static _Atomic uint64_t head = 0;
+static atomic_int enabled = 0;
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+void dirty_enable() {
+    atomic_store(&enabled, 1);
+}
+
+void dirty_add(const char *key) {
+    // nothing to log until the first backup
+    if (!atomic_load(&enabled)) {
+        return;
+    }
+
+    uint64_t position = atomic_fetch_add(&head, 1);
+    DirtySlot *slot = &ring[position & (DIRTY_LOG_SIZE - 1)];
+    uint64_t published = (position + 1) << 1;
+    uint64_t seen = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    while (1) {
+        if (seen >> 1 > position + 1) {
+            // a later change already has the slot, this one is lost
+            return;
+        }
+        if (seen & 1) {
+            // an earlier change that wrapped onto the slot is filling it
+            seen = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(&slot->sequence, &seen, published | 1, memory_order_acquire,
+                                                         memory_order_relaxed)) {
+            break;
+        }
+    }
+    // the key is written only once readers can see the slot is busy
+    atomic_thread_fence(memory_order_release);
+    strncpy(slot->key, key, MAX_STRING_SIZE - 1);
+    slot->key[MAX_STRING_SIZE - 1] = '\0';
+    atomic_store_explicit(&slot->sequence, published, memory_order_release);
+}
+
+uint64_t dirty_position() {
+    return atomic_load(&head);
+}
+
+int dirty_collect(uint64_t from, uint64_t to, char (**keys)[MAX_STRING_SIZE], size_t *count) {
+    if (to - from > DIRTY_LOG_SIZE) {
+        return 1;
+    }
+
+    char (*collected)[MAX_STRING_SIZE] = malloc((to - from + 1) * MAX_STRING_SIZE);
+    if (!collected) {
+        return 1;
+    }
+    size_t num_keys = 0;
+    for (uint64_t position = from; position < to; position++) {
+        DirtySlot *slot = &ring[position & (DIRTY_LOG_SIZE - 1)];
+        uint64_t published = (position + 1) << 1;
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != published) {
+            // overwritten by a later change, or still being filled
+            free(collected);
+            return 1;
+        }
+        memcpy(collected[num_keys], slot->key, MAX_STRING_SIZE);
+        // a writer that took the slot during the copy changed its sequence
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != published) {
+            free(collected);
+            return 1;
+        }
+        collected[num_keys++][MAX_STRING_SIZE - 1] = '\0';
+    }
+
+    // a key changed many times is only written once
+    qsort(collected, num_keys, MAX_STRING_SIZE, compare_keys);
+    size_t unique = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        if (unique == 0 || strcmp(collected[unique - 1], collected[i]) != 0) {
+            memmove(collected[unique++], collected[i], MAX_STRING_SIZE);
+        }
+    }
+
+    *keys = collected;
+    *count = unique;
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef KVS_DIRTY_H
+#define KVS_DIRTY_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+
+#define DIRTY_LOG_SIZE (1 << 16)  // changes the log remembers (power of two)
+
+// Log of the keys changed since the server started, so that a backup only
+// has to write the keys changed since the previous one. Every change of a key
+// takes the next position of a ring; once the ring wraps around, the oldest
+// positions are lost and a backup that needed them has to be a full one.
+//
+// A key is logged after its change is visible in the table and before its
+// stripe is unlocked, so a backup that reads the log position with the tables
+// locked sees exactly the changes before it.
+// Writers claim a position with one atomic increment. Each slot is a
+// seqlock: a writer takes it by marking its sequence busy, fills the key and
+// publishes it with release semantics, so two writers whose positions wrap
+// onto the same slot never fill it at once, and the older one gives up once
+// the newer one has it. A reader checks the sequence before and after
+// copying the key; a slot that is busy, or changed while it was copied, reads
+// as lost.
+typedef struct DirtySlot {
+    _Atomic uint64_t sequence;           // position the slot holds, plus 1, times 2; plus 1 while busy
+    char key[MAX_STRING_SIZE];
+} DirtySlot;
+
+/// Starts logging changes. Changes before this call are not logged, so the
+/// first backup after it must be a full one.
+void dirty_enable();
+
+/// Logs the change of a key, if logging is enabled.
+/// @param key Key that was written or removed.
+void dirty_add(const char *key);
+
+/// Gets the position the next change will take.
+/// @return Number of changes logged so far.
+uint64_t dirty_position();
+
+/// Gets the keys changed between two positions, sorted and without repeats.
+/// @param from First position.
+/// @param to Position after the last one.
+/// @param keys Set to an array of keys to be freed by the caller.
+/// @param count Set to the number of keys.
+/// @return 0 on success, 1 if some position was lost or on failure.
+int dirty_collect(uint64_t from, uint64_t to, char (**keys)[MAX_STRING_SIZE], size_t *count);
+
+#endif  // KVS_DIRTY_H
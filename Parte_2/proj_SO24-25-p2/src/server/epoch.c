@@ -0,0 +1,162 @@
+#include "epoch.h"
+#include "slab.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// retire calls between two attempts to advance the global epoch
+#define EPOCH_COLLECT_EVERY 64
+
+typedef struct Retired {
+    void *ptr;
+    void (*release)(void *ptr);
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+// Per-thread state. Records are never freed: a thread that exits gives its
+// record back and the next thread to register reuses it.
+typedef struct EpochRecord {
+    _Alignas(64) atomic_uint_fast64_t state;  // (epoch << 1) | active
+    atomic_int in_use;
+    unsigned int nesting;
+    unsigned int retired_since_collect;
+    Retired *head;                            // oldest retired object
+    Retired *tail;
+    struct EpochRecord *next;
+} EpochRecord;
+
+static atomic_uint_fast64_t global_epoch = 2;
+static _Atomic(EpochRecord *) records = NULL;
+static _Thread_local EpochRecord *self = NULL;
+
+static EpochRecord *get_record() {
+    if (self != NULL) {
+        return self;
+    }
+
+    // reuse the record of a thread that has exited
+    for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+        int expected = 0;
+        if (atomic_load(&r->in_use) == 0 && atomic_compare_exchange_strong(&r->in_use, &expected, 1)) {
+            self = r;
+            return self;
+        }
+    }
+
+    EpochRecord *r = aligned_alloc(_Alignof(EpochRecord), sizeof(EpochRecord));
+    if (!r) {
+        perror("Failed to allocate epoch record");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&r->state, 0);
+    atomic_init(&r->in_use, 1);
+    r->nesting = 0;
+    r->retired_since_collect = 0;
+    r->head = NULL;
+    r->tail = NULL;
+    r->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &r->next, r)) {
+    }
+    self = r;
+    return self;
+}
+
+void epoch_enter() {
+    EpochRecord *r = get_record();
+    if (r->nesting++ > 0) {
+        return;
+    }
+    // seq_cst store: an advancing thread either sees us active or we see its new epoch
+    atomic_store(&r->state, (atomic_load(&global_epoch) << 1) | 1);
+}
+
+void epoch_exit() {
+    EpochRecord *r = self;
+    if (--r->nesting > 0) {
+        return;
+    }
+    atomic_store_explicit(&r->state, 0, memory_order_release);
+}
+
+// Moves the global epoch forward if every active thread has observed it.
+static void try_advance() {
+    uint_fast64_t epoch = atomic_load(&global_epoch);
+
+    for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+        uint_fast64_t state = atomic_load(&r->state);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// Releases the objects retired at least two epochs ago: no critical section
+// that started before they were unlinked can still be running.
+static void collect(EpochRecord *r) {
+    uint_fast64_t epoch = atomic_load(&global_epoch);
+
+    while (r->head != NULL && r->head->epoch + 2 <= epoch) {
+        Retired *item = r->head;
+        r->head = item->next;
+        item->release(item->ptr);
+        slab_free(item);
+    }
+    if (r->head == NULL) {
+        r->tail = NULL;
+    }
+}
+
+void epoch_retire(void *ptr, void (*release)(void *ptr)) {
+    EpochRecord *r = get_record();
+    Retired *item = slab_alloc(sizeof(Retired));
+    if (!item) {
+        perror("Failed to retire object");
+        exit(EXIT_FAILURE);
+    }
+    item->ptr = ptr;
+    item->release = release;
+    item->epoch = atomic_load(&global_epoch);
+    item->next = NULL;
+    if (r->tail == NULL) {
+        r->head = item;
+    } else {
+        r->tail->next = item;
+    }
+    r->tail = item;
+
+    if (++r->retired_since_collect >= EPOCH_COLLECT_EVERY) {
+        r->retired_since_collect = 0;
+        try_advance();
+        collect(r);
+    }
+}
+
+void epoch_synchronize() {
+    EpochRecord *r = get_record();
+    uint_fast64_t target = atomic_load(&global_epoch) + 2;
+
+    while (atomic_load(&global_epoch) < target) {
+        try_advance();
+        if (atomic_load(&global_epoch) < target) {
+            sched_yield();
+        }
+    }
+    collect(r);
+}
+
+void epoch_thread_exit() {
+    if (self == NULL) {
+        return;
+    }
+    while (self->head != NULL) {
+        epoch_synchronize();
+    }
+    atomic_store(&self->state, 0);
+    atomic_store(&self->in_use, 0);
+    self = NULL;
+}
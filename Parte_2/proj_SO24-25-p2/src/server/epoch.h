@@ -0,0 +1,32 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+#include <stddef.h>
+
+// Epoch-based reclamation.
+// Readers wrap their accesses to shared nodes in epoch_enter/epoch_exit and
+// never block. Writers unlink nodes while holding their locks and hand them
+// to epoch_retire, which frees them only after every reader that could still
+// see them has left its critical section.
+
+/// Enters a read-side critical section. Sections may be nested.
+void epoch_enter();
+
+/// Leaves a read-side critical section.
+void epoch_exit();
+
+/// Defers the release of an unlinked object until no reader can reach it.
+/// @param ptr Object to be released.
+/// @param release Function that releases the object.
+void epoch_retire(void *ptr, void (*release)(void *ptr));
+
+/// Waits until every critical section running when it was called has ended,
+/// then releases the objects this thread retired before the call.
+/// Must not be called inside a critical section.
+void epoch_synchronize();
+
+/// Releases the state of the calling thread. Called by threads that exit
+/// while the server keeps running.
+void epoch_thread_exit();
+
+#endif  // KVS_EPOCH_H
@@ -0,0 +1,224 @@
+#include "expiry.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "epoch.h"
+#include "slab.h"
+
+typedef struct Timer {
+    char key[MAX_STRING_SIZE];
+    uint64_t version;     // version the key must still be at
+    uint64_t deadline;    // tick the timer fires at
+    struct Timer *next;
+} Timer;
+
+static Timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static Timer *overflow = NULL;   // timers beyond the span of the wheel
+static uint64_t wheel_tick = 0;  // last tick processed
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t expiry_thread;
+static int started = 0;
+static atomic_int stopping = 0;
+static atomic_size_t pending = 0;
+static atomic_size_t removed = 0;
+static expire_fn expire_keys = NULL;
+static struct timespec start_time;
+
+static uint64_t current_tick() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ms = (int64_t) (now.tv_sec - start_time.tv_sec) * 1000 +
+                 (now.tv_nsec - start_time.tv_nsec) / 1000000;
+    return (uint64_t) ms / EXPIRY_TICK_MS;
+}
+
+// Files a timer in the lowest level whose slots tell its deadline apart from
+// the current tick. Must be called with wheel_mutex held.
+static void place_timer(Timer *timer) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * (level + 1);
+        if ((timer->deadline >> shift) == (wheel_tick >> shift)) {
+            size_t slot = (timer->deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            timer->next = wheel[level][slot];
+            wheel[level][slot] = timer;
+            return;
+        }
+    }
+    timer->next = overflow;
+    overflow = timer;
+}
+
+// Files again every timer of a list, one level down where possible.
+static void cascade(Timer **list) {
+    Timer *timer = *list;
+    *list = NULL;
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        place_timer(timer);
+        timer = next;
+    }
+}
+
+// Moves the wheel to the next tick and appends the timers due at it to due.
+// Must be called with wheel_mutex held.
+static void advance_wheel(Timer **due) {
+    wheel_tick++;
+
+    if ((wheel_tick & ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)) == 0) {
+        cascade(&overflow);
+    }
+    // higher levels first, so that their timers can drop all the way down
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        if ((wheel_tick & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0) {
+            cascade(&wheel[level][(wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)]);
+        }
+    }
+
+    Timer **slot = &wheel[0][wheel_tick & (WHEEL_SLOTS - 1)];
+    while (*slot != NULL) {
+        Timer *timer = *slot;
+        *slot = timer->next;
+        timer->next = *due;
+        *due = timer;
+    }
+}
+
+// Hands the keys of the fired timers to the expire function, a batch at a
+// time, and frees the timers.
+static void fire_timers(Timer *due) {
+    char keys[EXPIRY_BATCH][MAX_STRING_SIZE];
+    uint64_t versions[EXPIRY_BATCH];
+
+    while (due != NULL) {
+        size_t count = 0;
+        while (due != NULL && count < EXPIRY_BATCH) {
+            Timer *timer = due;
+            due = timer->next;
+            memcpy(keys[count], timer->key, MAX_STRING_SIZE);
+            versions[count++] = timer->version;
+            slab_free(timer);
+        }
+        atomic_fetch_sub(&pending, count);
+        atomic_fetch_add(&removed, expire_keys(count, keys, versions));
+    }
+}
+
+static void *run_expiry(void *arg) {
+    (void) arg;
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = EXPIRY_TICK_MS * 1000000L};
+
+    while (!atomic_load(&stopping)) {
+        nanosleep(&tick, NULL);
+
+        Timer *due = NULL;
+        uint64_t target = current_tick();
+        pthread_mutex_lock(&wheel_mutex);
+        while (wheel_tick < target) {
+            advance_wheel(&due);
+        }
+        pthread_mutex_unlock(&wheel_mutex);
+
+        fire_timers(due);
+    }
+
+    epoch_thread_exit();
+    slab_thread_exit();
+    return NULL;
+}
+
+int expiry_start(expire_fn expire) {
+    if (started) {
+        return 1;
+    }
+
+    expire_keys = expire;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    wheel_tick = 0;
+    atomic_store(&stopping, 0);
+    if (pthread_create(&expiry_thread, NULL, run_expiry, NULL) != 0) {
+        return 1;
+    }
+    started = 1;
+    return 0;
+}
+
+void expiry_stop() {
+    if (!started) {
+        return;
+    }
+
+    atomic_store(&stopping, 1);
+    pthread_join(expiry_thread, NULL);
+
+    // the thread is gone, so the wheel is no longer shared
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            while (wheel[level][slot] != NULL) {
+                Timer *timer = wheel[level][slot];
+                wheel[level][slot] = timer->next;
+                slab_free(timer);
+            }
+        }
+    }
+    while (overflow != NULL) {
+        Timer *timer = overflow;
+        overflow = timer->next;
+        slab_free(timer);
+    }
+    atomic_store(&pending, 0);
+    started = 0;
+}
+
+int expiry_add(const char *key, uint64_t version, unsigned int ttl_ms) {
+    Timer *timer = slab_alloc(sizeof(Timer));
+    if (!timer) return 1;
+    strncpy(timer->key, key, MAX_STRING_SIZE - 1);
+    timer->key[MAX_STRING_SIZE - 1] = '\0';
+    timer->version = version;
+
+    // rounded up, and the current tick may already be partly over, so that a
+    // key never expires before its TTL
+    uint64_t ticks = (ttl_ms + EXPIRY_TICK_MS - 1) / EXPIRY_TICK_MS;
+    timer->deadline = current_tick() + ticks + 1;
+
+    pthread_mutex_lock(&wheel_mutex);
+    if (timer->deadline <= wheel_tick) {
+        timer->deadline = wheel_tick + 1;
+    }
+    place_timer(timer);
+    atomic_fetch_add(&pending, 1);
+    pthread_mutex_unlock(&wheel_mutex);
+    return 0;
+}
+
+// Milliseconds since the Epoch.
+static uint64_t wall_clock_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+uint64_t expiry_deadline(unsigned int ttl_ms) {
+    return ttl_ms > 0 ? wall_clock_ms() + ttl_ms : 0;
+}
+
+unsigned int expiry_time_left(uint64_t deadline) {
+    uint64_t now = wall_clock_ms();
+    if (deadline <= now) {
+        return 0;
+    }
+    return deadline - now > UINT_MAX ? UINT_MAX : (unsigned int) (deadline - now);
+}
+
+size_t expiry_pending() {
+    return atomic_load(&pending);
+}
+
+size_t expiry_removed() {
+    return atomic_load(&removed);
+}
@@ -0,0 +1,65 @@
+#ifndef KVS_EXPIRY_H
+#define KVS_EXPIRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+
+#define EXPIRY_TICK_MS 10  // resolution of the timers
+#define WHEEL_BITS 6       // each level of the wheel has 2^WHEEL_BITS slots
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4     // the wheel spans 2^24 ticks, about 46 hours
+#define EXPIRY_BATCH 64    // keys handed to the expire function at a time
+
+// Expiry of keys written with a TTL. Timers live in a hierarchical timer
+// wheel: level l holds the timers due in the next 64^(l+1) ticks, in the slot
+// given by the l-th group of bits of their deadline. A background thread
+// advances the wheel one tick at a time, moving the timers of a higher level
+// down when the lower level wraps around, so each tick only touches the
+// timers that are due or about to be. Timers further away than the wheel
+// spans wait in an overflow list.
+//
+// A timer remembers the version its write gave the key; a key written or
+// deleted again since then is left alone when the timer fires.
+
+/// Function that removes expired keys.
+/// @param num_keys Number of keys.
+/// @param keys Array of keys' strings.
+/// @param versions Array with the version each key must still be at.
+/// @return Number of keys removed.
+typedef size_t (*expire_fn)(size_t num_keys, char keys[][MAX_STRING_SIZE], uint64_t versions[]);
+
+/// Starts the expiry thread.
+/// @param expire Function called with the keys whose timers fire.
+/// @return 0 on success, 1 otherwise.
+int expiry_start(expire_fn expire);
+
+/// Stops the expiry thread and drops the pending timers.
+void expiry_stop();
+
+/// Schedules the expiry of a key.
+/// @param key Key to expire.
+/// @param version Version the write gave the key.
+/// @param ttl_ms Time to live of the key, in milliseconds.
+/// @return 0 on success, 1 otherwise.
+int expiry_add(const char *key, uint64_t version, unsigned int ttl_ms);
+
+/// Gets the wall clock time at which a TTL given now runs out. The write-ahead
+/// log keeps this time rather than the TTL, since the timers do not outlive
+/// the server.
+/// @param ttl_ms Time to live, in milliseconds.
+/// @return Milliseconds since the Epoch, 0 for a TTL of 0.
+uint64_t expiry_deadline(unsigned int ttl_ms);
+
+/// Gets the time left until a deadline given by expiry_deadline.
+/// @param deadline Milliseconds since the Epoch.
+/// @return Milliseconds left, 0 if the deadline has passed.
+unsigned int expiry_time_left(uint64_t deadline);
+
+/// Gets the number of timers that have not fired yet.
+size_t expiry_pending();
+
+/// Gets the number of keys removed by the expiry thread.
+size_t expiry_removed();
+
+#endif  // KVS_EXPIRY_H
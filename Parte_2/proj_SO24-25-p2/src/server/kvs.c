@@ -1,180 +1,1437 @@
 #include "kvs.h"
+#include "dirty.h"
+#include "epoch.h"
+#include "notify.h"
+#include "slab.h"
+#include "swiss.h"
+#include "wal.h"
 #include "../common/constants.h"
 #include "../common/io.h"
 #include "operations.h"
 #include "string.h"
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <time.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+// FNV-1a over the whole key, followed by a final mix so that the low bits
+// used to pick buckets and locks depend on every byte of the key.
+// @param key Null terminated string.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+uint64_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-struct HashTable* create_hash_table() {
+size_t stripe_index(HashTable *ht, const char *key) {
+    return (size_t) (hash(key) & (ht->num_stripes - 1));
+}
+
+static Buckets *create_buckets(size_t size) {
+    Buckets *buckets = malloc(sizeof(Buckets) + size * sizeof(_Atomic(KeyNode *)));
+    if (!buckets) return NULL;
+    buckets->size = size;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&buckets->heads[i], NULL);
+    }
+    return buckets;
+}
+
+static IndexNode *create_index_node(const char *key, int levels) {
+    IndexNode *indexNode = slab_alloc(sizeof(IndexNode) + (size_t) levels * sizeof(_Atomic(IndexNode *)));
+    if (!indexNode) return NULL;
+    strncpy(indexNode->key, key, MAX_STRING_SIZE - 1);
+    indexNode->key[MAX_STRING_SIZE - 1] = '\0';
+    indexNode->levels = levels;
+    for (int i = 0; i < levels; i++) {
+        atomic_init(&indexNode->next[i], NULL);
+    }
+    return indexNode;
+}
+
+struct HashTable* create_hash_table(size_t num_stripes, enum TableEngine engine) {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      pthread_rwlock_init(&ht->rwlock[i], NULL);
-      ht->table[i] = NULL;
+
+  ht->num_stripes = 1;
+  while (ht->num_stripes < num_stripes && ht->num_stripes < MAX_STRIPES) {
+      ht->num_stripes *= 2;
+  }
+  size_t size = ht->num_stripes > TABLE_SIZE ? ht->num_stripes : TABLE_SIZE;
+
+  Buckets *table = NULL;
+  SwissTable *swiss = NULL;
+  if (engine == ENGINE_SWISS) {
+      swiss = swiss_create(SWISS_MIN_SLOTS);
+  } else {
+      table = create_buckets(size);
+  }
+  ht->stripes = aligned_alloc(_Alignof(Stripe), ht->num_stripes * sizeof(Stripe));
+  ht->index = malloc(sizeof(IndexNode) + INDEX_LEVELS * sizeof(_Atomic(IndexNode *)));
+  // sized for the keys the table holds before it first grows
+  size_t capacity = engine == ENGINE_SWISS ? SWISS_MIN_SLOTS * SWISS_MAX_LOAD / 8 : size * MAX_LOAD_FACTOR;
+  BloomFilter *filter = bloom_create(bloom_counters(capacity));
+  atomic_init(&ht->filter, filter);
+  ht->next_filter = NULL;
+  ht->subs = subs_create();
+  if ((!table && !swiss) || !ht->stripes || !ht->index || !filter || !ht->subs) {
+      free(table);
+      free(swiss);
+      free(ht->stripes);
+      free(ht->index);
+      bloom_free(filter);
+      if (ht->subs) {
+          subs_free(ht->subs);
+      }
+      free(ht);
+      return NULL;
+  }
+  ht->index->key[0] = '\0';
+  ht->index->levels = INDEX_LEVELS;
+  for (int i = 0; i < INDEX_LEVELS; i++) {
+      atomic_init(&ht->index->next[i], NULL);
+  }
+  pthread_mutex_init(&ht->index_mutex, NULL);
+  ht->engine = engine;
+  atomic_init(&ht->swiss, swiss);
+  atomic_init(&ht->reserved, 0);
+  atomic_init(&ht->table, table);
+  atomic_init(&ht->old_table, NULL);
+  atomic_init(&ht->rehash_left, 0);
+  atomic_init(&ht->scanners, 0);
+  atomic_init(&ht->rehash_hint, 0);
+  atomic_init(&ht->count, 0);
+  atomic_init(&ht->grow_at, size * MAX_LOAD_FACTOR);
+  atomic_init(&ht->resizing, 0);
+  atomic_init(&ht->version, 0);
+  atomic_init(&ht->resident, 0);
+  ht->max_bytes = 0;
+  ht->owned = 0;
+  atomic_init(&ht->clock_hand, 0);
+  atomic_init(&ht->evictions, 0);
+  atomic_init(&ht->filtered, 0);
+  ht->views = NULL;
+  for (size_t i = 0; i < ht->num_stripes; i++) {
+      pthread_rwlock_init(&ht->stripes[i].rwlock, NULL);
+      ht->stripes[i].rehash_cursor = 0;
   }
   return ht;
 }
 
-void notify_clients(int fds[], const char *key, const char* value) {
-    char message[MAX_STRING_SIZE*2 + 3] = {0};
-    snprintf(message, MAX_STRING_SIZE*2 + 3, "(%s,%s)", key, value);
+static inline KeyNode *load_next(KeyNode *keyNode) {
+    return atomic_load_explicit(&keyNode->next, memory_order_acquire);
+}
+
+static inline KeyNode *load_head(Buckets *buckets, uint64_t h) {
+    return atomic_load_explicit(&buckets->heads[h & (buckets->size - 1)], memory_order_acquire);
+}
 
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (fds[i] > 0) {
-            write_all(fds[i], message, sizeof(message));
+// Bytes taken by a value of a given length.
+static inline size_t value_size(size_t len) {
+    return sizeof(Value) + len + 1;
+}
+
+// Copies a value into a slab object, or into a buffer of its own if it does
+// not fit in one. The copy is null terminated.
+static Value *copy_value(const char *value, size_t len, uint64_t deadline) {
+    size_t size = value_size(len);
+    Value *copy = size <= SLAB_MAX_SIZE ? slab_alloc(size) : malloc(size);
+    if (copy) {
+        copy->len = len;
+        copy->deadline = deadline;
+        memcpy(copy->data, value, len);
+        copy->data[len] = '\0';
+    }
+    return copy;
+}
+
+static void free_value(void *ptr) {
+    Value *value = ptr;
+    if (value != NULL && value_size(value->len) > SLAB_MAX_SIZE) {
+        free(value);
+    } else {
+        slab_free(value);
+    }
+}
+
+// Frees a node and its value.
+static void release_node(void *ptr) {
+    KeyNode *keyNode = ptr;
+    free_value(atomic_load_explicit(&keyNode->value, memory_order_relaxed));
+    slab_free(keyNode);
+}
+
+// Frees a node whose value was handed over to a copy.
+static void release_node_shell(void *ptr) {
+    slab_free(ptr);
+}
+
+static KeyNode *create_node(const char *key, uint64_t h, Value *value, uint64_t version, KeyNode *next) {
+    KeyNode *keyNode = slab_alloc(sizeof(KeyNode));
+    if (!keyNode) return NULL;
+    keyNode->hash = h;
+    keyNode->key_len = strnlen(key, MAX_STRING_SIZE - 1);
+    memcpy(keyNode->key, key, keyNode->key_len);
+    keyNode->key[keyNode->key_len] = '\0';
+    atomic_init(&keyNode->value, value);
+    keyNode->version = version;
+    atomic_init(&keyNode->referenced, 1);
+    atomic_init(&keyNode->next, next);
+    return keyNode;
+}
+
+// Copies every node of an old bucket into the current table, then unlinks the
+// old chain. Nodes are copied rather than moved so that a reader walking the
+// old chain never gets diverted into a chain of the new table. The copies are
+// all made before any is linked, so a failed allocation leaves both tables
+// as they were and the bucket can be migrated by a later step.
+// Must be called with the write lock of the bucket's stripe held.
+// @param ht Hash table being resized.
+// @param old Array being drained.
+// @param index Index of the bucket in old.
+// @return 0 on success, 1 if the copies could not be allocated.
+static int migrate_bucket(HashTable *ht, Buckets *old, size_t index) {
+    Buckets *table = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    KeyNode *first = atomic_load_explicit(&old->heads[index], memory_order_relaxed);
+
+    // the copies are chained through their next links until they are placed
+    KeyNode *copies = NULL;
+    for (KeyNode *keyNode = first; keyNode != NULL; keyNode = load_next(keyNode)) {
+        KeyNode *copy = create_node(keyNode->key, keyNode->hash, atomic_load_explicit(&keyNode->value, memory_order_relaxed),
+                                    keyNode->version, copies);
+        if (!copy) {
+            while (copies != NULL) {
+                KeyNode *next = load_next(copies);
+                release_node_shell(copies);
+                copies = next;
+            }
+            return 1;
         }
+        atomic_store_explicit(&copy->referenced, atomic_load_explicit(&keyNode->referenced, memory_order_relaxed),
+                              memory_order_relaxed);
+        copies = copy;
     }
+
+    while (copies != NULL) {
+        KeyNode *copy = copies;
+        copies = load_next(copy);
+        // the filter of the new array holds the nodes that are in it
+        if (ht->next_filter != NULL) {
+            bloom_add(ht->next_filter, copy->hash);
+        }
+        _Atomic(KeyNode *) *head = &table->heads[copy->hash & (table->size - 1)];
+        atomic_store_explicit(&copy->next, atomic_load_explicit(head, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(head, copy, memory_order_release);
+    }
+    atomic_store_explicit(&old->heads[index], NULL, memory_order_release);
+
+    while (first != NULL) {
+        KeyNode *next = load_next(first);
+        epoch_retire(first, release_node_shell);
+        first = next;
+    }
+    return 0;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            notify_clients(keyNode->client_fds, key, value);
-            return 0;
+// Where find_node found a node: the link that points to it in a chain, or
+// its slot in a swiss table.
+typedef struct NodeLink {
+    _Atomic(KeyNode *) *prev;
+    SwissSlot *slot;
+    int in_old;                          // 1 if the node is in old_table
+} NodeLink;
+
+// Looks for a key in old_table (if a resize is running) and in the table, or
+// in the slots of a swiss table. Nodes are told apart by their hash and
+// length first; the bytes are only compared when both match.
+// @param link If not NULL, set to where the node was found.
+static KeyNode *find_node(HashTable *ht, const char *key, uint64_t h, NodeLink *link) {
+    if (ht->engine == ENGINE_SWISS) {
+        SwissSlot *slot = swiss_find(atomic_load_explicit(&ht->swiss, memory_order_acquire), key, h);
+        if (slot == NULL) {
+            return NULL;
+        }
+        if (link != NULL) {
+            link->slot = slot;
+            link->in_old = 0;
+        }
+        return slot->node;
+    }
+
+    size_t len = strlen(key);
+    // table is loaded first: it is published after old_table when a resize starts
+    Buckets *table = atomic_load_explicit(&ht->table, memory_order_acquire);
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_acquire);
+    Buckets *arrays[2] = {old, table};
+
+    for (int i = 0; i < 2; i++) {
+        if (arrays[i] == NULL) {
+            continue;
+        }
+        _Atomic(KeyNode *) *prev = &arrays[i]->heads[h & (arrays[i]->size - 1)];
+        KeyNode *keyNode = atomic_load_explicit(prev, memory_order_acquire);
+        while (keyNode != NULL) {
+            if (keyNode->hash == h && keyNode->key_len == len && memcmp(keyNode->key, key, len) == 0) {
+                if (link != NULL) {
+                    link->prev = prev;
+                    link->slot = NULL;
+                    link->in_old = arrays[i] == old;
+                }
+                return keyNode;
+            }
+            prev = &keyNode->next;
+            keyNode = load_next(keyNode);
+        }
+    }
+    return NULL;
+}
+
+void prefetch_bucket(HashTable *ht, uint64_t h) {
+    if (ht->engine == ENGINE_SWISS) {
+        swiss_prefetch(atomic_load_explicit(&ht->swiss, memory_order_acquire), h);
+        return;
+    }
+    Buckets *table = atomic_load_explicit(&ht->table, memory_order_acquire);
+    _Atomic(KeyNode *) *head = &table->heads[h & (table->size - 1)];
+    __builtin_prefetch(head);
+    __builtin_prefetch(atomic_load_explicit(head, memory_order_relaxed));
+}
+
+// The stripe locks below are skipped for an owned table, which only its
+// owner thread ever touches.
+static int try_lock_stripe(HashTable *ht, Stripe *stripe) {
+    return ht->owned ? 0 : pthread_rwlock_trywrlock(&stripe->rwlock);
+}
+
+static void read_lock_stripe(HashTable *ht, Stripe *stripe) {
+    if (!ht->owned) {
+        pthread_rwlock_rdlock(&stripe->rwlock);
+    }
+}
+
+static void unlock_stripe(HashTable *ht, Stripe *stripe) {
+    if (!ht->owned) {
+        pthread_rwlock_unlock(&stripe->rwlock);
+    }
+}
+
+void lock_table(HashTable *ht) {
+    if (ht->owned) {
+        return;
+    }
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        pthread_rwlock_wrlock(&ht->stripes[i].rwlock);
+    }
+}
+
+void unlock_table(HashTable *ht) {
+    if (ht->owned) {
+        return;
+    }
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        pthread_rwlock_unlock(&ht->stripes[i].rwlock);
+    }
+}
+
+// Counters of a filter for a table that holds num_keys keys before it
+// grows, or fewer if the memory limit cannot hold that many.
+static size_t filter_counters(HashTable *ht, size_t num_keys) {
+    size_t fit = ht->max_bytes / (sizeof(KeyNode) + sizeof(IndexNode));
+    if (ht->max_bytes != 0 && fit < num_keys) {
+        num_keys = fit;
+    }
+    return bloom_counters(num_keys);
+}
+
+static void retire_filter(void *ptr) {
+    bloom_free(ptr);
+}
+
+// Adds a new key to the filter, and to the filter a resize fills, as the
+// key goes to the new array. Must be called with the key's stripe locked.
+static void filter_add(HashTable *ht, uint64_t h) {
+    bloom_add(atomic_load_explicit(&ht->filter, memory_order_relaxed), h);
+    if (ht->next_filter != NULL) {
+        bloom_add(ht->next_filter, h);
+    }
+}
+
+// Removes a key from the filters that hold it. Must be called with the
+// key's stripe locked.
+// @param in_old 1 if the node was in old_table, which a resize has not
+// added to its filter yet.
+static void filter_remove(HashTable *ht, uint64_t h, int in_old) {
+    bloom_remove(atomic_load_explicit(&ht->filter, memory_order_relaxed), h);
+    if (ht->next_filter != NULL && !in_old) {
+        bloom_remove(ht->next_filter, h);
+    }
+}
+
+// Installs a bucket array twice as large. New keys go to the new array right
+// away, but the old nodes are only migrated, a few buckets at a time by
+// rehash_step, once no reader can still be using the previous arrays.
+static void start_resize(HashTable *ht) {
+    Buckets *old = atomic_load(&ht->table);
+    Buckets *table = create_buckets(old->size * 2);
+    if (!table) {
+        atomic_store(&ht->resizing, 0);
+        return;
+    }
+    // filled as the nodes reach the new array, and used once they all did;
+    // without it the current filter is kept
+    BloomFilter *filter = bloom_create(filter_counters(ht, table->size * MAX_LOAD_FACTOR));
+
+    // the stripes are locked in index order, like in lock_batch
+    lock_table(ht);
+    ht->next_filter = filter;
+    atomic_store(&ht->old_table, old);
+    atomic_store(&ht->table, table);
+    atomic_store(&ht->grow_at, table->size * MAX_LOAD_FACTOR);
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        ht->stripes[i].rehash_cursor = 0;
+    }
+    unlock_table(ht);
+
+    epoch_synchronize();
+    atomic_store(&ht->rehash_left, old->size);
+}
+
+// Releases the drained old_table, puts the filter of the new array in use
+// and allows the next resize.
+static void finish_resize(HashTable *ht) {
+    Buckets *old = atomic_exchange(&ht->old_table, NULL);
+    epoch_retire(old, free);
+
+    if (ht->next_filter != NULL) {
+        // no writer is between its two filters while every stripe is held
+        lock_table(ht);
+        BloomFilter *filter = atomic_exchange(&ht->filter, ht->next_filter);
+        ht->next_filter = NULL;
+        unlock_table(ht);
+        epoch_retire(filter, retire_filter);
+    }
+    atomic_store(&ht->resizing, 0);
+}
+
+// Rebuilds a swiss table that is running out of empty slots into one where
+// the keys stored and reserved take at most half of the allowed load; deleted
+// slots are dropped on the way. The nodes are moved, not copied, so readers
+// still probing the old table find the same nodes.
+// @return 0 if the table has room, 1 if a larger one could not be allocated.
+static int rebuild_slots(HashTable *ht) {
+    // the stripes are locked in index order, like in lock_batch
+    lock_table(ht);
+    SwissTable *old = atomic_load(&ht->swiss);
+    size_t reserved = atomic_load(&ht->reserved);
+    if (!swiss_overloaded(old, reserved)) {
+        unlock_table(ht);
+        return 0;
+    }
+
+    size_t wanted = atomic_load(&ht->count) + reserved;
+    size_t num_slots = SWISS_MIN_SLOTS;
+    while (wanted * 16 > num_slots * SWISS_MAX_LOAD) {
+        num_slots *= 2;
+    }
+    SwissTable *table = swiss_create(num_slots);
+    if (!table) {
+        unlock_table(ht);
+        perror("Failed to allocate memory for slots");
+        return 1;
+    }
+    // the filter is rebuilt on the same walk; without memory for it the
+    // current one is kept
+    BloomFilter *filter = bloom_create(filter_counters(ht, num_slots * SWISS_MAX_LOAD / 8));
+    for (size_t i = 0; i < old->num_slots; i++) {
+        SwissSlot *slot = swiss_slot(old, i);
+        if (slot != NULL) {
+            swiss_insert(table, slot->node->hash, slot->node, atomic_load(&slot->referenced));
+            if (filter != NULL) {
+                bloom_add(filter, slot->node->hash);
+            }
         }
-        keyNode = keyNode->next; // Move to the next node
     }
+    atomic_store(&ht->swiss, table);
+    if (filter != NULL) {
+        filter = atomic_exchange(&ht->filter, filter);
+    }
+    unlock_table(ht);
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    pthread_mutex_init(&keyNode->mutex, NULL);
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+    epoch_retire(old, free);
+    if (filter != NULL) {
+        epoch_retire(filter, retire_filter);
+    }
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+// Makes room in a swiss table that is running out of empty slots. If the
+// keys stored and reserved would fit at half of the allowed load, the
+// deleted slots take the room and are freed in place, without stopping the
+// writers; otherwise the table is rebuilt larger. One writer at a time does
+// either, the others wait for it. Must be called outside an epoch.
+// @return 0 if the table has room or is being given some, 1 if a larger one
+// could not be allocated.
+static int grow_slots(HashTable *ht) {
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&ht->resizing, &expected, 1)) {
+        sched_yield();
+        return 0;
+    }
+
+    // only the writer that set resizing replaces the table
+    SwissTable *table = atomic_load(&ht->swiss);
+    size_t wanted = atomic_load(&ht->count) + atomic_load(&ht->reserved);
+    int failed = 0;
+    if (wanted * 16 <= table->num_slots * SWISS_MAX_LOAD) {
+        swiss_retire_deleted(table);
+        epoch_synchronize();
+        swiss_free_retired(table);
+    } else {
+        failed = rebuild_slots(ht);
+    }
+    atomic_store(&ht->resizing, 0);
+    return failed;
+}
+
+// Checks whether the swiss table lacks room for the reserved keys. The table
+// is only looked at inside an epoch, as a rebuild may retire it, but the
+// rebuild itself runs outside: it waits for every stripe.
+static int slots_overloaded(HashTable *ht) {
+    epoch_enter();
+    int overloaded = swiss_overloaded(atomic_load(&ht->swiss), atomic_load(&ht->reserved));
+    epoch_exit();
+    return overloaded;
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return copy of the value if found
+void reserve_pairs(HashTable *ht, size_t num_pairs) {
+    if (ht->engine != ENGINE_SWISS) {
+        return;
+    }
+    atomic_fetch_add(&ht->reserved, num_pairs);
+    while (slots_overloaded(ht)) {
+        if (grow_slots(ht) != 0) {
+            break;
         }
-        keyNode = keyNode->next; // Move to the next node
     }
-    return NULL; // Key not found
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
-
-    // Search for the key node
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            notify_clients(keyNode->client_fds, key, "DELETED");
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+void release_pairs(HashTable *ht, size_t num_pairs) {
+    if (ht->engine == ENGINE_SWISS) {
+        atomic_fetch_sub(&ht->reserved, num_pairs);
+    }
+}
+
+void rehash_step(HashTable *ht) {
+    if (ht->engine == ENGINE_SWISS) {
+        // swiss tables grow in reserve_pairs
+        return;
+    }
+    if (atomic_load(&ht->resizing) == 0) {
+        int expected = 0;
+        if (atomic_load(&ht->count) <= atomic_load(&ht->grow_at) ||
+            !atomic_compare_exchange_strong(&ht->resizing, &expected, 1)) {
+            return;
+        }
+        start_resize(ht);
+        return;
+    }
+
+    // migrate the next buckets of the first stripe that is free and has work left
+    int finished = 0;
+    epoch_enter();
+    for (size_t tries = 0; tries < ht->num_stripes && atomic_load(&ht->rehash_left) > 0; tries++) {
+        if (atomic_load(&ht->scanners) > 0) {
+            break;
+        }
+        size_t i = atomic_fetch_add(&ht->rehash_hint, 1) & (ht->num_stripes - 1);
+        Stripe *stripe = &ht->stripes[i];
+        if (try_lock_stripe(ht, stripe) != 0) {
+            continue;
+        }
+        // a view may have been opened since the check above
+        if (atomic_load(&ht->scanners) > 0) {
+            unlock_stripe(ht, stripe);
+            break;
+        }
+
+        size_t migrated = 0;
+        Buckets *old = atomic_load(&ht->old_table);
+        if (old != NULL) {
+            // the old buckets guarded by this stripe are i, i + num_stripes, ...
+            while (migrated < REHASH_STEP) {
+                size_t index = i + stripe->rehash_cursor * ht->num_stripes;
+                if (index >= old->size) {
+                    break;
+                }
+                if (migrate_bucket(ht, old, index) != 0) {
+                    // out of memory: the bucket is tried again by a later step
+                    break;
+                }
+                stripe->rehash_cursor++;
+                migrated++;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        unlock_stripe(ht, stripe);
+
+        if (migrated > 0) {
+            finished = atomic_fetch_sub(&ht->rehash_left, migrated) == migrated;
+            break;
+        }
+    }
+    epoch_exit();
+    // outside the epoch, as it waits for every stripe
+    if (finished) {
+        finish_resize(ht);
     }
+}
+
+// Number of levels of a key in the ordered index, taken from its hash so that
+// each level holds about a quarter of the keys of the level below. The hash is
+// mixed again first: its bits also pick the stripe and the shard of the key.
+static int index_levels(uint64_t h) {
+    int levels = 1;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    while (levels < INDEX_LEVELS && (h & 3) == 0) {
+        levels++;
+        h >>= 2;
+    }
+    return levels;
+}
+
+// Finds, on every level, the last node of the index before a key.
+// @param inclusive 0 to also skip the nodes equal to key.
+static void index_find(HashTable *ht, const char *key, int inclusive, IndexNode *preds[INDEX_LEVELS]) {
+    IndexNode *pred = ht->index;
+    for (int level = INDEX_LEVELS - 1; level >= 0; level--) {
+        IndexNode *next = atomic_load_explicit(&pred->next[level], memory_order_acquire);
+        while (next != NULL) {
+            int cmp = strcmp(next->key, key);
+            if (cmp > 0 || (cmp == 0 && inclusive)) {
+                break;
+            }
+            pred = next;
+            next = atomic_load_explicit(&pred->next[level], memory_order_acquire);
+        }
+        preds[level] = pred;
+    }
+}
+
+// Links a new key into the ordered index, from the bottom level up.
+static int index_insert(HashTable *ht, const char *key, uint64_t h) {
+    IndexNode *preds[INDEX_LEVELS];
+    IndexNode *indexNode = create_index_node(key, index_levels(h));
+    if (!indexNode) return 1;
+
+    pthread_mutex_lock(&ht->index_mutex);
+    index_find(ht, key, 1, preds);
+    for (int i = 0; i < indexNode->levels; i++) {
+        IndexNode *next = atomic_load_explicit(&preds[i]->next[i], memory_order_relaxed);
+        atomic_store_explicit(&indexNode->next[i], next, memory_order_relaxed);
+        atomic_store_explicit(&preds[i]->next[i], indexNode, memory_order_release);
+    }
+    pthread_mutex_unlock(&ht->index_mutex);
+    return 0;
+}
+
+// Unlinks a key from the ordered index; readers already on its node still
+// see its successors.
+static void index_remove(HashTable *ht, const char *key) {
+    IndexNode *preds[INDEX_LEVELS];
+
+    pthread_mutex_lock(&ht->index_mutex);
+    index_find(ht, key, 1, preds);
+    IndexNode *indexNode = atomic_load_explicit(&preds[0]->next[0], memory_order_relaxed);
+    if (indexNode != NULL && strcmp(indexNode->key, key) == 0) {
+        for (int i = indexNode->levels - 1; i >= 0; i--) {
+            IndexNode *next = atomic_load_explicit(&indexNode->next[i], memory_order_relaxed);
+            atomic_store_explicit(&preds[i]->next[i], next, memory_order_release);
+        }
+        epoch_retire(indexNode, slab_free);
+    }
+    pthread_mutex_unlock(&ht->index_mutex);
+}
+
+size_t scan_keys(HashTable *ht, const char *start, int inclusive, const char *end,
+                 char keys[][MAX_STRING_SIZE], size_t max_keys) {
+    IndexNode *preds[INDEX_LEVELS];
+    size_t count = 0;
+
+    epoch_enter();
+    index_find(ht, start, inclusive, preds);
+    IndexNode *indexNode = atomic_load_explicit(&preds[0]->next[0], memory_order_acquire);
+    while (indexNode != NULL && count < max_keys && strcmp(indexNode->key, end) <= 0) {
+        memcpy(keys[count++], indexNode->key, MAX_STRING_SIZE);
+        indexNode = atomic_load_explicit(&indexNode->next[0], memory_order_acquire);
+    }
+    epoch_exit();
+    return count;
+}
+
+// Bytes charged to the table for a pair: its node, its index node and its value.
+static size_t entry_bytes(uint64_t h, const Value *value) {
+    return sizeof(KeyNode) + sizeof(IndexNode) + (size_t) index_levels(h) * sizeof(_Atomic(IndexNode *)) +
+           value_size(value->len);
+}
+
+// Marks a pair as recently used, writing only when the mark is missing so that
+// readers of hot keys do not keep dirtying its cache line.
+static inline void touch_pair(atomic_int *referenced) {
+    if (atomic_load_explicit(referenced, memory_order_relaxed) == 0) {
+        atomic_store_explicit(referenced, 1, memory_order_relaxed);
+    }
+}
+
+// Checks whether the walk of a view has passed a key. Must be called with
+// view->mutex held.
+static int view_passed(const ReadView *view, const char *key) {
+    return view->walked || strcmp(key, view->passed) <= 0;
+}
+
+// Adds a pair to the retained pairs of a view. Must be called with
+// view->mutex held.
+// @param value Value of the pair, NULL if it could not be copied.
+// @return 0 on success, 1 if the view failed to keep the pair.
+static int keep_pair(ReadView *view, const char *key, Value *value) {
+    if (value != NULL && view->num_retained == view->retained_capacity) {
+        size_t capacity = view->retained_capacity > 0 ? view->retained_capacity * 2 : 64;
+        RetainedPair *retained = realloc(view->retained, capacity * sizeof(RetainedPair));
+        if (retained) {
+            view->retained = retained;
+            view->retained_capacity = capacity;
+        }
+    }
+    if (value == NULL || view->num_retained == view->retained_capacity) {
+        view->failed = 1;
+        return 1;
+    }
+    RetainedPair *pair = &view->retained[view->num_retained++];
+    memcpy(pair->key, key, MAX_STRING_SIZE);
+    pair->value = value;
+    return 0;
+}
+
+// Hands the value a node is about to lose to the open views that hold it and
+// have not walked past it yet; the first one takes the value itself, any
+// other a copy. Must be called with the node's stripe locked, before the
+// version of the node changes.
+// @return 1 if the value was handed over and must not be retired, 0 otherwise.
+static int retain_value(HashTable *ht, KeyNode *keyNode, Value *value) {
+    int handed = 0;
+    for (ReadView *view = ht->views; view != NULL; view = view->next) {
+        if (keyNode->version > view->version) {
+            continue;
+        }
+        pthread_mutex_lock(&view->mutex);
+        if (!view_passed(view, keyNode->key)) {
+            Value *kept = handed ? copy_value(value->data, value->len, value->deadline) : value;
+            if (keep_pair(view, keyNode->key, kept) == 0) {
+                handed = 1;
+            } else if (kept != value) {
+                free_value(kept);
+            }
+        }
+        pthread_mutex_unlock(&view->mutex);
+    }
+    return handed;
+}
+
+// Stores a value under a key, updating keyNode if the key already exists.
+// Must be called inside an epoch, with the key's stripe locked.
+// @param keyNode Node of the key, NULL if it does not exist.
+// @param link Where find_node found keyNode.
+// @param value Value, not necessarily null terminated.
+// @param value_len Length of the value.
+// @param deadline Time the pair expires at, 0 if it does not.
+// @param version Set to the version given to the value.
+// @return The copy of the value that was stored, NULL on failure.
+static Value *store_pair(HashTable *ht, const char *key, uint64_t h, KeyNode *keyNode, const NodeLink *link,
+                         const char *value, size_t value_len, uint64_t deadline, uint64_t *version) {
+    Value *copy = copy_value(value, value_len, deadline);
+    if (!copy) return NULL;
+    *version = atomic_fetch_add(&ht->version, 1) + 1;
+
+    if (keyNode != NULL) {
+        // publish the new value; readers may still be copying the old one
+        Value *old_value = atomic_exchange_explicit(&keyNode->value, copy, memory_order_acq_rel);
+        if (link->slot != NULL) {
+            atomic_store_explicit(&link->slot->value, copy, memory_order_release);
+            touch_pair(&link->slot->referenced);
+        } else {
+            touch_pair(&keyNode->referenced);
+        }
+        atomic_fetch_add(&ht->resident, value_size(copy->len));
+        atomic_fetch_sub(&ht->resident, value_size(old_value->len));
+        if (!retain_value(ht, keyNode, old_value)) {
+            epoch_retire(old_value, free_value);
+        }
+        keyNode->version = *version;
+        subs_notify(ht->subs, key, h, copy->data);
+        return copy;
+    }
+
+    if (ht->engine == ENGINE_SWISS) {
+        keyNode = create_node(key, h, copy, *version, NULL);
+        if (!keyNode || index_insert(ht, key, h) != 0) {
+            if (keyNode) {
+                release_node_shell(keyNode);
+            }
+            free_value(copy);
+            return NULL;
+        }
+        filter_add(ht, h);
+        if (swiss_insert(atomic_load_explicit(&ht->swiss, memory_order_relaxed), h, keyNode, 1) == NULL) {
+            // only when the writer did not reserve room for the key
+            filter_remove(ht, h, 0);
+            index_remove(ht, key);
+            release_node(keyNode);
+            return NULL;
+        }
+        atomic_fetch_add(&ht->count, 1);
+        atomic_fetch_add(&ht->resident, entry_bytes(h, copy));
+        return copy;
+    }
+
+    // Key not found, create a new key node at the start of the list
+    Buckets *table = atomic_load_explicit(&ht->table, memory_order_acquire);
+    _Atomic(KeyNode *) *head = &table->heads[h & (table->size - 1)];
+    keyNode = create_node(key, h, copy, *version, atomic_load_explicit(head, memory_order_relaxed));
+    if (!keyNode || index_insert(ht, key, h) != 0) {
+        if (keyNode) {
+            release_node_shell(keyNode);
+        }
+        free_value(copy);
+        return NULL;
+    }
+    // in the filter before any reader can find the node
+    filter_add(ht, h);
+    atomic_store_explicit(head, keyNode, memory_order_release);
+    atomic_fetch_add(&ht->count, 1);
+    atomic_fetch_add(&ht->resident, entry_bytes(h, copy));
+    return copy;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t deadline) {
+    return write_pair_len(ht, key, value, strlen(value), deadline);
+}
+
+int write_pair_len(HashTable *ht, const char *key, const char *value, size_t value_len, uint64_t deadline) {
+    uint64_t h = hash(key);
+    uint64_t version;
+    NodeLink link;
+
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, h, &link);
+    Value *stored = store_pair(ht, key, h, keyNode, &link, value, value_len, deadline, &version);
+    epoch_exit();
+    if (stored == NULL) {
+        return 1;
+    }
+    // the stripe is still locked, so the stored copy cannot be replaced yet
+    wal_append(WAL_WRITE, key, stored->data, deadline);
+    dirty_add(key);
+    return 0;
+}
+
+int cas_pair(HashTable *ht, const char *key, uint64_t expected, const char *value, uint64_t *version) {
+    uint64_t h = hash(key);
+    NodeLink link;
+
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, h, &link);
+    uint64_t current = keyNode != NULL ? keyNode->version : 0;
+    if (current != expected) {
+        *version = current;
+        epoch_exit();
+        return 1;
+    }
+    int result = store_pair(ht, key, h, keyNode, &link, value, strlen(value), 0, version) != NULL ? 0 : -1;
+    epoch_exit();
+    if (result == 0) {
+        // the write drops the timer the key may have had
+        wal_append(WAL_WRITE, key, value, 0);
+        dirty_add(key);
+    }
+    return result;
+}
+
+// Checks the filter for a key, counting the lookups it ends.
+// @return 1 if the key certainly does not exist, 0 otherwise.
+static int filtered_out(HashTable *ht, uint64_t h) {
+    // a resize may retire the filter
+    epoch_enter();
+    int may_contain = bloom_may_contain(atomic_load_explicit(&ht->filter, memory_order_acquire), h);
+    epoch_exit();
+    if (may_contain) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(&ht->filtered, 1, memory_order_relaxed);
     return 1;
 }
 
+void filter_stats(HashTable *ht, BloomStats *stats) {
+    epoch_enter();
+    bloom_stats(atomic_load_explicit(&ht->filter, memory_order_acquire), stats);
+    epoch_exit();
+}
+
+int pair_may_exist(HashTable *ht, const char *key) {
+    return !filtered_out(ht, hash(key));
+}
+
+// Finds the value of a key for a reader, with the mark the eviction hand
+// clears. A swiss table keeps both in the slot, so the node is not touched.
+// Must be called inside an epoch.
+static Value *find_value(HashTable *ht, const char *key, uint64_t h, atomic_int **referenced) {
+    if (ht->engine == ENGINE_SWISS) {
+        SwissSlot *slot = swiss_find(atomic_load_explicit(&ht->swiss, memory_order_acquire), key, h);
+        if (slot == NULL) {
+            return NULL;
+        }
+        *referenced = &slot->referenced;
+        return atomic_load_explicit(&slot->value, memory_order_acquire);
+    }
+
+    KeyNode *keyNode = find_node(ht, key, h, NULL);
+    if (keyNode == NULL) {
+        return NULL;
+    }
+    *referenced = &keyNode->referenced;
+    return atomic_load_explicit(&keyNode->value, memory_order_acquire);
+}
+
+int read_pair(HashTable *ht, const char *key, char *value, size_t size, size_t *len) {
+    uint64_t h = hash(key);
+    if (filtered_out(ht, h)) {
+        return 1;
+    }
+
+    atomic_int *referenced;
+    epoch_enter();
+    Value *stored = find_value(ht, key, h, &referenced);
+    if (stored != NULL) {
+        size_t copied = stored->len < size ? stored->len : size - 1;
+        memcpy(value, stored->data, copied);
+        value[copied] = '\0';
+        if (len != NULL) {
+            *len = stored->len;
+        }
+        touch_pair(referenced);
+    }
+    epoch_exit();
+    return stored == NULL;
+}
+
+char *copy_pair(HashTable *ht, const char *key, size_t *len) {
+    char *copy = NULL;
+    uint64_t h = hash(key);
+    if (filtered_out(ht, h)) {
+        return NULL;
+    }
+
+    atomic_int *referenced;
+    epoch_enter();
+    Value *stored = find_value(ht, key, h, &referenced);
+    if (stored != NULL) {
+        copy = malloc(stored->len + 1);
+        if (copy) {
+            memcpy(copy, stored->data, stored->len + 1);
+            if (len != NULL) {
+                *len = stored->len;
+            }
+        }
+        touch_pair(referenced);
+    }
+    epoch_exit();
+    return copy;
+}
+
+// Unlinks a node, notifies its subscribers and hands it to the reclaimer.
+// Must be called inside an epoch, with the node's stripe locked.
+// @param link Where find_node found the node.
+// @param notice Value sent to the subscribers.
+static void remove_node(HashTable *ht, const NodeLink *link, KeyNode *keyNode, const char *notice) {
+    subs_drop(ht->subs, keyNode->key, keyNode->hash, notice);
+    if (link->slot != NULL) {
+        swiss_erase(atomic_load_explicit(&ht->swiss, memory_order_relaxed), link->slot);
+    } else {
+        // bypass the node; readers already on it still see its successors
+        atomic_store_explicit(link->prev, load_next(keyNode), memory_order_release);
+    }
+    Value *value = atomic_load_explicit(&keyNode->value, memory_order_relaxed);
+    atomic_fetch_sub(&ht->resident, entry_bytes(keyNode->hash, value));
+    // handed over before the key leaves the index: a walk that no longer
+    // finds it there finds it among the retained pairs
+    int retained = retain_value(ht, keyNode, value);
+    index_remove(ht, keyNode->key);
+    filter_remove(ht, keyNode->hash, link->in_old);
+    wal_append(WAL_DELETE, keyNode->key, NULL, 0);
+    dirty_add(keyNode->key);
+    epoch_retire(keyNode, retained ? release_node_shell : release_node);
+    atomic_fetch_sub(&ht->count, 1);
+    // a key written again later must not get a version it had before
+    atomic_fetch_add(&ht->version, 1);
+}
+
+int delete_pair(HashTable *ht, const char *key) {
+    NodeLink link;
+    uint64_t h = hash(key);
+    if (filtered_out(ht, h)) {
+        return 1;
+    }
+
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, h, &link);
+    if (keyNode == NULL) {
+        epoch_exit();
+        return 1;
+    }
+
+    remove_node(ht, &link, keyNode, "DELETED");
+    epoch_exit();
+    return 0;
+}
+
+// Sweeps the slots of a swiss table with the eviction hand. A slot is looked
+// at with the stripe of its key locked; a rebuild of the table, which needs
+// every stripe, cannot happen meanwhile, but the slot may have been emptied
+// just before the lock was taken. Must be called inside an epoch.
+static void evict_slots(HashTable *ht) {
+    size_t budget = 2 * atomic_load(&ht->swiss)->num_slots;
+    while (budget-- > 0 && atomic_load(&ht->resident) > ht->max_bytes) {
+        size_t hand = atomic_fetch_add(&ht->clock_hand, 1);
+        SwissTable *table = atomic_load(&ht->swiss);
+        SwissSlot *slot = swiss_slot(table, hand & (table->num_slots - 1));
+        if (slot == NULL) {
+            continue;
+        }
+        KeyNode *keyNode = slot->node;
+        Stripe *stripe = &ht->stripes[keyNode->hash & (ht->num_stripes - 1)];
+        if (try_lock_stripe(ht, stripe) != 0) {
+            continue;
+        }
+
+        if (atomic_load(&ht->swiss) == table && swiss_slot(table, (size_t) (slot - table->slots)) != NULL) {
+            if (atomic_exchange_explicit(&slot->referenced, 0, memory_order_relaxed) == 0) {
+                NodeLink link = {NULL, slot, 0};
+                remove_node(ht, &link, keyNode, "EVICTED");
+                atomic_fetch_add(&ht->evictions, 1);
+            }
+        }
+        unlock_stripe(ht, stripe);
+    }
+}
+
+// Sweeps a bucket of chains with the eviction hand: a referenced node loses
+// its mark, one without a mark is evicted. Must be called with the stripe of
+// the bucket locked for writing.
+static void evict_bucket(HashTable *ht, Buckets *buckets, size_t index) {
+    _Atomic(KeyNode *) *prev = &buckets->heads[index];
+    KeyNode *keyNode = atomic_load_explicit(prev, memory_order_acquire);
+    while (keyNode != NULL && atomic_load(&ht->resident) > ht->max_bytes) {
+        KeyNode *next = load_next(keyNode);
+        if (atomic_exchange_explicit(&keyNode->referenced, 0, memory_order_relaxed) != 0) {
+            prev = &keyNode->next;
+        } else {
+            NodeLink link = {prev, NULL, buckets != atomic_load(&ht->table)};
+            remove_node(ht, &link, keyNode, "EVICTED");
+            atomic_fetch_add(&ht->evictions, 1);
+        }
+        keyNode = next;
+    }
+}
+
+void evict_pairs(HashTable *ht) {
+    if (ht->max_bytes == 0 || atomic_load(&ht->resident) <= ht->max_bytes) {
+        return;
+    }
+
+    epoch_enter();
+    if (ht->engine == ENGINE_SWISS) {
+        evict_slots(ht);
+        epoch_exit();
+        return;
+    }
+    // every bucket is looked at most twice: once to clear the marks, once to evict
+    size_t budget = 2 * atomic_load(&ht->table)->size;
+    while (budget-- > 0 && atomic_load(&ht->resident) > ht->max_bytes) {
+        size_t hand = atomic_fetch_add(&ht->clock_hand, 1);
+        Stripe *stripe = &ht->stripes[hand & (ht->num_stripes - 1)];
+        if (try_lock_stripe(ht, stripe) != 0) {
+            continue;
+        }
+
+        // the arrays are loaded under the lock: a resize may have replaced
+        // them, but the bucket is guarded by the same stripe in any array
+        Buckets *table = atomic_load(&ht->table);
+        evict_bucket(ht, table, hand & (table->size - 1));
+        // during a resize the pairs not migrated yet are only in old_table;
+        // the matching old bucket is under the same stripe, and one the
+        // resize already drained is empty
+        Buckets *old = atomic_load(&ht->old_table);
+        if (old != NULL) {
+            evict_bucket(ht, old, hand & (old->size - 1));
+        }
+        unlock_stripe(ht, stripe);
+    }
+    epoch_exit();
+}
+
+uint64_t pair_version(HashTable *ht, const char *key) {
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, hash(key), NULL);
+    uint64_t version = keyNode != NULL ? keyNode->version : 0;
+    epoch_exit();
+    return version;
+}
+
+int expire_pair(HashTable *ht, const char *key, uint64_t version) {
+    if (version == 0 || pair_version(ht, key) != version) {
+        return 1;
+    }
+    return delete_pair(ht, key);
+}
+
 int subscribe_key(HashTable *ht, const char *key, int client_fd) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-
-    // find the key in the hash table
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-
-            // find an empty slot in the client_fds array
-            pthread_mutex_lock(&keyNode->mutex);
-            for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-                if (keyNode->client_fds[i] <= 0) {
-                    keyNode->client_fds[i] = client_fd;
-                    pthread_mutex_unlock(&keyNode->mutex);
-                    return 0;
-                }
+    uint64_t h = hash(key);
+
+    // only keys that exist can be subscribed to
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, h, NULL);
+    epoch_exit();
+    if (keyNode == NULL) {
+        return 1;
+    }
+    return subs_add(ht->subs, key, h, client_fd);
+}
+
+int unsubscribe_key(HashTable *ht, const char *key, int client_fd) {
+    return subs_remove(ht->subs, key, hash(key), client_fd);
+}
+
+// Calls visit for every node of a bucket array.
+static void visit_buckets(Buckets *buckets, void (*visit)(KeyNode *node, void *arg), void *arg) {
+    for (size_t i = 0; i < buckets->size; i++) {
+        KeyNode *keyNode = atomic_load_explicit(&buckets->heads[i], memory_order_acquire);
+        while (keyNode != NULL) {
+            KeyNode *next = load_next(keyNode);
+            visit(keyNode, arg);
+            keyNode = next;
+        }
+    }
+}
+
+// Calls visit for every node of a swiss table.
+static void visit_slots(SwissTable *table, void (*visit)(KeyNode *node, void *arg), void *arg) {
+    for (size_t i = 0; i < table->num_slots; i++) {
+        SwissSlot *slot = swiss_slot(table, i);
+        if (slot != NULL) {
+            visit(slot->node, arg);
+        }
+    }
+}
+
+void for_each_pair(HashTable *ht, void (*visit)(KeyNode *node, void *arg), void *arg) {
+    if (ht->engine == ENGINE_SWISS) {
+        // a rebuild moves the nodes to a new table but leaves the old one intact
+        epoch_enter();
+        visit_slots(atomic_load(&ht->swiss), visit, arg);
+        epoch_exit();
+        return;
+    }
+
+    // a bucket migrated during the traversal could be visited twice or not at
+    // all, so migration is paused and the steps already running are waited for
+    atomic_fetch_add(&ht->scanners, 1);
+    if (atomic_load(&ht->rehash_left) > 0) {
+        epoch_synchronize();
+    }
+
+    epoch_enter();
+    Buckets *table = atomic_load(&ht->table);
+    Buckets *old = atomic_load(&ht->old_table);
+    if (old != NULL) {
+        visit_buckets(old, visit, arg);
+    }
+    visit_buckets(table, visit, arg);
+    epoch_exit();
+
+    atomic_fetch_sub(&ht->scanners, 1);
+}
+
+void view_open(HashTable *ht, ReadView *view) {
+    view->version = atomic_load(&ht->version);
+    pthread_mutex_init(&view->mutex, NULL);
+    view->retained = NULL;
+    view->num_retained = 0;
+    view->retained_capacity = 0;
+    view->failed = 0;
+    view->passed[0] = '\0';
+    view->walked = 0;
+    view->pending = NULL;
+    view->num_pending = 0;
+    view->pending_capacity = 0;
+    view->num_taken = 0;
+    view->page_len = 0;
+    view->page_next = 0;
+    view->last_page = 0;
+    view->buffer = NULL;
+    view->buffer_size = 0;
+    view->next = ht->views;
+    ht->views = view;
+}
+
+// Orders two entries of the pending heap of a view by the keys of their pairs.
+static int pending_before(const ReadView *view, size_t a, size_t b) {
+    return strcmp(view->retained[view->pending[a]].key, view->retained[view->pending[b]].key) < 0;
+}
+
+static void swap_pending(ReadView *view, size_t a, size_t b) {
+    size_t pair = view->pending[a];
+    view->pending[a] = view->pending[b];
+    view->pending[b] = pair;
+}
+
+// Moves the pairs retained since the last call to the pending heap. Must be
+// called with view->mutex held.
+static void take_retained(ReadView *view) {
+    if (view->num_taken == view->num_retained) {
+        return;
+    }
+    if (view->pending_capacity < view->num_retained) {
+        size_t *pending = realloc(view->pending, view->retained_capacity * sizeof(size_t));
+        if (!pending) {
+            // tried again on the next call; the pairs are lost if it keeps failing
+            view->failed = 1;
+            return;
+        }
+        view->pending = pending;
+        view->pending_capacity = view->retained_capacity;
+    }
+    while (view->num_taken < view->num_retained) {
+        size_t i = view->num_pending++;
+        view->pending[i] = view->num_taken++;
+        while (i > 0 && pending_before(view, i, (i - 1) / 2)) {
+            swap_pending(view, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+}
+
+// Removes the pair with the smallest key from the pending heap. Must be
+// called with view->mutex held.
+// @return Index of the pair in view->retained.
+static size_t pop_pending(ReadView *view) {
+    size_t first = view->pending[0];
+    view->pending[0] = view->pending[--view->num_pending];
+    size_t i = 0;
+    for (;;) {
+        size_t smallest = i;
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < view->num_pending; child++) {
+            if (pending_before(view, child, smallest)) {
+                smallest = child;
             }
-            pthread_mutex_unlock(&keyNode->mutex);
+        }
+        if (smallest == i) {
+            return first;
+        }
+        swap_pending(view, i, smallest);
+        i = smallest;
+    }
+}
+
+// Takes the next page of keys from the ordered index, once the walk is done
+// with the current one.
+static void next_view_page(HashTable *ht, ReadView *view) {
+    if (view->page_next < view->page_len || view->last_page) {
+        return;
+    }
+    char from[MAX_STRING_SIZE];
+    char end[MAX_STRING_SIZE];
+    int inclusive = view->page_len == 0;
+    if (inclusive) {
+        from[0] = '\0';
+    } else {
+        memcpy(from, view->page[view->page_len - 1], MAX_STRING_SIZE);
+    }
+    memset(end, 0xff, MAX_STRING_SIZE - 1);
+    end[MAX_STRING_SIZE - 1] = '\0';
+    view->page_len = scan_keys(ht, from, inclusive, end, view->page, SCAN_PAGE);
+    view->page_next = 0;
+    view->last_page = view->page_len < SCAN_PAGE;
+}
+
+// Copies the value of a node into the buffer of a view.
+// @return 0 on success, 1 if the buffer could not grow.
+static int copy_to_view(ReadView *view, const Value *value) {
+    if (value->len >= view->buffer_size) {
+        char *buffer = realloc(view->buffer, value->len + 1);
+        if (!buffer) {
+            view->failed = 1;
             return 1;
         }
-        keyNode = keyNode->next;
+        view->buffer = buffer;
+        view->buffer_size = value->len + 1;
     }
-    return 1;
+    memcpy(view->buffer, value->data, value->len + 1);
+    return 0;
 }
 
-int unsubscribe_key(HashTable *ht, const char *key, int client_fd) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-
-    // find the key in the hash table
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-
-            // find the client_fd in the client_fds array
-            pthread_mutex_lock(&keyNode->mutex);
-            for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-                if (keyNode->client_fds[i] == client_fd) {
-                    keyNode->client_fds[i] = -1; //delete the client_fd
-                    pthread_mutex_unlock(&keyNode->mutex);
-                    return 0;
-                }
+int view_next(HashTable *ht, ReadView *view, ViewPair *pair) {
+    for (;;) {
+        next_view_page(ht, view);
+        const char *key = view->page_next < view->page_len ? view->page[view->page_next] : NULL;
+        // the stripe is taken before the mutex, like by the writers handing
+        // values over, so every value retained for the key is pending by now
+        Stripe *stripe = key != NULL ? &ht->stripes[stripe_index(ht, key)] : NULL;
+        if (stripe != NULL) {
+            read_lock_stripe(ht, stripe);
+        }
+        pthread_mutex_lock(&view->mutex);
+        take_retained(view);
+
+        int found = 0;
+        int cmp = view->num_pending == 0 ? 1 : key == NULL ? -1 : strcmp(view->retained[view->pending[0]].key, key);
+        if (cmp <= 0) {
+            // a pair changed since the opening comes first, or stands for the key
+            const RetainedPair *retained = &view->retained[pop_pending(view)];
+            memcpy(view->passed, retained->key, MAX_STRING_SIZE);
+            pair->value = retained->value->data;
+            pair->len = retained->value->len;
+            pair->deadline = retained->value->deadline;
+            view->page_next += cmp == 0;
+            found = 1;
+        } else if (key != NULL) {
+            epoch_enter();
+            KeyNode *keyNode = find_node(ht, key, hash(key), NULL);
+            // a key added since the opening is skipped
+            if (keyNode != NULL && keyNode->version <= view->version) {
+                Value *value = atomic_load_explicit(&keyNode->value, memory_order_acquire);
+                found = copy_to_view(view, value) == 0;
+                pair->value = view->buffer;
+                pair->len = value->len;
+                pair->deadline = value->deadline;
             }
-            pthread_mutex_unlock(&keyNode->mutex);
+            epoch_exit();
+            memcpy(view->passed, key, MAX_STRING_SIZE);
+            view->page_next++;
+        } else {
+            // writers stop handing values over once every key was passed
+            view->walked = 1;
+        }
+        int walked = view->walked;
+        pthread_mutex_unlock(&view->mutex);
+        if (stripe != NULL) {
+            unlock_stripe(ht, stripe);
+        }
+
+        if (found) {
+            pair->key = view->passed;
             return 1;
         }
-        keyNode = keyNode->next;
+        if (walked) {
+            return 0;
+        }
     }
-    return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            pthread_mutex_destroy(&temp->mutex);
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            pthread_rwlock_destroy(&ht->rwlock[i]);
-            free(temp);
+char *view_copy(HashTable *ht, ReadView *view, const char *key, size_t *len) {
+    char *copy = NULL;
+    Stripe *stripe = &ht->stripes[stripe_index(ht, key)];
+    read_lock_stripe(ht, stripe);
+    epoch_enter();
+    KeyNode *keyNode = find_node(ht, key, hash(key), NULL);
+    if (keyNode != NULL && keyNode->version <= view->version) {
+        Value *value = atomic_load_explicit(&keyNode->value, memory_order_acquire);
+        copy = malloc(value->len + 1);
+        if (copy) {
+            memcpy(copy, value->data, value->len + 1);
+            if (len != NULL) {
+                *len = value->len;
+            }
         }
     }
+    epoch_exit();
+    unlock_stripe(ht, stripe);
+    return copy;
+}
+
+static int compare_retained(const void *a, const void *b) {
+    return strcmp(((const RetainedPair *) a)->key, ((const RetainedPair *) b)->key);
+}
+
+void view_close(HashTable *ht, ReadView *view) {
+    lock_table(ht);
+    ReadView **link = &ht->views;
+    while (*link != view) {
+        link = &(*link)->next;
+    }
+    *link = view->next;
+    unlock_table(ht);
+
+    // a key is retained at most once: its version is past the view after that
+    if (view->num_retained > 1) {
+        qsort(view->retained, view->num_retained, sizeof(RetainedPair), compare_retained);
+    }
+}
+
+const RetainedPair *view_retained(const ReadView *view, const char *key) {
+    if (view->num_retained == 0) {
+        return NULL;
+    }
+    RetainedPair wanted;
+    strncpy(wanted.key, key, MAX_STRING_SIZE - 1);
+    wanted.key[MAX_STRING_SIZE - 1] = '\0';
+    return bsearch(&wanted, view->retained, view->num_retained, sizeof(RetainedPair), compare_retained);
+}
+
+void view_free(ReadView *view) {
+    // readers may still be copying a value that was replaced just before the close
+    for (size_t i = 0; i < view->num_retained; i++) {
+        epoch_retire(view->retained[i].value, free_value);
+    }
+    free(view->retained);
+    free(view->pending);
+    free(view->buffer);
+    pthread_mutex_destroy(&view->mutex);
+}
+
+static void free_node(KeyNode *keyNode, void *arg) {
+    (void) arg;
+    release_node(keyNode);
+}
+
+void free_table(HashTable *ht) {
+    for_each_pair(ht, free_node, NULL);
+    IndexNode *indexNode = atomic_load(&ht->index->next[0]);
+    while (indexNode != NULL) {
+        IndexNode *next = atomic_load(&indexNode->next[0]);
+        slab_free(indexNode);
+        indexNode = next;
+    }
+    free(ht->index);
+    bloom_free(atomic_load(&ht->filter));
+    if (ht->next_filter != NULL) {
+        bloom_free(ht->next_filter);
+    }
+    subs_free(ht->subs);
+    pthread_mutex_destroy(&ht->index_mutex);
+    for (size_t i = 0; i < ht->num_stripes; i++) {
+        pthread_rwlock_destroy(&ht->stripes[i].rwlock);
+    }
+    free(ht->stripes);
+    free(atomic_load(&ht->old_table));
+    free(atomic_load(&ht->table));
+    free(atomic_load(&ht->swiss));
     free(ht);
 }
 
@@ -224,20 +1481,27 @@ FIFOBuffer* init_FIFO_buffer() {
     FIFOBuffer *fifo = (FIFOBuffer *)malloc(sizeof(FIFOBuffer)); 
     if (!fifo) {
         perror("Failed to allocate memory for FIFO buffer");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
     fifo->front = 0;
     fifo->rear = 0;
 
-    sem_init(&fifo->empty, 0, MAX_SESSION_COUNT); 
-    sem_init(&fifo->full, 0, 0);        
-    pthread_mutex_init(&fifo->mutex, NULL);
-
     // Allocate memory for each string in the buffer
     for (int i = 0; i < MAX_SESSION_COUNT; i++) {
         fifo->buffer[i] = malloc(MAX_PIPE_PATH_LENGTH * 3 + 3); // For 3 pipes and delimiters
+        if (!fifo->buffer[i]) {
+            perror("Failed to allocate memory for FIFO buffer");
+            while (i-- > 0) {
+                free(fifo->buffer[i]);
+            }
+            free(fifo);
+            return NULL;
+        }
     }
 
+    sem_init(&fifo->empty, 0, MAX_SESSION_COUNT); 
+    sem_init(&fifo->full, 0, 0);        
+    pthread_mutex_init(&fifo->mutex, NULL);
     return fifo;
 }
 
@@ -278,11 +1542,14 @@ Client *init_client(int req_fd, int resp_fd, int notif_fd) {
     Client *client = malloc(sizeof(Client));
     if (!client) {
         perror("Failed to allocate memory for client");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
     client->req_fd = req_fd;
     client->resp_fd = resp_fd;
     client->notif_fd = notif_fd;
+    if (notify_register(notif_fd) != 0) {
+        fprintf(stderr, "Failed to register the notification pipe\n");
+    }
     for (int i = 0; i < MAX_NUMBER_SUB; i++) {
         client->keys[i][0] = '\0'; // Initialize the keys array
     }
@@ -299,6 +1566,7 @@ void subscribe_client(Client *client, const char *key) {
 }
 
 void destroy_client(Client *client) {
+    notify_unregister(client->notif_fd);
     free(client);
 }
 
@@ -1,26 +1,160 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+#define TABLE_SIZE 64       // initial number of buckets (power of two)
+#define DEFAULT_STRIPES 64  // number of locks when none is given
+#define MAX_STRIPES 65536
+#define MAX_LOAD_FACTOR 2  // average chain length that triggers a resize
+#define REHASH_STEP 8      // old buckets migrated per rehash step
+#define INDEX_LEVELS 12    // levels of the ordered index
+#define SCAN_PAGE 64       // keys taken from the ordered index at a time
 #define MAX_FILES 10000
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "bloom.h"
+#include "subs.h"
 #include "constants.h"
 #include "../common/constants.h"
 #include <pthread.h>
 #include <semaphore.h>
 
+// A stored value and its length. Values that fit in a slab object live in
+// the slab allocator next to the nodes; longer ones get a buffer of their own
+// out of line, so values have no size limit. The deadline travels with the
+// value so that a backup writes each pair with the TTL of its own write.
+typedef struct Value {
+    size_t len;
+    uint64_t deadline;                   // time the pair expires at, as given to write_pair, 0 if never
+    char data[];                         // len characters and a null terminator
+} Value;
+
+// Readers walk the chains without locks, so next and value are only changed
+// with atomic stores and unlinked nodes and values are released through
+// epoch_retire. The key of a node never changes and is stored inline, with
+// its hash and length so that chain walks only compare the bytes of keys that
+// are very likely equal; nodes come from the slab allocator.
 typedef struct KeyNode {
-    char *key;
-    char *value;
-    int client_fds[MAX_SESSION_COUNT];
-    pthread_mutex_t mutex;
-    struct KeyNode *next;
+    uint64_t hash;                       // hash of the key
+    size_t key_len;
+    char key[MAX_STRING_SIZE];
+    _Atomic(Value *) value;
+    uint64_t version;                    // version of the value, changed with the stripe lock held
+    atomic_int referenced;               // set by accesses, cleared by the eviction hand
+    _Atomic(struct KeyNode *) next;
 } KeyNode;
 
+typedef struct Buckets {
+    size_t size;                         // number of buckets, power of two
+    _Atomic(KeyNode *) heads[];
+} Buckets;
+
+// A key and the value it had when a read view was opened, kept for the view
+// after a writer replaced or removed it.
+typedef struct RetainedPair {
+    char key[MAX_STRING_SIZE];
+    Value *value;
+} RetainedPair;
+
+// Point in time view of a table, so that a backup can run in a thread of its
+// own next to the writers. The view holds every pair whose version is at most
+// the one the table had when the view was opened.
+//
+// A walk of the view goes through the keys of the ordered index in key order
+// and records the last key it passed. A writer about to replace or remove a
+// pair the view holds, and that the walk has not passed yet, hands the old
+// value over to the view instead of retiring it: the walk skips the pairs
+// changed since the opening and merges in their retained values, in key
+// order, as it goes. The retained pairs are released with the view.
+typedef struct ReadView {
+    uint64_t version;                    // last version of the table the view holds
+    pthread_mutex_t mutex;               // serializes the writers handing values over and the walk
+    RetainedPair *retained;              // sorted by key once the view is closed
+    size_t num_retained;
+    size_t retained_capacity;
+    int failed;                          // set when a value could not be kept
+    char passed[MAX_STRING_SIZE];        // last key the walk has passed, empty before it starts
+    int walked;                          // set once the walk has passed every key
+    size_t *pending;                     // retained pairs the walk has not reached, a heap by key
+    size_t num_pending;
+    size_t pending_capacity;
+    size_t num_taken;                    // retained pairs moved to pending so far
+    char page[SCAN_PAGE][MAX_STRING_SIZE];  // keys taken from the index for the walk
+    size_t page_len;
+    size_t page_next;                    // next key of the page to be walked
+    int last_page;                       // set once the index has no keys past the page
+    char *buffer;                        // value of the last pair the walk copied
+    size_t buffer_size;
+    struct ReadView *next;               // next view open on the table
+} ReadView;
+
+// Pair given by view_next; it is valid until the next call.
+typedef struct ViewPair {
+    const char *key;
+    const char *value;
+    size_t len;
+    uint64_t deadline;                   // time the pair expires at, 0 if never
+} ViewPair;
+
+// Node of the ordered index, a skiplist with every key of the table. Like
+// the chains, it is walked without locks; writers insert and unlink nodes
+// under index_mutex and release them through epoch_retire.
+typedef struct IndexNode {
+    char key[MAX_STRING_SIZE];
+    int levels;
+    _Atomic(struct IndexNode *) next[];
+} IndexNode;
+
+// A lock stripe, padded to its own cache line so that threads working on
+// different stripes do not share lines.
+typedef struct Stripe {
+    _Alignas(64) pthread_rwlock_t rwlock;
+    size_t rehash_cursor;                // next old bucket of this stripe to migrate
+} Stripe;
+
+// Ways a table can keep its nodes, chosen when it is created.
+enum TableEngine {
+    ENGINE_CHAINS,  // buckets of linked nodes, resized incrementally
+    ENGINE_SWISS,   // open addressing table with the keys and values inline (swiss.h)
+};
+
+// The bucket array grows by doubling and is always a multiple of the number
+// of stripes, so a key is guarded by the same stripe (hash % num_stripes) in
+// the old and in the new array while an incremental rehash is in progress.
+// Writers hold the stripe lock of the keys they change; readers hold nothing.
+//
+// With ENGINE_SWISS the buckets are not used: the nodes are kept in the slots
+// of a swiss table instead, which is rebuilt as a whole, with every stripe
+// locked, when it runs out of empty slots. Writers that may add keys reserve
+// slots for them first, so that a table never fills up under a lock.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t rwlock[TABLE_SIZE];
+    enum TableEngine engine;
+    _Atomic(struct SwissTable *) swiss;  // slots of ENGINE_SWISS, NULL otherwise
+    atomic_size_t reserved;              // slots reserved by writers of ENGINE_SWISS
+    _Atomic(Buckets *) table;            // current bucket array
+    _Atomic(Buckets *) old_table;        // array being drained by a rehash, NULL otherwise
+    atomic_size_t rehash_left;           // old buckets not yet migrated
+    atomic_int scanners;                 // running for_each_pair calls, which pause migration
+    atomic_size_t rehash_hint;           // stripe the next rehash step starts from
+    atomic_size_t count;                 // number of keys stored
+    atomic_size_t grow_at;               // count above which the table is resized
+    atomic_int resizing;                 // 1 while a resize, or a cleanup of the swiss slots, is in progress
+    _Atomic uint64_t version;            // last version given out by a write or delete
+    atomic_size_t resident;              // bytes of the nodes, index nodes and values stored
+    size_t max_bytes;                    // resident bytes above which pairs are evicted, 0 for no limit
+    int owned;                           // 1 if only an owner thread uses the table, which then takes no lock
+    atomic_size_t clock_hand;            // next bucket looked at by the eviction hand
+    atomic_size_t evictions;             // pairs evicted so far
+    Stripe *stripes;                     // locks, each one guarding every num_stripes-th bucket
+    size_t num_stripes;                  // power of two, at most the number of buckets
+    IndexNode *index;                    // head of the ordered index, with INDEX_LEVELS levels
+    pthread_mutex_t index_mutex;         // serializes the writers of the index
+    _Atomic(BloomFilter *) filter;       // every key stored, for lookups of missing keys
+    BloomFilter *next_filter;            // filter of the array a resize fills, NULL otherwise
+    atomic_size_t filtered;              // lookups the filter answered on its own
+    SubscriptionIndex *subs;             // subscribers of the keys, by key
+    ReadView *views;                     // open read views, changed with every stripe locked
 } HashTable;
 
 typedef struct stack {
@@ -120,21 +254,61 @@ char* pop(stack* s);
 void destroy_stack(stack* s);
 
 /// Creates a new event hash table.
+/// @param num_stripes Number of locks, rounded up to a power of two.
+/// @param engine How the table keeps its nodes.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t num_stripes, enum TableEngine engine);
 
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
 /// @param value Value of the pair to be written.
+/// @param deadline Wall clock time the pair expires at, in milliseconds since
+/// the Epoch, or 0 if it does not expire. It goes to the write-ahead log; the
+/// timer is set by the caller.
 /// @return 0 if the node was appended successfully, 1 otherwise.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t deadline);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+/// Appends a new key value pair whose value is not null terminated, like
+/// write_pair.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param value Value of the pair to be written.
+/// @param value_len Length of the value.
+/// @param deadline Wall clock time the pair expires at, 0 if it does not.
+/// @return 0 if the node was appended successfully, 1 otherwise.
+int write_pair_len(HashTable *ht, const char *key, const char *value, size_t value_len, uint64_t deadline);
+
+/// Writes a pair only if the key is at an expected version. Versions grow
+/// with every write and delete of the table, so a key that is deleted and
+/// written again never gets an old version back; a missing key is at
+/// version 0.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be written.
+/// @param expected Version the key must be at.
+/// @param value Value of the pair to be written.
+/// @param version Set to the new version, or to the current one on a mismatch.
+/// @return 0 if the pair was written, 1 on a version mismatch, -1 on failure.
+int cas_pair(HashTable *ht, const char *key, uint64_t expected, const char *value, uint64_t *version);
+
+/// Reads the value of given key straight into a buffer. Takes no lock and
+/// allocates no memory.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to be read.
+/// @param value Buffer the value is copied to, always null terminated.
+/// @param size Size of the buffer; longer values are truncated.
+/// @param len If not NULL, set to the whole length of the value, which is
+/// size or more when it was truncated.
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, char *value, size_t size, size_t *len);
+
+/// Copies the value of given key, whatever its length. Takes no lock.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to be read.
+/// @param len If not NULL, set to the length of the value.
+/// @return Null terminated copy to be freed by the caller, NULL if the key
+/// was not found.
+char *copy_pair(HashTable *ht, const char *key, size_t *len);
 
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
@@ -142,18 +316,46 @@ char* read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
-/// Subscribes a client to a key.
+/// Adds the usage counters of the filter of a table to stats.
+/// @param ht Hash table to be looked at.
+/// @param stats Structure the counters are added to.
+void filter_stats(HashTable *ht, BloomStats *stats);
+
+/// Checks the filter of the table for a key, so that commands can drop the
+/// keys that do not exist before taking any lock. Takes no lock.
+/// @param ht Hash table to check.
+/// @param key Key to look for.
+/// @return 0 if the key certainly does not exist, 1 if it may.
+int pair_may_exist(HashTable *ht, const char *key);
+
+/// Gets the version of a key. Must be called with the key's stripe locked.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair.
+/// @return Version of the key, 0 if it does not exist.
+uint64_t pair_version(HashTable *ht, const char *key);
+
+/// Deletes a pair through delete_pair if its key is still at a version. Used
+/// to expire keys without touching the ones written again since.
+/// @param ht Hash table to be modified.
+/// @param key Key of the pair to be deleted.
+/// @param version Version the key must be at.
+/// @return 0 if the pair was deleted, 1 otherwise.
+int expire_pair(HashTable *ht, const char *key, uint64_t version);
+
+/// Subscribes a client to a key. Must be called with the key's stripe locked,
+/// in read or write mode.
 /// @param ht Hash table to be modified.
 /// @param key Key to be subscribed to.
 /// @param client_fd File descriptor of the client to be subscribed.
 /// @return 1 if the key was not found, 0 otherwise.
 int subscribe_key(HashTable *ht, const char *key, int client_fd);
 
-/// Unsubscribes a client from a key.
+/// Unsubscribes a client from a key. Must be called with the key's stripe
+/// locked, in read or write mode.
 /// @param ht Hash table to be modified.
 /// @param key Key to be unsubscribed from.
 /// @param client_fd File descriptor of the client to be unsubscribed.
-/// @return 1 if the key was not found, 0 otherwise.
+/// @return 1 if the client was not subscribed to the key, 0 otherwise.
 int unsubscribe_key(HashTable *ht, const char *key, int client_fd);
 
 /// Frees the hashtable.
@@ -163,8 +365,117 @@ void free_table(HashTable *ht);
 /// Hashes a key.
 /// @param key Key to be hashed.
 /// @return Hashed key.
-int hash(const char *key);
+uint64_t hash(const char *key);
+
+/// Gets the index of the stripe that guards a key.
+/// @param ht Hash table the key belongs to.
+/// @param key Key to be locked.
+/// @return Index into ht->stripes.
+size_t stripe_index(HashTable *ht, const char *key);
+
+/// Starts loading the bucket of a key and the first node of its chain, or the
+/// control bytes of its first group of slots, into the cache. Must be called
+/// inside an epoch.
+/// @param ht Hash table the key belongs to.
+/// @param h Hash of the key.
+void prefetch_bucket(HashTable *ht, uint64_t h);
+
+/// Grows the table when it is overloaded and migrates a few buckets of an
+/// ongoing resize. Must be called without holding any lock of the table.
+/// @param ht Hash table to be rehashed.
+void rehash_step(HashTable *ht);
+
+/// Makes room for keys about to be added, growing a swiss table if the keys
+/// already reserved and these could fill it. Does nothing for the chains,
+/// which never fill up. Must be called without holding any lock of the table,
+/// and followed by release_pairs once the keys are written.
+/// @param ht Hash table to be written.
+/// @param num_pairs Maximum number of keys to be added.
+void reserve_pairs(HashTable *ht, size_t num_pairs);
+
+/// Gives back the room taken by reserve_pairs.
+/// @param ht Hash table that was written.
+/// @param num_pairs Number of keys given to reserve_pairs.
+void release_pairs(HashTable *ht, size_t num_pairs);
+
+/// Evicts pairs while the table holds more than max_bytes, using the CLOCK
+/// approximation of LRU: a hand sweeps the buckets or slots, sparing the pairs
+/// accessed since its last pass and evicting the others, whose subscribers
+/// are notified. Stripes that are busy are skipped. Must be called without
+/// holding any lock of the table.
+/// @param ht Hash table to be trimmed.
+void evict_pairs(HashTable *ht);
+
+/// Calls a function for every pair stored in the table. Takes no lock: pairs
+/// written or deleted during the traversal may or may not be visited.
+/// @param ht Hash table to be traversed.
+/// @param visit Function called for each node.
+/// @param arg Argument passed to visit.
+void for_each_pair(HashTable *ht, void (*visit)(KeyNode *node, void *arg), void *arg);
+
+/// Locks every stripe of a table in write mode, in index order. Does nothing
+/// for an owned table, whose stripes are never taken.
+/// @param ht Hash table to be locked.
+void lock_table(HashTable *ht);
+
+/// Unlocks the stripes locked by lock_table.
+/// @param ht Hash table to be unlocked.
+void unlock_table(HashTable *ht);
+
+/// Opens a read view of a table at its current version. Must be called with
+/// the table locked by lock_table, so that the views of several tables can be
+/// opened at the same point in time, and followed by view_close.
+/// @param ht Hash table to be viewed.
+/// @param view View to be opened; it must not move until it is closed.
+void view_open(HashTable *ht, ReadView *view);
+
+/// Gets the next pair a view holds, in key order: the pairs still stored as
+/// they were are copied from the table, taking the stripe of each key in
+/// turn, and the ones changed since the opening come from the retained pairs.
+/// Must be called before the view is closed.
+/// @param ht Hash table of the view.
+/// @param view Open view to be walked.
+/// @param pair Set to the next pair.
+/// @return 1 if a pair was found, 0 once the walk has passed every key.
+int view_next(HashTable *ht, ReadView *view, ViewPair *pair);
+
+/// Copies the value a key has in a view, if the key is still stored as it
+/// was when the view was opened. Takes the stripe of the key.
+/// @param ht Hash table of the view.
+/// @param view Open view to read from.
+/// @param key Key of the pair to be read.
+/// @param len If not NULL, set to the length of the value.
+/// @return Null terminated copy to be freed by the caller, NULL if the key
+/// changed since or did not exist: its value, if it had one, is then among
+/// the retained pairs once the view is closed.
+char *view_copy(HashTable *ht, ReadView *view, const char *key, size_t *len);
+
+/// Closes a view: writers stop handing values over to it, and its retained
+/// pairs are sorted by key.
+/// @param ht Hash table of the view.
+/// @param view Open view to be closed.
+void view_close(HashTable *ht, ReadView *view);
+
+/// Finds the retained pair of a key in a closed view.
+/// @param view Closed view to search.
+/// @param key Key of the pair.
+/// @return The pair, NULL if the view did not retain the key.
+const RetainedPair *view_retained(const ReadView *view, const char *key);
 
+/// Releases the retained pairs and the walk of a closed view.
+/// @param view View to be released.
+void view_free(ReadView *view);
 
+/// Copies the keys of a range, in key order. Takes no lock: keys written or
+/// deleted during the call may or may not be copied.
+/// @param ht Hash table to read from.
+/// @param start First key of the range.
+/// @param inclusive 0 to leave start itself out of the range.
+/// @param end Last key of the range.
+/// @param keys Array the keys are copied to.
+/// @param max_keys Maximum number of keys to copy.
+/// @return Number of keys copied.
+size_t scan_keys(HashTable *ht, const char *start, int inclusive, const char *end,
+                 char keys[][MAX_STRING_SIZE], size_t max_keys);
 
 #endif  // KVS_H
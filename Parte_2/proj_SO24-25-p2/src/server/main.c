@@ -7,13 +7,13 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/wait.h>
 #include <threads.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "constants.h"
 #include "kvs.h"
 #include "../common/io.h" 
@@ -21,6 +21,10 @@
 #include "../common/protocol.h"
 #include "parser.h"
 #include "operations.h"
+#include "epoch.h"
+#include "notify.h"
+#include "slab.h"
+#include "wal.h"
 
 // global variables
 stack* s;
@@ -47,6 +51,54 @@ void ignore_signals() {
   }
 
 // function to the manager pool threads
+// Copies the key of a request, the field after the opcode.
+// @return 0 on success, 1 if the request has no key or one too long.
+static int request_key(const char *buffer, size_t size, char key[MAX_STRING_SIZE]) {
+  const char *start = memchr(buffer, '|', size);
+  if (start == NULL) {
+    return 1;
+  }
+  start++;
+  size_t len = strnlen(start, size - (size_t) (start - buffer));
+  const char *end = memchr(start, '|', len);
+  if (end != NULL) {
+    len = (size_t) (end - start);
+  }
+  if (len == 0 || len >= MAX_STRING_SIZE) {
+    return 1;
+  }
+  memcpy(key, start, len);
+  key[len] = '\0';
+  return 0;
+}
+
+// Reads the key and the value that follow a CAS request, whose fields give
+// their lengths.
+// @param value Set to the value, to be freed by the caller.
+// @return 0 on success, 1 if the request is malformed or the pipe failed,
+// leaving the rest of the pipe unreadable.
+static int read_cas(int req_fd, const char *buffer, size_t size, char key[MAX_STRING_SIZE], uint64_t *version,
+                    char **value) {
+  char header[MAX_REQUEST_SIZE + 1];
+  size_t header_len = strnlen(buffer, size < MAX_REQUEST_SIZE ? size : MAX_REQUEST_SIZE);
+  memcpy(header, buffer, header_len);
+  header[header_len] = '\0';
+  size_t key_len;
+  size_t value_len;
+  if (sscanf(header, "%*d|%" SCNu64 "|%zu|%zu", version, &key_len, &value_len) != 3 || key_len == 0 ||
+      key_len >= MAX_STRING_SIZE || value_len > MAX_VALUE_SIZE) {
+    return 1;
+  }
+  *value = malloc(value_len + 1);
+  if (*value == NULL || read_all(req_fd, key, key_len, NULL) != 1 || read_all(req_fd, *value, value_len, NULL) != 1) {
+    free(*value);
+    return 1;
+  }
+  key[key_len] = '\0';
+  (*value)[value_len] = '\0';
+  return 0;
+}
+
 void* manager_pool() {
 
   ignore_signals();
@@ -87,6 +139,12 @@ void* manager_pool() {
     }
 
     Client *client = init_client(req_fd, resp_fd, notif_fd);
+    if (client == NULL) {
+      close(notif_fd);
+      close(resp_fd);
+      close(req_fd);
+      continue;
+    }
 
     // add the client to the client list
     pthread_mutex_lock(&clients_mutex);
@@ -127,11 +185,40 @@ void* manager_pool() {
         client_on = 0;
         break;
       } else {
-        int op_code = 0;
+        int op_code = atoi(buffer);
         char key[MAX_STRING_SIZE] = {0};
-        sscanf(buffer, "%d|%s", &op_code, key);
+        // an invalid key is left empty, which no subscription accepts
+        request_key(buffer, sizeof(buffer), key);
         int res = 0;
         switch (op_code) {
+
+        case OP_CODE_CAS: {
+          char *value = NULL;
+          uint64_t version = 0;
+          int failed = 1;
+          int malformed = read_cas(req_fd, buffer, sizeof(buffer), key, &version, &value);
+          if (!malformed) {
+            char *values[1] = {value};
+            kvs_cas(1, &key, &version, values, &failed);
+            free(value);
+          }
+
+          char response[MAX_STRING_SIZE];
+          int len = snprintf(response, sizeof(response), "5|%s|%" PRIu64, failed == 0 ? "OK" : "ERROR", version);
+          res = write_all(resp_fd, response, (size_t) len + 1);
+          // after a malformed request the pipe no longer starts at a request
+          if (res == -1 || malformed) {
+            printf("Pipe is compromised, disconnecting client...\n");
+            for (int i = 0; i < MAX_NUMBER_SUB; i++) {
+              if (strcmp(client->keys[i], "") != 0) {
+                kvs_unsubscribe(client->keys[i], notif_fd);
+              }
+            }
+            destroy_client(client);
+            client_on = 0;
+          }
+          break;
+        }
         
         case OP_CODE_SUBSCRIBE:
           if (kvs_subscribe(key, notif_fd) == 0) {
@@ -227,6 +314,7 @@ void* handle_job() {
     }
     int stop = 1;
     int total_backups = 1;
+    BackupChain backup_chain = {.deltas = -1, .position = 0};
 
     char file_path[PATH_MAX];
     char filename[FILENAME_MAX];
@@ -245,23 +333,45 @@ void* handle_job() {
 
     while (stop) {
       char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-      char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+      char *values[MAX_WRITE_SIZE];
       unsigned int delay;
       size_t num_pairs;
 
       switch (get_next(fd)) {
-        case CMD_WRITE:
-          num_pairs = parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        case CMD_WRITE: {
+          unsigned int ttls[MAX_WRITE_SIZE];
+          num_pairs = parse_write(fd, keys, values, ttls, MAX_WRITE_SIZE, MAX_STRING_SIZE);
           if (num_pairs == 0) {
             fprintf(stderr, "Invalid command. See HELP for usage\n");
             continue;
           }
 
-          if (kvs_write(num_pairs, keys, values)) {
+          if (kvs_write(num_pairs, keys, values, ttls)) {
             fprintf(stderr, "Failed to write pair\n");
           }
 
+          free_values(values, num_pairs);
           break;
+        }
+
+        case CMD_CAS: {
+          uint64_t versions[MAX_WRITE_SIZE];
+          int failed[MAX_WRITE_SIZE];
+          num_pairs = parse_cas(fd, keys, versions, values, MAX_WRITE_SIZE);
+          if (num_pairs == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+
+          int result = kvs_cas(num_pairs, keys, versions, values, failed);
+          free_values(values, num_pairs);
+          if (result) {
+            fprintf(stderr, "Failed to write pair\n");
+            break;
+          }
+          kvs_write_cas(num_pairs, keys, versions, failed, out_fd);
+          break;
+        }
 
         case CMD_READ:
           num_pairs = parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
@@ -289,11 +399,49 @@ void* handle_job() {
           }
           break;
 
+        case CMD_READ_PREFIX:
+          if (parse_prefix(fd, keys[0]) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+
+          if (kvs_read_prefix(keys[0], out_fd)) {
+            fprintf(stderr, "Failed to read prefix\n");
+          }
+          break;
+
+        case CMD_DELETE_PREFIX:
+          if (parse_prefix(fd, keys[0]) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+
+          if (kvs_delete_prefix(keys[0])) {
+            fprintf(stderr, "Failed to delete prefix\n");
+          }
+          break;
+
         case CMD_SHOW:
 
           kvs_show(out_fd);
           break;
 
+        case CMD_SCAN:
+          if (parse_scan(fd, keys[0], keys[1]) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+
+          if (kvs_scan(keys[0], keys[1], out_fd)) {
+            fprintf(stderr, "Failed to scan pairs\n");
+          }
+          break;
+
+        case CMD_STATS:
+
+          kvs_stats(out_fd);
+          break;
+
         case CMD_WAIT:
           if (parse_wait(fd, &delay, NULL) == -1) {
             fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -308,7 +456,8 @@ void* handle_job() {
 
         case CMD_BACKUP:
 
-          if (kvs_backup(max_backups, active_backups, &total_backups, file_path_no_extension, &active_backups_mutex)) {
+          if (kvs_backup(max_backups, active_backups, &total_backups, &backup_chain, file_path_no_extension,
+                         &active_backups_mutex)) {
             fprintf(stderr, "Failed to perform backup.\n");
           }
           break;
@@ -322,10 +471,15 @@ void* handle_job() {
           
           snprintf(help_info, sizeof(help_info), 
           "Available commands:\n"
-              "  WRITE [(key,value)(key2,value2),...]\n"
+              "  WRITE [(key,value)(key2,value2,ttl_ms),...]\n"
+              "  CAS [(key,version,value)(key2,version2,value2),...]\n"
               "  READ [key,key2,...]\n"
               "  DELETE [key,key2,...]\n"
+              "  READPREFIX [prefix]\n"
+              "  DELETEPREFIX [prefix]\n"
               "  SHOW\n"
+              "  SCAN [start,end]\n"
+              "  STATS\n"
               "  WAIT <delay_ms>\n"
               "  BACKUP\n" 
               "  HELP\n");
@@ -347,7 +501,9 @@ void* handle_job() {
     close(fd);
     close(out_fd);
     }
-    
+
+    epoch_thread_exit();
+    slab_thread_exit();
     return NULL;
 }
 
@@ -369,7 +525,8 @@ void handle_sigusr1(int signo) {
           }
         }
 
-        // close client pipes
+        // close client pipes, once no dispatcher is writing to them
+        notify_unregister(client->notif_fd);
         close(client->notif_fd);
         close(client->resp_fd);
         close(client->req_fd);
@@ -440,7 +597,102 @@ void* host() {
     return NULL;
 }
 
+// Reads a size in bytes, optionally followed by K, M or G.
+size_t parse_size(const char *arg) {
+  char *unit;
+  size_t size = (size_t) strtoull(arg, &unit, 10);
+  switch (*unit) {
+    case 'G': case 'g':
+      size *= 1024;
+      // fall through
+    case 'M': case 'm':
+      size *= 1024;
+      // fall through
+    case 'K': case 'k':
+      size *= 1024;
+      break;
+    default:
+      break;
+  }
+  return size;
+}
+
+void print_usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-s lock_stripes] [-S shards] [-m max_memory[K|M|G]] [-e chains|swiss] [-n deliver|coalesce|drop|disconnect] [-w wal_file] [-b text|binary] <jobs_dir> <max_backups> <max_threads> <register_fifo>\n", program);
+}
+
 int main(int argc, char *argv[]) {
+  size_t num_stripes = DEFAULT_STRIPES;
+  size_t num_shards = 0;
+  size_t max_bytes = 0;
+  enum TableEngine engine = ENGINE_CHAINS;
+  enum NotifyPolicy policy = NOTIFY_DELIVER;
+  const char *wal_path = NULL;
+  enum BackupFormat backup_format = BACKUP_TEXT;
+  int opt;
+
+  // optional flags come before the positional arguments
+  while ((opt = getopt(argc, argv, "s:S:m:e:n:w:b:")) != -1) {
+    switch (opt) {
+      case 's':
+        num_stripes = (size_t) strtoul(optarg, NULL, 10);
+        break;
+      case 'S':
+        num_shards = (size_t) strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        max_bytes = parse_size(optarg);
+        break;
+      case 'e':
+        if (strcmp(optarg, "chains") == 0) {
+          engine = ENGINE_CHAINS;
+          break;
+        }
+        if (strcmp(optarg, "swiss") == 0) {
+          engine = ENGINE_SWISS;
+          break;
+        }
+        print_usage(argv[0]);
+        return 1;
+      case 'w':
+        wal_path = optarg;
+        break;
+      case 'b':
+        if (strcmp(optarg, "text") == 0) {
+          backup_format = BACKUP_TEXT;
+          break;
+        }
+        if (strcmp(optarg, "binary") == 0) {
+          backup_format = BACKUP_BINARY;
+          break;
+        }
+        print_usage(argv[0]);
+        return 1;
+      case 'n':
+        if (strcmp(optarg, "deliver") == 0) {
+          policy = NOTIFY_DELIVER;
+          break;
+        }
+        if (strcmp(optarg, "coalesce") == 0) {
+          policy = NOTIFY_COALESCE;
+          break;
+        }
+        if (strcmp(optarg, "drop") == 0) {
+          policy = NOTIFY_DROP_OLDEST;
+          break;
+        }
+        if (strcmp(optarg, "disconnect") == 0) {
+          policy = NOTIFY_DISCONNECT;
+          break;
+        }
+        // fall through
+      default:
+        print_usage(argv[0]);
+        return 1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
 
   if (argc == 5) {
 
@@ -468,10 +720,21 @@ int main(int argc, char *argv[]) {
 
     dir = argv[1];
 
-    if (kvs_init()) {
+    notify_set_policy(policy);
+    kvs_set_backup_format(backup_format);
+    if (kvs_init(num_stripes, num_shards, max_bytes, engine)) {
       fprintf(stderr, "Failed to initialize KVS\n");
       return 1;
     }
+    // the state before the last stop is back before any session is accepted
+    if (wal_path != NULL && kvs_recover(wal_path) != 0) {
+      fprintf(stderr, "Failed to recover the KVS state\n");
+      return 1;
+    }
+    if (wal_path != NULL && wal_open(wal_path) != 0) {
+      fprintf(stderr, "Failed to open the write-ahead log\n");
+      return 1;
+    }
 
     s = create_stack();
     if (s == NULL) {
@@ -538,16 +801,7 @@ int main(int argc, char *argv[]) {
     }
     
     // wait for the backups to end
-    while (*active_backups > 0) {
-      int terminated = wait(NULL);
-      if (terminated == -1) {
-        fprintf(stderr, "Error waiting for backup\n");
-      } else {
-        pthread_mutex_lock(&active_backups_mutex);
-        (*active_backups)--;
-        pthread_mutex_unlock(&active_backups_mutex);
-      }
-    }
+    kvs_wait_backup(1, active_backups, &active_backups_mutex);
 
     // notify the host thread to close
     running = 0;
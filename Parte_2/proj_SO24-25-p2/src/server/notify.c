@@ -0,0 +1,568 @@
+#include "notify.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "../common/constants.h"
+
+// Formatted once and shared by the queues of all its subscribers.
+typedef struct Notification {
+    atomic_size_t refs;                  // queues still holding it
+    uint64_t hash;                       // hash of the key
+    size_t key_len;
+    size_t size;
+    char data[];
+} Notification;
+
+#define NO_POSITION UINT16_MAX
+
+typedef struct NotifyQueue {
+    int fd;
+    pthread_mutex_t mutex;               // guards everything below
+    pthread_cond_t idle;                 // signalled when no dispatcher holds the queue
+    pthread_cond_t room;                 // signalled when the queue is no longer full
+    Notification *ring[NOTIFY_QUEUE_DEPTH];
+    size_t head;
+    size_t count;
+    // positions in ring of the queued notifications by the hash of their key,
+    // NO_POSITION where free; only kept by NOTIFY_COALESCE
+    uint16_t index[NOTIFY_INDEX_SIZE];
+    int scheduled;                       // on the ready list or being drained
+    int closed;                          // unregistered, or its pipe failed
+    int sever;                           // the pipe must be closed by the dispatcher
+    struct NotifyQueue *next_ready;
+} NotifyQueue;
+
+// Queues indexed by their pipe, grown as higher descriptors show up.
+static NotifyQueue **queues = NULL;
+static size_t num_queues = 0;
+static pthread_rwlock_t queues_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Queues with notifications and no dispatcher, oldest first.
+static NotifyQueue *ready_head = NULL;
+static NotifyQueue *ready_tail = NULL;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t dispatchers[NOTIFY_THREADS];
+static int started = 0;
+static int stopping = 0;                 // guarded by ready_mutex
+static enum NotifyPolicy policy = NOTIFY_DELIVER;
+static int null_fd = -1;                 // takes the place of severed pipes
+static atomic_size_t pending = 0;
+static atomic_size_t dropped = 0;
+static atomic_size_t coalesced = 0;
+
+// Queues the calling thread scheduled while holding, not handed to the
+// dispatchers yet.
+static _Thread_local int holding = 0;
+static _Thread_local NotifyQueue *held = NULL;
+
+static void release_notification(Notification *notification) {
+    if (atomic_fetch_sub_explicit(&notification->refs, 1, memory_order_acq_rel) == 1) {
+        free(notification);
+    }
+}
+
+static inline int same_key(const Notification *a, const Notification *b) {
+    // the key starts right after the length and the opening parenthesis
+    return a->hash == b->hash && a->key_len == b->key_len &&
+           memcmp(a->data + sizeof(uint32_t) + 1, b->data + sizeof(uint32_t) + 1, a->key_len) == 0;
+}
+
+// Finds the entry of the index that holds the queued notification of a key,
+// or the free entry where it would go. Must be called with the queue locked.
+static size_t find_entry(NotifyQueue *queue, const Notification *notification) {
+    size_t i = notification->hash & (NOTIFY_INDEX_SIZE - 1);
+    while (queue->index[i] != NO_POSITION && !same_key(queue->ring[queue->index[i]], notification)) {
+        i = (i + 1) & (NOTIFY_INDEX_SIZE - 1);
+    }
+    return i;
+}
+
+// Takes the notification at a position of the ring out of the index. The
+// entries after it are moved back, so that lookups never meet a gap. Must be
+// called with the queue locked.
+static void unindex(NotifyQueue *queue, size_t position) {
+    if (policy != NOTIFY_COALESCE) {
+        return;
+    }
+    size_t i = find_entry(queue, queue->ring[position]);
+    if (queue->index[i] != position) {
+        return;
+    }
+    for (size_t j = (i + 1) & (NOTIFY_INDEX_SIZE - 1); queue->index[j] != NO_POSITION;
+         j = (j + 1) & (NOTIFY_INDEX_SIZE - 1)) {
+        size_t home = queue->ring[queue->index[j]]->hash & (NOTIFY_INDEX_SIZE - 1);
+        // an entry may fill the gap unless its home lies between the gap and it
+        if (((j - home) & (NOTIFY_INDEX_SIZE - 1)) >= ((j - i) & (NOTIFY_INDEX_SIZE - 1))) {
+            queue->index[i] = queue->index[j];
+            i = j;
+        }
+    }
+    queue->index[i] = NO_POSITION;
+}
+
+// Takes the oldest notification out of a queue. Must be called with the
+// queue locked.
+static Notification *pop_notification(NotifyQueue *queue) {
+    Notification *notification = queue->ring[queue->head];
+    unindex(queue, queue->head);
+    queue->head = (queue->head + 1) % NOTIFY_QUEUE_DEPTH;
+    queue->count--;
+    return notification;
+}
+
+// Drops the notifications of a queue. Must be called with the queue locked.
+static void discard_queue(NotifyQueue *queue) {
+    while (queue->count > 0) {
+        release_notification(pop_notification(queue));
+    }
+    pthread_cond_broadcast(&queue->room);
+}
+
+// Appends a scheduled queue to the ready list.
+static void make_ready(NotifyQueue *queue) {
+    queue->next_ready = NULL;
+    pthread_mutex_lock(&ready_mutex);
+    if (ready_tail == NULL) {
+        ready_head = queue;
+    } else {
+        ready_tail->next_ready = queue;
+    }
+    ready_tail = queue;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
+}
+
+// Hands a queue to the dispatchers. Must be called with the queue locked.
+static void schedule_queue(NotifyQueue *queue) {
+    queue->scheduled = 1;
+    make_ready(queue);
+}
+
+// Hands the queues the calling thread holds to the dispatchers.
+static void flush_held() {
+    while (held != NULL) {
+        NotifyQueue *queue = held;
+        held = queue->next_ready;
+        make_ready(queue);
+    }
+}
+
+// Makes room in a full queue according to the policy. Must be called with the
+// queue locked.
+// @return 1 if there is room, 0 if the client was cut off.
+static int make_room(NotifyQueue *queue) {
+    switch (policy) {
+        case NOTIFY_DELIVER:
+            // the queues held back by this thread could never drain otherwise
+            flush_held();
+            while (queue->count == NOTIFY_QUEUE_DEPTH && !queue->closed) {
+                pthread_cond_wait(&queue->room, &queue->mutex);
+            }
+            return !queue->closed;
+        case NOTIFY_COALESCE:
+        case NOTIFY_DROP_OLDEST:
+            release_notification(pop_notification(queue));
+            atomic_fetch_sub_explicit(&pending, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return 1;
+        case NOTIFY_DISCONNECT:
+            break;
+    }
+
+    // the dispatcher closes the pipe, the client then disconnects on its own
+    queue->closed = 1;
+    queue->sever = 1;
+    atomic_fetch_add_explicit(&dropped, queue->count, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&pending, queue->count, memory_order_relaxed);
+    discard_queue(queue);
+    if (!queue->scheduled) {
+        schedule_queue(queue);
+    }
+    return 0;
+}
+
+// Appends a notification to a queue.
+// @return 1 if it was queued, 0 if it was dropped.
+static int push_notification(NotifyQueue *queue, Notification *notification) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+
+    if (policy == NOTIFY_COALESCE) {
+        // the queue only holds what no dispatcher took yet
+        size_t i = find_entry(queue, notification);
+        if (queue->index[i] != NO_POSITION) {
+            Notification **queued = &queue->ring[queue->index[i]];
+            release_notification(*queued);
+            *queued = notification;
+            atomic_fetch_add_explicit(&coalesced, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&queue->mutex);
+            return 1;
+        }
+    }
+
+    if (queue->count == NOTIFY_QUEUE_DEPTH && !make_room(queue)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 0;
+    }
+    size_t position = (queue->head + queue->count) % NOTIFY_QUEUE_DEPTH;
+    queue->ring[position] = notification;
+    queue->count++;
+    if (policy == NOTIFY_COALESCE) {
+        // looked up again, as making room may have moved the entries
+        queue->index[find_entry(queue, notification)] = (uint16_t) position;
+    }
+    atomic_fetch_add_explicit(&pending, 1, memory_order_relaxed);
+    if (!queue->scheduled && holding > 0) {
+        // scheduled, so that no one else hands it over, but kept until the
+        // thread is done with the command
+        queue->scheduled = 1;
+        queue->next_ready = held;
+        held = queue;
+    } else if (!queue->scheduled) {
+        schedule_queue(queue);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return 1;
+}
+
+// Writes a batch of notifications with as few calls as the pipe allows,
+// going on after partial writes.
+// @return Number of notifications written whole, less than count on error.
+static size_t write_batch(int fd, Notification *batch[], size_t count) {
+    struct iovec iov[NOTIFY_IOV_MAX];
+    size_t done = 0;    // notifications written whole
+    size_t offset = 0;  // bytes of batch[done] already written
+
+    while (done < count) {
+        int num_iov = 0;
+        for (size_t i = done; i < count && num_iov < NOTIFY_IOV_MAX; i++, num_iov++) {
+            size_t skip = i == done ? offset : 0;
+            iov[num_iov].iov_base = batch[i]->data + skip;
+            iov[num_iov].iov_len = batch[i]->size - skip;
+        }
+        ssize_t written = writev(fd, iov, num_iov);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return done;
+        }
+
+        size_t left = (size_t) written;
+        while (done < count && left >= batch[done]->size - offset) {
+            left -= batch[done]->size - offset;
+            offset = 0;
+            done++;
+        }
+        offset += left;
+    }
+    return done;
+}
+
+// Writes what a queue holds to its pipe. The queue is only unlocked during
+// the writes, and stays scheduled, so no other dispatcher can take it and the
+// notifications go out in order.
+static void drain_queue(NotifyQueue *queue) {
+    Notification *batch[NOTIFY_QUEUE_DEPTH];
+
+    pthread_mutex_lock(&queue->mutex);
+    size_t count = queue->count;
+    for (size_t i = 0; i < count; i++) {
+        batch[i] = pop_notification(queue);
+    }
+    queue->head = 0;
+    pthread_cond_broadcast(&queue->room);
+    int failed = queue->closed;
+    int sever = queue->sever;
+    queue->sever = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    // the descriptor stays open for its owner to close, but no longer refers
+    // to the pipe, so the client sees the end of it
+    if (sever && dup2(null_fd, queue->fd) == -1) {
+        perror("Failed to close notification pipe");
+    }
+
+    size_t written = failed ? 0 : write_batch(queue->fd, batch, count);
+    if (written < count) {
+        failed = 1;
+        atomic_fetch_add_explicit(&dropped, count - written, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&pending, count, memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        release_notification(batch[i]);
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    if (failed && !queue->closed) {
+        // the client is gone, what it is sent until it is unregistered is dropped
+        queue->closed = 1;
+        atomic_fetch_add_explicit(&dropped, queue->count, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&pending, queue->count, memory_order_relaxed);
+        discard_queue(queue);
+    }
+    if (queue->count > 0) {
+        schedule_queue(queue);
+    } else {
+        queue->scheduled = 0;
+        pthread_cond_broadcast(&queue->idle);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Frees a queue taken out of the registry. No writer can find it anymore, so
+// only a dispatcher may still hold it.
+static void retire_queue(NotifyQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    atomic_fetch_add_explicit(&dropped, queue->count, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&pending, queue->count, memory_order_relaxed);
+    discard_queue(queue);
+    while (queue->scheduled) {
+        pthread_cond_wait(&queue->idle, &queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->idle);
+    pthread_cond_destroy(&queue->room);
+    free(queue);
+}
+
+void notify_hold() {
+    holding++;
+}
+
+void notify_flush() {
+    if (--holding > 0) {
+        return;
+    }
+    flush_held();
+}
+
+void notify_set_policy(enum NotifyPolicy new_policy) {
+    policy = new_policy;
+}
+
+static void *run_dispatcher() {
+    // a client that closes its pipe must not take the server down with it,
+    // and the signals of the server are handled by the host thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&ready_mutex);
+        while (ready_head == NULL && !stopping) {
+            pthread_cond_wait(&ready_cond, &ready_mutex);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&ready_mutex);
+            return NULL;
+        }
+        NotifyQueue *queue = ready_head;
+        ready_head = queue->next_ready;
+        if (ready_head == NULL) {
+            ready_tail = NULL;
+        }
+        pthread_mutex_unlock(&ready_mutex);
+
+        drain_queue(queue);
+    }
+}
+
+int notify_start() {
+    if (started) {
+        return 1;
+    }
+
+    null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        perror("Failed to open /dev/null");
+        return 1;
+    }
+
+    stopping = 0;
+    for (size_t i = 0; i < NOTIFY_THREADS; i++) {
+        if (pthread_create(&dispatchers[i], NULL, run_dispatcher, NULL) != 0) {
+            pthread_mutex_lock(&ready_mutex);
+            stopping = 1;
+            pthread_cond_broadcast(&ready_cond);
+            pthread_mutex_unlock(&ready_mutex);
+            for (size_t j = 0; j < i; j++) {
+                pthread_join(dispatchers[j], NULL);
+            }
+            close(null_fd);
+            return 1;
+        }
+    }
+    started = 1;
+    return 0;
+}
+
+void notify_stop() {
+    if (!started) {
+        return;
+    }
+
+    pthread_mutex_lock(&ready_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
+    for (size_t i = 0; i < NOTIFY_THREADS; i++) {
+        pthread_join(dispatchers[i], NULL);
+    }
+
+    // the dispatchers are gone, so the queues are no longer shared
+    for (size_t fd = 0; fd < num_queues; fd++) {
+        NotifyQueue *queue = queues[fd];
+        if (queue != NULL) {
+            discard_queue(queue);
+            pthread_mutex_destroy(&queue->mutex);
+            pthread_cond_destroy(&queue->idle);
+            pthread_cond_destroy(&queue->room);
+            free(queue);
+        }
+    }
+    free(queues);
+    queues = NULL;
+    num_queues = 0;
+    ready_head = NULL;
+    ready_tail = NULL;
+    close(null_fd);
+    null_fd = -1;
+    atomic_store(&pending, 0);
+    started = 0;
+}
+
+int notify_register(int fd) {
+    if (fd < 0) {
+        return 1;
+    }
+    NotifyQueue *queue = malloc(sizeof(NotifyQueue));
+    if (!queue) {
+        perror("Failed to allocate notification queue");
+        return 1;
+    }
+    queue->fd = fd;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+    pthread_cond_init(&queue->room, NULL);
+    memset(queue->index, 0xFF, sizeof(queue->index));
+    queue->head = 0;
+    queue->count = 0;
+    queue->scheduled = 0;
+    queue->closed = 0;
+    queue->sever = 0;
+    queue->next_ready = NULL;
+
+    pthread_rwlock_wrlock(&queues_lock);
+    if ((size_t) fd >= num_queues) {
+        size_t size = num_queues > 0 ? num_queues : 64;
+        while (size <= (size_t) fd) {
+            size *= 2;
+        }
+        NotifyQueue **grown = realloc(queues, size * sizeof(NotifyQueue *));
+        if (!grown) {
+            pthread_rwlock_unlock(&queues_lock);
+            pthread_mutex_destroy(&queue->mutex);
+            pthread_cond_destroy(&queue->idle);
+            pthread_cond_destroy(&queue->room);
+            free(queue);
+            return 1;
+        }
+        memset(grown + num_queues, 0, (size - num_queues) * sizeof(NotifyQueue *));
+        queues = grown;
+        num_queues = size;
+    }
+    NotifyQueue *old = queues[fd];
+    queues[fd] = queue;
+    pthread_rwlock_unlock(&queues_lock);
+
+    // a pipe that was closed without being unregistered
+    if (old != NULL) {
+        retire_queue(old);
+    }
+    return 0;
+}
+
+void notify_unregister(int fd) {
+    pthread_rwlock_wrlock(&queues_lock);
+    NotifyQueue *queue = NULL;
+    if (fd >= 0 && (size_t) fd < num_queues) {
+        queue = queues[fd];
+        queues[fd] = NULL;
+    }
+    pthread_rwlock_unlock(&queues_lock);
+    if (queue != NULL) {
+        retire_queue(queue);
+    }
+}
+
+void notify_send(const int fds[], size_t count, const char *key, uint64_t h, const char *value) {
+    if (count == 0) {
+        return;
+    }
+
+    // the message is its length followed by "(key,value)"
+    size_t len = strlen(key) + strlen(value) + 3;
+    if (len > MAX_NOTIFICATION_SIZE) {
+        // longer than any client accepts
+        atomic_fetch_add_explicit(&dropped, count, memory_order_relaxed);
+        return;
+    }
+    Notification *notification = malloc(sizeof(Notification) + sizeof(uint32_t) + len + 1);
+    if (!notification) {
+        perror("Failed to allocate notification");
+        atomic_fetch_add_explicit(&dropped, count, memory_order_relaxed);
+        return;
+    }
+    uint32_t header = htonl((uint32_t) len);
+    memcpy(notification->data, &header, sizeof(header));
+    snprintf(notification->data + sizeof(header), len + 1, "(%s,%s)", key, value);
+    notification->hash = h;
+    notification->key_len = strlen(key);
+    notification->size = sizeof(header) + len;
+    // one extra reference until every queue had its chance
+    atomic_init(&notification->refs, count + 1);
+
+    pthread_rwlock_rdlock(&queues_lock);
+    for (size_t i = 0; i < count; i++) {
+        int fd = fds[i];
+        NotifyQueue *queue = fd >= 0 && (size_t) fd < num_queues ? queues[fd] : NULL;
+        if (queue == NULL || !push_notification(queue, notification)) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            release_notification(notification);
+        }
+    }
+    pthread_rwlock_unlock(&queues_lock);
+    release_notification(notification);
+}
+
+size_t notify_pending() {
+    return atomic_load(&pending);
+}
+
+size_t notify_dropped() {
+    return atomic_load(&dropped);
+}
+
+size_t notify_coalesced() {
+    return atomic_load(&coalesced);
+}
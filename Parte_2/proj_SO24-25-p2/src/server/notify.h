@@ -0,0 +1,87 @@
+#ifndef KVS_NOTIFY_H
+#define KVS_NOTIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NOTIFY_THREADS 2          // dispatcher threads
+#define NOTIFY_QUEUE_DEPTH 1024   // notifications a client can have waiting
+#define NOTIFY_IOV_MAX 1024       // buffers a single writev may gather, the IOV_MAX of Linux
+#define NOTIFY_INDEX_SIZE 2048    // entries of the key index of a queue, twice its depth (power of two)
+
+// Delivery of notifications. Every notification pipe registered here gets a
+// bounded queue; writers only format a notification once and append it to
+// the queues of its subscribers, and a pool of dispatcher threads writes the
+// queued notifications to the pipes. A slow client therefore only delays its
+// own notifications and, when every notification must be delivered, the
+// writers that fill its queue; never the other clients.
+//
+// A queue is drained by one dispatcher at a time, so a client receives its
+// notifications in the order they were queued. A dispatcher writes everything
+// a queue holds with one writev, each notification still framed by its
+// length, and a command that changes several keys holds its notifications
+// back until it is done, so that its subscribers get them in one write. What happens to a client that
+// falls behind is up to the policy of the server; notifications for a pipe
+// that is not registered, or whose write failed, are dropped.
+
+// What to do with the notifications of a client that does not keep up.
+enum NotifyPolicy {
+    NOTIFY_DELIVER,       // every notification is delivered; a full queue makes the writer wait
+    NOTIFY_COALESCE,      // a queued notification of the key is replaced by the new one;
+                          // a full queue drops its oldest notification
+    NOTIFY_DROP_OLDEST,   // a full queue drops its oldest notification
+    NOTIFY_DISCONNECT,    // a full queue closes the notification pipe of its client
+};
+
+/// Sets the policy for clients that fall behind. Must be called before the
+/// dispatchers are started.
+/// @param policy Policy of the server.
+void notify_set_policy(enum NotifyPolicy policy);
+
+/// Starts the dispatcher threads.
+/// @return 0 on success, 1 otherwise.
+int notify_start();
+
+/// Stops the dispatcher threads and drops the notifications still queued.
+void notify_stop();
+
+/// Holds back the notifications the calling thread queues, until the
+/// matching notify_flush. Calls may be nested.
+void notify_hold();
+
+/// Hands the queues that got notifications since notify_hold to the
+/// dispatchers.
+void notify_flush();
+
+/// Gives a notification pipe its queue.
+/// @param fd Notification pipe of a client.
+/// @return 0 on success, 1 on failure.
+int notify_register(int fd);
+
+/// Drops the queue of a notification pipe and what is still in it. Waits for
+/// a dispatcher that is writing to the pipe, so that it can be closed next.
+/// @param fd Notification pipe of a client.
+void notify_unregister(int fd);
+
+/// Queues a notification for some pipes, as its length followed by
+/// "(key,value)". One longer than MAX_NOTIFICATION_SIZE is dropped.
+/// @param fds Notification pipes of the subscribers.
+/// @param count Number of pipes.
+/// @param key Key that changed.
+/// @param h Hash of the key.
+/// @param value New value of the key, or the reason it was removed.
+void notify_send(const int fds[], size_t count, const char *key, uint64_t h, const char *value);
+
+/// Gets the number of notifications waiting in the queues.
+/// @return Number of notifications queued and not written yet.
+size_t notify_pending();
+
+/// Gets the number of notifications dropped.
+/// @return Number of notifications that were never written to their pipe.
+size_t notify_dropped();
+
+/// Gets the number of notifications replaced by a newer one of their key.
+/// @return Number of notifications coalesced.
+size_t notify_coalesced();
+
+#endif  // KVS_NOTIFY_H
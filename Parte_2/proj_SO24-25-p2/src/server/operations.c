@@ -1,6 +1,8 @@
 #include "operations.h"
+#include <inttypes.h>
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -10,11 +12,33 @@
 #include <threads.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include "kvs.h"
+#include "batch.h"
+#include "dirty.h"
+#include "epoch.h"
+#include "expiry.h"
+#include "notify.h"
+#include "recovery.h"
+#include "shard.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "wal.h"
 #include "constants.h"
 
+// table of the lock-based mode, NULL when the store is sharded
 static struct HashTable* kvs_table = NULL;
+static enum BackupFormat backup_format = BACKUP_TEXT;
+
+static int kvs_initialized() {
+  return kvs_table != NULL || shard_count() > 0;
+}
+
+// Number of tables of the store: one, or one per shard. The tables of the
+// shards are only ever touched by their owners, through shard_call and
+// shard_each.
+static size_t table_count() {
+  return kvs_table != NULL ? 1 : shard_count();
+}
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -23,182 +47,642 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
-void swap(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int i, int j) {
-  char temp[MAX_STRING_SIZE];
+static int compare_keys(const void *a, const void *b) {
+  return strcmp((const char *) a, (const char *) b);
+}
 
-  memcpy(temp, keys[i], MAX_STRING_SIZE); 
-  memcpy(keys[i], keys[j], MAX_STRING_SIZE); 
-  memcpy(keys[j], temp, MAX_STRING_SIZE); 
+void write_to_open_file(int fd, const char *content) {
+  size_t len = strlen(content);
+  size_t done = 0;
+
+  while (len > done) {
+    ssize_t bytes_written = write(fd, content + done, len - done);
 
-  if (keys != values) {
-    memcpy(temp, values[i], MAX_STRING_SIZE); 
-    memcpy(values[i], values[j], MAX_STRING_SIZE); 
-    memcpy(values[j], temp, MAX_STRING_SIZE); 
+    if (bytes_written < 0) {
+      fprintf(stderr, "Write error");
+      return;
+    }
+
+    done += (size_t) bytes_written;
   }
 }
 
-void sortByHash(char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t size) {
-  for (size_t i = 0; i < size - 1; ++i) {
-    for (size_t j = 0; j < size - i - 1; ++j) {
-      if (hash(keys[j]) > hash(keys[j + 1])) {
-          swap(keys, values, (int) j, (int) j + 1);
-      }
+// Removes the keys whose timers fired, unless they were written or deleted
+// since. Called by the expiry thread.
+static size_t expire_keys(size_t num_keys, char keys[][MAX_STRING_SIZE], uint64_t versions[]) {
+  int kept[num_keys];
+
+  if (kvs_table == NULL) {
+    shard_expire(num_keys, keys, versions, kept);
+  } else {
+    BatchPlan plan;
+    if (plan_batch(&plan, kvs_table, num_keys, keys, BATCH_KEEP_ALL) != 0) {
+      return 0;
     }
+    notify_hold();
+    lock_batch(&plan);
+    for (size_t i = 0; i < num_keys; i++) {
+      kept[i] = expire_pair(kvs_table, keys[i], versions[i]);
+    }
+    unlock_batch(&plan);
+    notify_flush();
+    free_batch(&plan);
+    rehash_step(kvs_table);
+  }
+
+  size_t removed = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    removed += kept[i] == 0;
   }
+  return removed;
 }
 
-int* lock_all_keys(HashTable *ht, char key[][MAX_STRING_SIZE], size_t size, char type) {
-  int *locks = calloc(TABLE_SIZE, sizeof(int) * TABLE_SIZE);
+void kvs_set_backup_format(enum BackupFormat format) {
+  backup_format = format;
+}
 
-  for (size_t i = 0; i < size; i++) {
-    int index = hash(key[i]);
-    if (locks[index] == 0) {
-      if (type == 'r') {
-        pthread_rwlock_rdlock(&ht->rwlock[index]);
-      } else {
-        pthread_rwlock_wrlock(&ht->rwlock[index]);
-      }
+int kvs_init(size_t num_stripes, size_t num_shards, size_t max_bytes, enum TableEngine engine) {
+  if (kvs_initialized()) {
+    fprintf(stderr, "KVS state has already been initialized\n");
+    return 1;
+  }
+
+  if (num_shards > 0) {
+    if (shards_init(num_shards, engine, max_bytes) != 0) {
+      return 1;
     }
-      locks[index] = 1;
+  } else {
+    kvs_table = create_hash_table(num_stripes, engine);
+    if (kvs_table == NULL) {
+      return 1;
+    }
+    kvs_table->max_bytes = max_bytes;
   }
-  
-  return locks;
+
+  if (notify_start() != 0) {
+    return 1;
+  }
+  return expiry_start(expire_keys);
 }
 
-void unlock_all_keys(HashTable *ht, int *locks) {
-  for (size_t i = 0; i < TABLE_SIZE ; i++) {
-    if (locks[i] == 1) {
-      pthread_rwlock_unlock(&ht->rwlock[i]);
-    }
+int kvs_terminate() {
+  if (!kvs_initialized()) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  expiry_stop();
+  notify_stop();
+  wal_close();
+
+  if (kvs_table == NULL) {
+    shards_terminate();
+    return 0;
   }
 
-  free(locks);
-  return;
+  free_table(kvs_table);
+  return 0;
 }
 
-void write_to_open_file(int fd, const char *content) {
-  size_t len = strlen(content);
-  size_t done = 0;
+// A change of a recovery, placed in the partition of its key.
+typedef struct PlannedChange {
+  const char *key;
+  const char *value;       // NULL if the key was removed, not null terminated
+  size_t value_len;        // length of the value
+  uint64_t deadline;       // time the key expires at, 0 if it does not
+  size_t index;            // position of the change in the log
+} PlannedChange;
+
+// Changes of a recovery, grouped by the stripe they fall in, so that each
+// stripe is filled by a single thread. A shard is a single partition, filled
+// by its owner.
+typedef struct RecoveryWork {
+  PlannedChange *changes;  // the changes of partition p are changes[starts[p]] to changes[starts[p + 1] - 1]
+  size_t *starts;
+  size_t num_stripes;      // stripes of each table
+  size_t num_partitions;   // one per stripe of every table
+  size_t *writes;          // pairs written to each table
+  atomic_size_t next;      // next partition to be taken
+} RecoveryWork;
+
+static size_t partition_of(const char *key) {
+  return kvs_table != NULL ? stripe_index(kvs_table, key) : shard_of(key);
+}
 
-  while (len > done) {
-    ssize_t bytes_written = write(fd, content + done, len - done);
+// Orders changes by key and then by log position, so that the changes of a
+// key are applied in the order they were made.
+static int compare_changes(const void *a, const void *b) {
+  const PlannedChange *x = a;
+  const PlannedChange *y = b;
+  int cmp = strcmp(x->key, y->key);
+  return cmp != 0 ? cmp : (x->index > y->index) - (x->index < y->index);
+}
 
-    if (bytes_written < 0) {
-      fprintf(stderr, "Write error");
-      return;
+// Applies the changes of a partition, a chunk at a time.
+// @param ht Table of the partition.
+// @param stripe Stripe of the partition, NULL when the caller owns the table.
+static void apply_partition(RecoveryWork *work, size_t p, HashTable *ht, Stripe *stripe) {
+  size_t end = work->starts[p + 1];
+
+  for (size_t i = work->starts[p]; i < end; i += RECOVERY_CHUNK) {
+    size_t chunk_end = i + RECOVERY_CHUNK < end ? i + RECOVERY_CHUNK : end;
+    if (stripe != NULL) {
+      pthread_rwlock_wrlock(&stripe->rwlock);
+    }
+    for (size_t j = i; j < chunk_end; j++) {
+      const PlannedChange *change = &work->changes[j];
+      unsigned int ttl = change->deadline != 0 ? expiry_time_left(change->deadline) : 0;
+      // only the last change of a key gets its timer back
+      int last = j + 1 == end || strcmp(work->changes[j + 1].key, change->key) != 0;
+      if (change->value == NULL || (change->deadline != 0 && ttl == 0)) {
+        // removed, or its TTL ran out while the server was down
+        delete_pair(ht, change->key);
+      } else if (write_pair_len(ht, change->key, change->value, change->value_len, change->deadline) != 0) {
+        fprintf(stderr, "Failed to recover keypair (%s,%.*s)\n", change->key, (int) change->value_len,
+                change->value);
+      } else if (ttl > 0 && last && expiry_add(change->key, pair_version(ht, change->key), ttl) != 0) {
+        fprintf(stderr, "Failed to set the TTL of %s\n", change->key);
+      }
+    }
+    if (stripe != NULL) {
+      pthread_rwlock_unlock(&stripe->rwlock);
+    }
+    // one rehash step per change, so that the chains grow as fast as
+    // they are filled
+    for (size_t j = i; j < chunk_end; j++) {
+      rehash_step(ht);
     }
+  }
+}
 
-    done += (size_t) bytes_written;
+// Applies the changes of the stripes of the table not taken yet.
+static void apply_partitions(RecoveryWork *work) {
+  size_t p;
+  while ((p = atomic_fetch_add(&work->next, 1)) < work->num_partitions) {
+    apply_partition(work, p, kvs_table, &kvs_table->stripes[p]);
   }
 }
 
-int kvs_init() {
-  if (kvs_table != NULL) {
-    fprintf(stderr, "KVS state has already been initialized\n");
+// Applies the changes of a shard, run by its owner.
+static void recover_shard(HashTable *ht, size_t index, void *arg) {
+  RecoveryWork *work = arg;
+  // the swiss tables are grown once, up front
+  reserve_pairs(ht, work->writes[index]);
+  apply_partition(work, index, ht, NULL);
+  release_pairs(ht, work->writes[index]);
+  evict_pairs(ht);
+}
+
+static void *run_recovery(void *arg) {
+  apply_partitions(arg);
+  epoch_thread_exit();
+  slab_thread_exit();
+  return NULL;
+}
+
+// Groups the changes by partition with a counting sort, and sorts each
+// partition by key: the ordered index is then filled front to back, along
+// nodes that are still in the cache.
+// Counts the pairs written to each table in work->writes.
+// @return 0 on success, 1 otherwise.
+static int plan_recovery(RecoveryWork *work, const RecoveryLog *log) {
+  size_t *partitions = malloc(log->count * sizeof(size_t));
+  size_t *cursors = malloc(work->num_partitions * sizeof(size_t));
+  work->changes = malloc(log->count * sizeof(PlannedChange));
+  work->starts = calloc(work->num_partitions + 1, sizeof(size_t));
+  if (!partitions || !cursors || !work->changes || !work->starts) {
+    free(partitions);
+    free(cursors);
     return 1;
   }
 
-  kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  for (size_t i = 0; i < log->count; i++) {
+    partitions[i] = partition_of(recovered_key(log, &log->changes[i]));
+    work->starts[partitions[i] + 1]++;
+    if (log->changes[i].value != RECOVERED_REMOVAL) {
+      work->writes[partitions[i] / work->num_stripes]++;
+    }
+  }
+  for (size_t p = 0; p < work->num_partitions; p++) {
+    work->starts[p + 1] += work->starts[p];
+    cursors[p] = work->starts[p];
+  }
+  for (size_t i = 0; i < log->count; i++) {
+    PlannedChange *change = &work->changes[cursors[partitions[i]]++];
+    change->key = recovered_key(log, &log->changes[i]);
+    change->value = recovered_value(log, &log->changes[i]);
+    change->value_len = log->changes[i].value_len;
+    change->deadline = log->changes[i].deadline;
+    change->index = i;
+  }
+  for (size_t p = 0; p < work->num_partitions; p++) {
+    qsort(work->changes + work->starts[p], work->starts[p + 1] - work->starts[p], sizeof(PlannedChange),
+          compare_changes);
+  }
+
+  free(partitions);
+  free(cursors);
+  return 0;
 }
 
-int kvs_terminate() {
-  if (kvs_table == NULL) {
+int kvs_recover(const char *wal_path) {
+  if (!kvs_initialized()) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  free_table(kvs_table);
+  RecoveryLog log;
+  if (recovery_load(wal_path, &log) != 0) {
+    return 1;
+  }
+  if (log.count == 0) {
+    recovery_free(&log);
+    return 0;
+  }
+
+  size_t num_tables = table_count();
+  size_t writes[num_tables];
+  memset(writes, 0, sizeof(writes));
+  RecoveryWork work = {.num_stripes = kvs_table != NULL ? kvs_table->num_stripes : 1, .writes = writes};
+  work.num_partitions = num_tables * work.num_stripes;
+  atomic_init(&work.next, 0);
+  if (plan_recovery(&work, &log) != 0) {
+    fprintf(stderr, "Failed to plan the recovery\n");
+    free(work.changes);
+    free(work.starts);
+    recovery_free(&log);
+    return 1;
+  }
+
+  if (kvs_table == NULL) {
+    // every owner fills its own shard
+    shard_each(recover_shard, &work);
+    free(work.changes);
+    free(work.starts);
+    recovery_free(&log);
+    return 0;
+  }
+
+  // the swiss tables are grown once, up front
+  reserve_pairs(kvs_table, writes[0]);
+  pthread_t threads[RECOVERY_THREADS];
+  size_t num_threads = 0;
+  while (num_threads < RECOVERY_THREADS && num_threads < work.num_partitions &&
+         pthread_create(&threads[num_threads], NULL, run_recovery, &work) == 0) {
+    num_threads++;
+  }
+  // this thread takes partitions too, and all of them if no thread started
+  apply_partitions(&work);
+  for (size_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  release_pairs(kvs_table, writes[0]);
+  evict_pairs(kvs_table);
+
+  free(work.changes);
+  free(work.starts);
+  recovery_free(&log);
   return 0;
 }
 
-int kvs_subscribe(const char *key, int client_fd) {
+// A change of the subscriptions of a key.
+typedef struct SubscriptionCall {
+  const char *key;
+  int client_fd;
+  int subscribe;           // 1 to subscribe, 0 to unsubscribe
+  int result;
+} SubscriptionCall;
+
+// Changes a subscription. Must be called with the stripe of the key locked,
+// or by the owner of the key's shard.
+static void change_subscription(HashTable *ht, size_t index, void *arg) {
+  (void) index;
+  SubscriptionCall *call = arg;
+  if (!call->subscribe) {
+    call->result = unsubscribe_key(ht, call->key, call->client_fd);
+  } else {
+    call->result = pair_may_exist(ht, call->key) ? subscribe_key(ht, call->key, call->client_fd) : 1;
+  }
+}
+
+// Changes a subscription on the table or through the owner of the key.
+static int run_subscription(SubscriptionCall *call) {
   if (kvs_table == NULL) {
+    shard_call(shard_of(call->key), change_subscription, call);
+    return call->result;
+  }
+
+  size_t index = stripe_index(kvs_table, call->key);
+  pthread_rwlock_rdlock(&kvs_table->stripes[index].rwlock);
+  change_subscription(kvs_table, 0, call);
+  pthread_rwlock_unlock(&kvs_table->stripes[index].rwlock);
+  return call->result;
+}
+
+int kvs_subscribe(const char *key, int client_fd) {
+  if (!kvs_initialized()) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  return subscribe_key(kvs_table, key, client_fd);
+  SubscriptionCall call = {.key = key, .client_fd = client_fd, .subscribe = 1};
+  return run_subscription(&call);
 }
 
 int kvs_unsubscribe(const char *key, int client_fd) {
-  if (kvs_table == NULL) {
+  if (!kvs_initialized()) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  return unsubscribe_key(kvs_table, key, client_fd);
+  SubscriptionCall call = {.key = key, .client_fd = client_fd, .subscribe = 0};
+  return run_subscription(&call);
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[]) {
+  if (!kvs_initialized()) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  // the log keeps the time each TTL runs out at, the wheel keeps the timers
+  uint64_t deadlines[num_pairs];
+  for (size_t i = 0; i < num_pairs; i++) {
+    deadlines[i] = ttls != NULL ? expiry_deadline(ttls[i]) : 0;
+  }
+
   if (kvs_table == NULL) {
+    uint64_t versions[ttls != NULL ? num_pairs : 1];
+    shard_write(num_pairs, keys, values, deadlines, ttls != NULL ? versions : NULL);
+    for (size_t i = 0; ttls != NULL && i < num_pairs; i++) {
+      if (ttls[i] > 0 && expiry_add(keys[i], versions[i], ttls[i]) != 0) {
+        fprintf(stderr, "Failed to set the TTL of %s\n", keys[i]);
+      }
+    }
+    return wal_sync();
+  }
+
+  // a key written twice only keeps its last value
+  BatchPlan plan;
+  if (plan_batch(&plan, kvs_table, num_pairs, keys, BATCH_KEEP_LAST) != 0) {
+    return 1;
+  }
+  reserve_pairs(kvs_table, plan.num_planned);
+  // each subscriber gets the notifications of the whole command in one write
+  notify_hold();
+  lock_batch(&plan);
+
+  for (size_t j = 0; j < plan.num_planned; j++) {
+    size_t i = plan.order[j];
+    if (write_pair(kvs_table, keys[i], values[i], deadlines[i]) != 0) {
+      fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+      continue;
+    }
+    // the timer is tied to the version this write gave the key
+    if (ttls != NULL && ttls[i] > 0 &&
+        expiry_add(keys[i], pair_version(kvs_table, keys[i]), ttls[i]) != 0) {
+      fprintf(stderr, "Failed to set the TTL of %s\n", keys[i]);
+    }
+  }
+
+  unlock_batch(&plan);
+  notify_flush();
+  release_pairs(kvs_table, plan.num_planned);
+  free_batch(&plan);
+  rehash_step(kvs_table);
+  evict_pairs(kvs_table);
+  // the command completes once its changes are in the log
+  return wal_sync();
+}
+
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t versions[],
+            char *values[], int failed[]) {
+  if (!kvs_initialized()) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  // sort the pair and aquire the locks in order to avoid deadlocks
-  sortByHash(keys, values, num_pairs);
-  int *locks = lock_all_keys(kvs_table, keys, num_pairs, 'w');
-  
+  if (kvs_table == NULL) {
+    shard_cas(num_pairs, keys, versions, values, failed);
+    return wal_sync();
+  }
+
+  // the pairs are applied in command order
+  BatchPlan plan;
+  if (plan_batch(&plan, kvs_table, num_pairs, keys, BATCH_KEEP_ALL) != 0) {
+    return 1;
+  }
+  reserve_pairs(kvs_table, plan.num_planned);
+  notify_hold();
+  lock_batch(&plan);
+
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
+    failed[i] = cas_pair(kvs_table, keys[i], versions[i], values[i], &versions[i]);
+    if (failed[i] < 0) {
       fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
     }
   }
 
-  unlock_all_keys(kvs_table, locks);
+  unlock_batch(&plan);
+  notify_flush();
+  release_pairs(kvs_table, plan.num_planned);
+  free_batch(&plan);
+  rehash_step(kvs_table);
+  evict_pairs(kvs_table);
+  // the command completes once its changes are in the log
+  return wal_sync();
+}
+
+// Output buffer shared by kvs_read, kvs_show and the backups. Pairs are
+// formatted straight into it and it is written out whenever it fills up.
+typedef struct OutputBuffer {
+  int fd;
+  size_t len;
+  char data[MAX_WRITE_SIZE];
+} OutputBuffer;
+
+static void flush_output(OutputBuffer *out) {
+  out->data[out->len] = '\0';
+  write_to_open_file(out->fd, out->data);
+  out->len = 0;
+}
+
+// Makes room for at least len more characters and the null terminator.
+static void reserve_output(OutputBuffer *out, size_t len) {
+  if (out->len + len >= sizeof(out->data)) {
+    flush_output(out);
+  }
+}
+
+// Appends len characters; strings longer than the room left are written out
+// a buffer at a time.
+static void append_output_len(OutputBuffer *out, const char *str, size_t len) {
+  while (out->len + len >= sizeof(out->data)) {
+    size_t room = sizeof(out->data) - 1 - out->len;
+    memcpy(out->data + out->len, str, room);
+    out->len += room;
+    flush_output(out);
+    str += room;
+    len -= room;
+  }
+  memcpy(out->data + out->len, str, len);
+  out->len += len;
+}
+
+static void append_output(OutputBuffer *out, const char *str) {
+  append_output_len(out, str, strlen(str));
+}
+
+// Appends the value of a key. A value that fits is copied straight into the
+// buffer; a longer one is copied out of the table first and then streamed.
+// @return 0 if the key was found, 1 otherwise, with the buffer unchanged.
+static int append_value(OutputBuffer *out, HashTable *ht, const char *key) {
+  size_t room = sizeof(out->data) - out->len;
+  size_t len;
+  if (read_pair(ht, key, out->data + out->len, room, &len) != 0) {
+    return 1;
+  }
+  if (len < room) {
+    out->len += len;
+    return 0;
+  }
+
+  char *value = copy_pair(ht, key, &len);
+  if (!value) {
+    // deleted in the meantime
+    return 1;
+  }
+  append_output_len(out, value, len);
+  free(value);
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-    char key[MAX_WRITE_SIZE];  
-    size_t key_len = 0;
+// Appends a pair as "(key, value)".
+static void append_pair(OutputBuffer *out, const char *key, const char *value, size_t len) {
+  append_output(out, "(");
+  append_output(out, key);
+  append_output(out, ", ");
+  append_output_len(out, value, len);
+  append_output(out, ")\n");
+}
 
-    if (kvs_table == NULL) {
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+    if (!kvs_initialized()) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    sortByHash(keys, keys, num_pairs);
-    int *locks = lock_all_keys(kvs_table, keys, num_pairs, 'r');
+    // reads take no lock, so the pairs are simply written in key order
+    qsort(keys, num_pairs, MAX_STRING_SIZE, compare_keys);
+
+    // in sharded mode the owners copy the values into these buffers first
+    char buffers[kvs_table == NULL ? num_pairs : 1][MAX_STRING_SIZE];
+    char *values[kvs_table == NULL ? num_pairs : 1];
+    int missing[kvs_table == NULL ? num_pairs : 1];
+    if (kvs_table == NULL) {
+        for (size_t i = 0; i < num_pairs; i++) {
+            values[i] = buffers[i];
+        }
+        shard_read(num_pairs, keys, values, missing);
+    }
 
-    snprintf(key, sizeof(key), "[");
-    key_len = strlen(key);
+    OutputBuffer out = {.fd = fd, .len = 0};
+    append_output(&out, "[");
 
     for (size_t i = 0; i < num_pairs; i++) {
-        char* result = read_pair(kvs_table, keys[i]);
-        if (result == NULL) {
-            key_len += (size_t)snprintf(key + key_len, sizeof(key) - key_len, "(%s,KVSERROR)", keys[i]);
-        } else {
-            key_len += (size_t)snprintf(key + key_len, sizeof(key) - key_len, "(%s,%s)", keys[i], result);
+        reserve_output(&out, MAX_STRING_SIZE * 2 + 3);
+        append_output(&out, "(");
+        append_output(&out, keys[i]);
+        append_output(&out, ",");
+        if (kvs_table == NULL) {
+            append_output(&out, missing[i] ? "KVSERROR" : values[i]);
+            if (values[i] != buffers[i]) {
+                free(values[i]);
+            }
+        } else if (append_value(&out, kvs_table, keys[i]) != 0) {
+            append_output(&out, "KVSERROR");
         }
-        free(result);
+        append_output(&out, ")");
+    }
+
+    append_output(&out, "]\n");
+    flush_output(&out);
+    return 0;
+}
+
+// Deletes keys from the table or the shards that hold them. The keys the
+// filter rules out are reported missing without taking any lock; in the
+// sharded mode the owners check their own filters.
+// @param missing Set to 1 for each key that was not found.
+static void delete_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE], int missing[]) {
+    if (kvs_table == NULL) {
+        shard_delete(num_pairs, keys, missing);
+        return;
     }
 
-    snprintf(key + key_len, sizeof(key) - key_len, "]\n");
+    char (*present)[MAX_STRING_SIZE] = malloc(num_pairs * MAX_STRING_SIZE);
+    if (!present) {
+        for (size_t i = 0; i < num_pairs; i++) {
+            missing[i] = 1;
+        }
+        return;
+    }
+    size_t positions[num_pairs];
+    size_t num_present = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+        missing[i] = 1;
+        if (pair_may_exist(kvs_table, keys[i])) {
+            memcpy(present[num_present], keys[i], MAX_STRING_SIZE);
+            positions[num_present++] = i;
+        }
+    }
 
-    write_to_open_file(fd, key);
+    if (num_present == 0) {
+        free(present);
+        return;
+    }
 
-    unlock_all_keys(kvs_table, locks);
+    int present_missing[num_present];
+    for (size_t i = 0; i < num_present; i++) {
+        present_missing[i] = 1;
+    }
+    BatchPlan plan;
+    if (plan_batch(&plan, kvs_table, num_present, present, BATCH_KEEP_FIRST) == 0) {
+        // only the first occurrence of a key is deleted, the others find it gone
+        notify_hold();
+        lock_batch(&plan);
+        for (size_t j = 0; j < plan.num_planned; j++) {
+            size_t i = plan.order[j];
+            present_missing[i] = delete_pair(kvs_table, present[i]);
+        }
+        unlock_batch(&plan);
+        notify_flush();
+        free_batch(&plan);
+        rehash_step(kvs_table);
+    }
 
-    return 0;
+    for (size_t i = 0; i < num_present; i++) {
+        missing[positions[i]] = present_missing[i];
+    }
+    free(present);
 }
 
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-    if (kvs_table == NULL) {
+    if (!kvs_initialized()) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    sortByHash(keys, keys, num_pairs);
-    int *locks = lock_all_keys(kvs_table, keys, num_pairs, 'w');
+    int missing[num_pairs];
+    delete_keys(num_pairs, keys, missing);
+    int result = wal_sync();
 
     int swt = 0;
     char error_message[MAX_WRITE_SIZE];
     size_t error_len = 0;
 
     for (size_t i = 0; i < num_pairs; i++) {
-        if (delete_pair(kvs_table, keys[i]) != 0) {
+        if (missing[i] != 0) {
             if (swt == 0) {
                 write_to_open_file(fd, "[");
                 swt = 1;
@@ -213,84 +697,675 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
         write_to_open_file(fd, "]\n");
     }
 
-    unlock_all_keys(kvs_table, locks);
+    return result;
+}
+
+// Gets the largest key that starts with a prefix: the prefix padded with the
+// largest character, so that the keys with the prefix form the range
+// [prefix, end] of the ordered index.
+static void prefix_end(const char *prefix, char end[MAX_STRING_SIZE]) {
+    size_t len = strnlen(prefix, MAX_STRING_SIZE - 1);
+    memcpy(end, prefix, len);
+    memset(end + len, 0xff, MAX_STRING_SIZE - 1 - len);
+    end[MAX_STRING_SIZE - 1] = '\0';
+}
+
+// A page of keys taken from the ordered index of every shard.
+typedef struct ScanCall {
+    const char *from;
+    int inclusive;
+    const char *end;
+    char (*page)[MAX_STRING_SIZE];  // SCAN_PAGE keys per shard
+    size_t *found;                  // keys found by each shard
+} ScanCall;
+
+// Scans the index of a shard, run by its owner.
+static void scan_shard(HashTable *ht, size_t index, void *arg) {
+    ScanCall *call = arg;
+    call->found[index] = scan_keys(ht, call->from, call->inclusive, call->end, call->page + index * SCAN_PAGE,
+                                   SCAN_PAGE);
+}
+
+// Takes from the ordered indexes the first page of keys after from.
+// @param page Array with room for SCAN_PAGE keys per table.
+// @return Number of keys in the page, at most SCAN_PAGE.
+static size_t next_page(const char *from, int inclusive, const char *end, char page[][MAX_STRING_SIZE]) {
+    if (kvs_table != NULL) {
+        return scan_keys(kvs_table, from, inclusive, end, page, SCAN_PAGE);
+    }
+
+    // each shard gives at most a page of keys; of those, the first page in
+    // key order is kept and the next one starts after its last key
+    size_t num_shards = shard_count();
+    size_t found[num_shards];
+    ScanCall call = {.from = from, .inclusive = inclusive, .end = end, .page = page, .found = found};
+    shard_each(scan_shard, &call);
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+        memmove(page + total, page + i * SCAN_PAGE, found[i] * MAX_STRING_SIZE);
+        total += found[i];
+    }
+    qsort(page, total, MAX_STRING_SIZE, compare_keys);
+    return total > SCAN_PAGE ? SCAN_PAGE : total;
+}
+
+// Appends a pair of a range as "(key" separator "value" closing. In the
+// sharded mode the value was copied by the owner of the key already.
+// @param value Value of the key, NULL to read it from the table.
+static void append_range_pair(OutputBuffer *out, const char *key, const char *value, const char *separator,
+                              const char *closing) {
+    reserve_output(out, MAX_STRING_SIZE * 2 + 5);
+    size_t len = out->len;
+    append_output(out, "(");
+    append_output(out, key);
+    append_output(out, separator);
+    if (value != NULL) {
+        append_output(out, value);
+    } else if (append_value(out, kvs_table, key) != 0) {
+        // deleted since it was taken from the index
+        out->len = len;
+        return;
+    }
+    append_output(out, closing);
+}
+
+// Appends every pair of a range, in key order, taking the keys from the
+// ordered indexes a page at a time.
+// @return 0 on success, 1 if the page could not be allocated.
+static int append_range(const char *start, const char *end, const char *separator, const char *closing,
+                        OutputBuffer *out) {
+    char (*page)[MAX_STRING_SIZE] = malloc(table_count() * SCAN_PAGE * MAX_STRING_SIZE);
+    if (!page) {
+        return 1;
+    }
+
+    char from[MAX_STRING_SIZE];
+    strncpy(from, start, MAX_STRING_SIZE - 1);
+    from[MAX_STRING_SIZE - 1] = '\0';
+    int inclusive = 1;
+
+    // in the sharded mode the owners copy the values of a page first
+    char buffers[kvs_table == NULL ? SCAN_PAGE : 1][MAX_STRING_SIZE];
+    char *values[SCAN_PAGE];
+    int missing[SCAN_PAGE];
+
+    for (;;) {
+        size_t found = next_page(from, inclusive, end, page);
+        if (kvs_table == NULL) {
+            for (size_t i = 0; i < found; i++) {
+                values[i] = buffers[i];
+            }
+            shard_read(found, page, values, missing);
+        }
+        for (size_t i = 0; i < found; i++) {
+            if (kvs_table != NULL) {
+                append_range_pair(out, page[i], NULL, separator, closing);
+                continue;
+            }
+            if (!missing[i]) {
+                append_range_pair(out, page[i], values[i], separator, closing);
+            }
+            if (values[i] != buffers[i]) {
+                free(values[i]);
+            }
+        }
+        if (found < SCAN_PAGE) {
+            break;
+        }
+        memcpy(from, page[found - 1], MAX_STRING_SIZE);
+        inclusive = 0;
+    }
+    free(page);
+    return 0;
+}
+
+int kvs_scan(const char *start, const char *end, int fd) {
+    if (!kvs_initialized()) {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
+    }
+
+    OutputBuffer out = {.fd = fd, .len = 0};
+    append_output(&out, "[");
+    if (append_range(start, end, ",", ")", &out) != 0) {
+        return 1;
+    }
+    append_output(&out, "]\n");
+    flush_output(&out);
     return 0;
 }
 
+int kvs_read_prefix(const char *prefix, int fd) {
+    char end[MAX_STRING_SIZE];
+    prefix_end(prefix, end);
+    return kvs_scan(prefix, end, fd);
+}
 
-void kvs_show(int fd) {
-    for (int j = 0; j < TABLE_SIZE; j++) {
-        pthread_rwlock_rdlock(&kvs_table->rwlock[j]);
+int kvs_delete_prefix(const char *prefix) {
+    if (!kvs_initialized()) {
+        fprintf(stderr, "KVS state must be initialized\n");
+        return 1;
     }
 
-    char buffer[MAX_WRITE_SIZE * TABLE_SIZE];
-    size_t buffer_len = 0;
+    char (*page)[MAX_STRING_SIZE] = malloc(table_count() * SCAN_PAGE * MAX_STRING_SIZE);
+    if (!page) {
+        return 1;
+    }
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = kvs_table->table[i];
+    char end[MAX_STRING_SIZE];
+    prefix_end(prefix, end);
+    char from[MAX_STRING_SIZE];
+    memcpy(from, prefix, strnlen(prefix, MAX_STRING_SIZE - 1) + 1);
+    from[MAX_STRING_SIZE - 1] = '\0';
+    int inclusive = 1;
+    int missing[SCAN_PAGE];
+
+    // the keys are deleted a page at a time; keys written with the prefix
+    // behind the cursor while this runs are kept
+    for (;;) {
+        size_t found = next_page(from, inclusive, end, page);
+        if (found == 0) {
+            break;
+        }
+        char last[MAX_STRING_SIZE];
+        memcpy(last, page[found - 1], MAX_STRING_SIZE);
+        delete_keys(found, page, missing);
 
-        while (keyNode != NULL) {
-            buffer_len += (size_t) snprintf(buffer + buffer_len, sizeof(buffer) - buffer_len, "(%s, %s)\n", keyNode->key, keyNode->value);
-            keyNode = keyNode->next; // Move to the next node
+        if (found < SCAN_PAGE) {
+            break;
         }
+        memcpy(from, last, MAX_STRING_SIZE);
+        inclusive = 0;
     }
 
-    write_to_open_file(fd, buffer);
+    free(page);
+    return wal_sync();
+}
 
-    for (int j = 0; j < TABLE_SIZE; j++) {
-        pthread_rwlock_unlock(&kvs_table->rwlock[j]);
+void kvs_write_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t versions[], int failed[], int fd) {
+    OutputBuffer out = {.fd = fd, .len = 0};
+    append_output(&out, "[");
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        char line[MAX_STRING_SIZE * 2 + 8];
+        snprintf(line, sizeof(line), "(%s,%s,%" PRIu64 ")", keys[i],
+                 failed[i] == 0 ? "OK" : "KVSCASFAILED", versions[i]);
+        append_output(&out, line);
     }
+
+    append_output(&out, "]\n");
+    flush_output(&out);
 }
 
+void kvs_show(int fd) {
+    // the pairs come out in key order, from the ordered indexes
+    char end[MAX_STRING_SIZE];
+    prefix_end("", end);
+    OutputBuffer out = {.fd = fd, .len = 0};
+    append_range("", end, ", ", ")\n", &out);
+    flush_output(&out);
+}
 
+// Counters of a table, added up over the tables of the store.
+typedef struct TableStats {
+  size_t keys;
+  size_t resident;
+  size_t evictions;
+  size_t filtered;
+  BloomStats filter;
+} TableStats;
+
+// Reads the counters of a table, or of a shard by its owner.
+static void table_stats(HashTable *ht, size_t index, void *arg) {
+  TableStats *stats = (TableStats *) arg + index;
+  stats->keys = atomic_load(&ht->count);
+  stats->resident = atomic_load(&ht->resident);
+  stats->evictions = atomic_load(&ht->evictions);
+  stats->filtered = atomic_load(&ht->filtered);
+  filter_stats(ht, &stats->filter);
+}
 
-void start_backup(int *total_backups, char* filename) {
-  char temp_filename[MAX_JOB_FILE_NAME_SIZE];
+void kvs_stats(int fd) {
+  SlabStats slab;
+  slab_stats(&slab);
 
-  strncpy(temp_filename, filename, sizeof(temp_filename) - 1);
-  
-  sprintf(filename, "%s-%d.bck", temp_filename, *total_backups);
-  
-  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  size_t num_tables = table_count();
+  TableStats tables[num_tables];
+  memset(tables, 0, sizeof(tables));
+  if (kvs_table != NULL) {
+    table_stats(kvs_table, 0, tables);
+  } else {
+    shard_each(table_stats, tables);
+  }
+  size_t keys = 0;
+  size_t resident = 0;
+  size_t evictions = 0;
+  size_t filtered = 0;
+  BloomStats filter = {0, 0, 0};
+  for (size_t i = 0; i < num_tables; i++) {
+    keys += tables[i].keys;
+    resident += tables[i].resident;
+    evictions += tables[i].evictions;
+    filtered += tables[i].filtered;
+    filter.counters += tables[i].filter.counters;
+    filter.counters_set += tables[i].filter.counters_set;
+    filter.counters_stuck += tables[i].filter.counters_stuck;
+  }
+
+  char buffer[MAX_WRITE_SIZE];
+  snprintf(buffer, sizeof(buffer),
+           "(keys, %zu)\n"
+           "(resident_bytes, %zu)\n"
+           "(evictions, %zu)\n"
+           "(filter_negatives, %zu)\n"
+           "(filter_counters, %zu)\n"
+           "(filter_counters_set, %zu)\n"
+           "(filter_counters_stuck, %zu)\n"
+           "(arena_objects, %zu)\n"
+           "(arena_bytes_in_use, %zu)\n"
+           "(arena_bytes_reserved, %zu)\n"
+           "(ttl_pending, %zu)\n"
+           "(keys_expired, %zu)\n"
+           "(notify_pending, %zu)\n"
+           "(notify_dropped, %zu)\n"
+           "(notify_coalesced, %zu)\n"
+           "(wal_records, %zu)\n"
+           "(wal_commits, %zu)\n",
+           keys, resident, evictions, filtered, filter.counters, filter.counters_set, filter.counters_stuck,
+           slab.objects_in_use, slab.bytes_in_use, slab.bytes_reserved,
+           expiry_pending(), expiry_removed(), notify_pending(), notify_dropped(), notify_coalesced(),
+           wal_records(), wal_commits());
+  write_to_open_file(fd, buffer);
+}
+
+// A backup running in a thread of its own: the views of the tables taken at
+// the BACKUP command of the job, and what to write from them.
+typedef struct BackupTask {
+  char *job;                         // path of the job without its extension
+  int number;
+  int full;                          // whether to write a full backup
+  uint64_t from;                     // change log position of the previous backup
+  uint64_t to;                       // change log position of this one
+  uint64_t log_offset;               // length of the write-ahead log on disk at the views
+  int *active_backups;
+  pthread_mutex_t *active_backups_mutex;
+  int closed;                        // whether the views were closed
+  struct ViewPage *pages;            // pairs walked by the owners of the shards, NULL until a full backup
+  ReadView views[];                  // one per table
+} BackupTask;
+
+// signaled whenever a backup ends, under the mutex of the active backups
+static pthread_cond_t backup_ended = PTHREAD_COND_INITIALIZER;
+
+// Gets the view of the table that holds a key.
+static ReadView *view_of(BackupTask *task, const char *key) {
+  return &task->views[kvs_table != NULL ? 0 : shard_of(key)];
+}
+
+// Opens the view of a table, or of a shard by its owner.
+static void open_view(HashTable *ht, size_t index, void *arg) {
+  BackupTask *task = arg;
+  view_open(ht, &task->views[index]);
+}
 
-  if (fd == -1) {
-    fprintf(stderr, "Error opening the file\n");
+// Closes the view of a table, or of a shard by its owner.
+static void close_view(HashTable *ht, size_t index, void *arg) {
+  BackupTask *task = arg;
+  view_close(ht, &task->views[index]);
+}
+
+static void close_views(BackupTask *task) {
+  if (task->closed) {
     return;
   }
+  if (kvs_table != NULL) {
+    close_view(kvs_table, 0, task);
+  } else {
+    shard_each(close_view, task);
+  }
+  task->closed = 1;
+}
 
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      
-      // add the current pair to a buffer
-      char buffer[MAX_WRITE_SIZE] = {0};
+// @return 1 if some view failed to keep a value, 0 otherwise.
+static int views_failed(BackupTask *task) {
+  for (size_t i = 0; i < table_count(); i++) {
+    if (task->views[i].failed) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-      sprintf(buffer, "(%s, %s)\n", keyNode->key, keyNode->value);
+// Keys of a delta whose values are copied from the views.
+typedef struct DeltaCopy {
+  BackupTask *task;
+  char (*keys)[MAX_STRING_SIZE];
+  size_t count;
+  size_t *shards;                    // shard of each key, NULL in the lock-based mode
+  char **values;
+  size_t *lens;
+} DeltaCopy;
+
+// Copies the values the keys of a table have in its view, or the keys of a
+// shard, by its owner.
+static void copy_delta(HashTable *ht, size_t index, void *arg) {
+  DeltaCopy *copy = arg;
+  for (size_t i = 0; i < copy->count; i++) {
+    if (copy->shards == NULL || copy->shards[i] == index) {
+      copy->values[i] = view_copy(ht, &copy->task->views[index], copy->keys[i], &copy->lens[i]);
+    }
+  }
+}
+
+// Writes the pairs changed between two positions of the change log, one line
+// per key: "(key, value)" if it was stored at the backup, "-(key)" if not.
+// The keys are read from the views while they are open; those changed since
+// get their values from the retained pairs once the views are closed.
+// @return 0 on success, 1 if the log no longer holds every change, with the
+// views still open.
+static int write_delta(BackupTask *task, int fd) {
+  char (*keys)[MAX_STRING_SIZE];
+  size_t count;
+  if (dirty_collect(task->from, task->to, &keys, &count) != 0) {
+    return 1;
+  }
+  char **values = malloc((count + 1) * sizeof(char *));
+  size_t *lens = malloc((count + 1) * sizeof(size_t));
+  size_t *shards = kvs_table == NULL ? malloc((count + 1) * sizeof(size_t)) : NULL;
+  if (!values || !lens || (kvs_table == NULL && !shards)) {
+    free(values);
+    free(lens);
+    free(shards);
+    free(keys);
+    return 1;
+  }
+  DeltaCopy copy = {.task = task, .keys = keys, .count = count, .shards = shards, .values = values, .lens = lens};
+  if (kvs_table != NULL) {
+    copy_delta(kvs_table, 0, &copy);
+  } else {
+    // every owner copies the keys of its shard
+    for (size_t i = 0; i < count; i++) {
+      shards[i] = shard_of(keys[i]);
+    }
+    shard_each(copy_delta, &copy);
+  }
+  close_views(task);
+
+  OutputBuffer out = {.fd = fd, .len = 0};
+  for (size_t i = 0; i < count; i++) {
+    const char *value = values[i];
+    size_t len = lens[i];
+    const RetainedPair *pair = value == NULL ? view_retained(view_of(task, keys[i]), keys[i]) : NULL;
+    if (pair != NULL) {
+      value = pair->value->data;
+      len = pair->value->len;
+    }
+    if (value == NULL) {
+      append_output(&out, "-(");
+      append_output(&out, keys[i]);
+      append_output(&out, ")\n");
+      continue;
+    }
+    append_pair(&out, keys[i], value, len);
+    free(values[i]);
+  }
+  flush_output(&out);
+  if (views_failed(task)) {
+    fprintf(stderr, "Backup %d of %s is missing values\n", task->number, task->job);
+  }
+  free(values);
+  free(lens);
+  free(shards);
+  free(keys);
+  return 0;
+}
+
+// Pairs of the view of a shard, copied by its owner a page at a time while
+// the backup merges them with the other shards.
+typedef struct ViewPage {
+  size_t count;                      // pairs in the page
+  size_t next;                       // next pair to be merged
+  int walked;                        // whether the view has no pairs past the page
+  char keys[SCAN_PAGE][MAX_STRING_SIZE];
+  size_t offsets[SCAN_PAGE];         // the value of pair i is at data + offsets[i]
+  size_t lens[SCAN_PAGE];
+  uint64_t deadlines[SCAN_PAGE];
+  char *data;
+  size_t data_size;
+} ViewPage;
+
+// Walks the view of a shard for the next page of pairs, run by its owner.
+// @param arg BackupTask whose pages field holds a page per shard.
+static void walk_view(HashTable *ht, size_t index, void *arg) {
+  BackupTask *task = arg;
+  ReadView *view = &task->views[index];
+  ViewPage *page = &task->pages[index];
+  size_t used = 0;
+  page->count = 0;
+  page->next = 0;
+  ViewPair pair;
+  while (page->count < SCAN_PAGE && !page->walked) {
+    if (!view_next(ht, view, &pair)) {
+      page->walked = 1;
+      break;
+    }
+    if (used + pair.len + 1 > page->data_size) {
+      size_t size = 2 * (used + pair.len + 1);
+      char *data = realloc(page->data, size);
+      if (!data) {
+        // the owner is the only writer of the view
+        view->failed = 1;
+        continue;
+      }
+      page->data = data;
+      page->data_size = size;
+    }
+    memcpy(page->keys[page->count], pair.key, MAX_STRING_SIZE);
+    memcpy(page->data + used, pair.value, pair.len);
+    page->data[used + pair.len] = '\0';
+    page->offsets[page->count] = used;
+    page->lens[page->count] = pair.len;
+    page->deadlines[page->count] = pair.deadline;
+    used += pair.len + 1;
+    page->count++;
+  }
+}
 
-      size_t done = 0;
-      size_t len = strlen(buffer);
+// Gets the next pair of the view of a table, from the page of its shard in
+// the sharded mode. The pair is valid until the next call for the table.
+// @return 1 if a pair was found, 0 once the view has none left.
+static int next_view_pair(BackupTask *task, size_t index, ViewPair *pair) {
+  if (kvs_table != NULL) {
+    return view_next(kvs_table, &task->views[index], pair);
+  }
+  ViewPage *page = &task->pages[index];
+  if (page->next == page->count) {
+    if (page->walked) {
+      return 0;
+    }
+    shard_call(index, walk_view, task);
+    if (page->count == 0) {
+      return 0;
+    }
+  }
+  size_t i = page->next++;
+  pair->key = page->keys[i];
+  pair->value = page->data + page->offsets[i];
+  pair->len = page->lens[i];
+  pair->deadline = page->deadlines[i];
+  return 1;
+}
 
-      while (len > done) {
-        ssize_t written = write(fd, buffer + done, len - done);
+// Output of a full backup: the backup of the job, as text or as a snapshot,
+// and, when the server has a write-ahead log, the snapshot its recovery
+// starts from.
+typedef struct BackupOutput {
+  OutputBuffer text;                 // fd is -1 for a binary backup
+  SnapshotWriter *snapshots[2];      // the binary backup and the snapshot of the log, NULL if not written
+  int failed[2];
+} BackupOutput;
+
+static void write_backup_pair(const char *key, const char *value, size_t len, uint64_t deadline, void *arg) {
+  BackupOutput *out = arg;
+  if (out->text.fd >= 0) {
+    append_pair(&out->text, key, value, len);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (out->snapshots[i] != NULL && !out->failed[i]) {
+      out->failed[i] = snapshot_add(out->snapshots[i], key, value, len, deadline);
+    }
+  }
+}
 
-        if (written < 0) {
-          fprintf(stderr, "Error writing");
-          close(fd);
-          return;
-        }
+// @param if_newer 1 to keep a snapshot already at path that covers more of the log.
+// @return Writer of a new snapshot, NULL on failure.
+static SnapshotWriter *open_snapshot(const char *path, uint64_t log_offset, int if_newer) {
+  SnapshotWriter *writer = malloc(sizeof(SnapshotWriter));
+  if (writer && snapshot_begin(writer, path, log_offset, if_newer) != 0) {
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
 
-        done += (size_t) written;
+// Writes a backup of a job from its views: the whole store to job-N.bck, or
+// job-N.snap in the binary format, or the keys changed since the previous
+// backup to job-N.delta. A full backup also replaces the snapshot of the
+// write-ahead log.
+static void write_backup(BackupTask *task) {
+  char path[FILENAME_MAX];
+
+  if (!task->full) {
+    snprintf(path, sizeof(path), "%s-%d.delta", task->job, task->number);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      fprintf(stderr, "Error opening the file\n");
+      return;
+    }
+    int lost = write_delta(task, fd);
+    close(fd);
+    if (!lost) {
+      return;
+    }
+    // too many changes since the previous backup, the log lost some
+    unlink(path);
+  }
+
+  BackupOutput out = {.text = {.fd = -1, .len = 0}, .snapshots = {NULL, NULL}, .failed = {0, 0}};
+  if (backup_format == BACKUP_BINARY) {
+    snprintf(path, sizeof(path), "%s-%d.snap", task->job, task->number);
+    out.snapshots[0] = open_snapshot(path, task->log_offset, 0);
+    if (out.snapshots[0] == NULL) {
+      fprintf(stderr, "Error opening the file\n");
+      return;
+    }
+  } else {
+    snprintf(path, sizeof(path), "%s-%d.bck", task->job, task->number);
+    out.text.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out.text.fd == -1) {
+      fprintf(stderr, "Error opening the file\n");
+      return;
+    }
+  }
+  if (wal_path() != NULL) {
+    recovery_snapshot_path(wal_path(), path, sizeof(path));
+    // backups of other jobs may be writing it too
+    out.snapshots[1] = open_snapshot(path, task->log_offset, 1);
+  }
+
+  // the pairs of the views in key order, merged across the tables
+  size_t num_tables = table_count();
+  if (kvs_table == NULL) {
+    task->pages = calloc(num_tables, sizeof(ViewPage));
+    if (task->pages == NULL) {
+      fprintf(stderr, "Failed to allocate the backup pages\n");
+    } else {
+      // the owners copy their first pages in parallel
+      shard_each(walk_view, task);
+    }
+  }
+  ViewPair pairs[num_tables];
+  int walking[num_tables];
+  for (size_t i = 0; i < num_tables; i++) {
+    walking[i] = (kvs_table != NULL || task->pages != NULL) && next_view_pair(task, i, &pairs[i]);
+  }
+  for (;;) {
+    size_t first = num_tables;
+    for (size_t i = 0; i < num_tables; i++) {
+      if (walking[i] && (first == num_tables || strcmp(pairs[i].key, pairs[first].key) < 0)) {
+        first = i;
+      }
+    }
+    if (first == num_tables) {
+      break;
+    }
+    write_backup_pair(pairs[first].key, pairs[first].value, pairs[first].len, pairs[first].deadline, &out);
+    walking[first] = next_view_pair(task, first, &pairs[first]);
+  }
+  close_views(task);
+
+  int failed = views_failed(task) || (kvs_table == NULL && task->pages == NULL);
+  if (out.text.fd >= 0) {
+    flush_output(&out.text);
+    close(out.text.fd);
+    if (failed) {
+      fprintf(stderr, "Backup %d of %s is missing values\n", task->number, task->job);
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    if (out.snapshots[i] != NULL) {
+      int installed = snapshot_end(out.snapshots[i], out.failed[i] || failed) == 0;
+      free(out.snapshots[i]);
+      if (i == 1 && installed) {
+        // the snapshot of the log holds every record before its offset
+        wal_compact(task->log_offset);
       }
+    }
+  }
+}
 
-      keyNode = keyNode->next;
+// Releases the views of a backup and the backup itself.
+static void free_backup(BackupTask *task) {
+  close_views(task);
+  for (size_t i = 0; i < table_count(); i++) {
+    view_free(&task->views[i]);
+    if (task->pages != NULL) {
+      free(task->pages[i].data);
     }
   }
-  
-  close(fd);
-  return;
+  free(task->pages);
+  free(task->job);
+  free(task);
+}
+
+// Stops counting a backup as active.
+static void end_backup(int *active_backups, pthread_mutex_t *active_backups_mutex) {
+  pthread_mutex_lock(active_backups_mutex);
+  (*active_backups)--;
+  pthread_cond_broadcast(&backup_ended);
+  pthread_mutex_unlock(active_backups_mutex);
 }
 
-int kvs_backup(int max_backups, int *active_backups, int *total_backups, char* filename, pthread_mutex_t* active_backups_mutex) {
+static void *run_backup(void *arg) {
+  BackupTask *task = arg;
+  int *active_backups = task->active_backups;
+  pthread_mutex_t *active_backups_mutex = task->active_backups_mutex;
+  // the signals of the server are handled by the host thread
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  write_backup(task);
+  free_backup(task);
+  epoch_thread_exit();
+  slab_thread_exit();
+  end_backup(active_backups, active_backups_mutex);
+  return NULL;
+}
+
+int kvs_backup(int max_backups, int *active_backups, int *total_backups, BackupChain *chain, char* filename,
+               pthread_mutex_t* active_backups_mutex) {
   
   if (max_backups == 0) {
     return 0;
@@ -298,42 +1373,72 @@ int kvs_backup(int max_backups, int *active_backups, int *total_backups, char* f
 
   kvs_wait_backup(max_backups, active_backups, active_backups_mutex);
 
-  pid_t pid = fork();
-  
-  // child process code
-  if (pid == 0) {
-    start_backup(total_backups, filename);
-    kvs_terminate();
-    exit(0);
-
-  // parent process code
-  } else if (pid > 1) {
-    pthread_mutex_lock(active_backups_mutex);
-    (*total_backups)++;
-    (*active_backups)++;
-    pthread_mutex_unlock(active_backups_mutex);
-    
+  BackupTask *task = malloc(sizeof(BackupTask) + table_count() * sizeof(ReadView));
+  if (!task || !(task->job = strdup(filename))) {
+    free(task);
+    return 1;
+  }
+
+  // every BACKUP_FULL_EVERY backups the whole table is written again
+  int full = chain->deltas < 0 || chain->deltas >= BACKUP_FULL_EVERY;
+  if (full) {
+    dirty_enable();
+  }
+  // taken before the views, so the snapshot holds every change logged up to it
+  task->log_offset = wal_synced();
+
+  uint64_t position;
+  if (kvs_table != NULL) {
+    // the view is opened at the point in time where the change log is read:
+    // the writers log their changes before they unlock
+    lock_table(kvs_table);
+    position = dirty_position();
+    view_open(kvs_table, &task->views[0]);
+    unlock_table(kvs_table);
   } else {
-    fprintf(stderr, "Fork Error");
-    exit(1);
+    // each owner opens the view of its shard after the change log is read:
+    // a change made in between is in the view and in the next delta too
+    position = dirty_position();
+    shard_each(open_view, task);
   }
 
+  // or when the log cannot cover the changes since the previous backup
+  if (position - chain->position > DIRTY_LOG_SIZE) {
+    full = 1;
+  }
+  task->number = *total_backups;
+  task->full = full;
+  task->from = chain->position;
+  task->to = position;
+  task->active_backups = active_backups;
+  task->active_backups_mutex = active_backups_mutex;
+  task->closed = 0;
+  task->pages = NULL;
+
+  pthread_mutex_lock(active_backups_mutex);
+  (*total_backups)++;
+  (*active_backups)++;
+  pthread_mutex_unlock(active_backups_mutex);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, run_backup, task) != 0) {
+    free_backup(task);
+    end_backup(active_backups, active_backups_mutex);
+    return 1;
+  }
+  pthread_detach(thread);
+  chain->deltas = full ? 0 : chain->deltas + 1;
+  chain->position = position;
   return 0;
 }
 
 void kvs_wait_backup(int max_backups, int *active_backups, pthread_mutex_t* active_backups_mutex) {
-  // when the limit is reached the parent will be blocked until a child ends
+  // when the limit is reached the job is blocked until a backup ends
+  pthread_mutex_lock(active_backups_mutex);
   while (*active_backups >= max_backups) {
-    pid_t terminated_pid = wait(NULL); 
-    if (terminated_pid > 0) {
-      pthread_mutex_lock(active_backups_mutex);
-      (*active_backups)--; 
-      pthread_mutex_unlock(active_backups_mutex);
-    } else {
-    } 
-
-  }  
-  return;
+    pthread_cond_wait(&backup_ended, active_backups_mutex);
+  }
+  pthread_mutex_unlock(active_backups_mutex);
 }
 
 void kvs_wait(unsigned int delay_ms) {
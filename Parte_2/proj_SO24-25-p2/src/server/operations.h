@@ -2,23 +2,82 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "constants.h"
+#include "kvs.h"
+
+#define BACKUP_FULL_EVERY 8  // deltas a job writes before its next full backup
+
+// Backups of a job: a full one, followed by deltas that each hold the keys
+// changed since the backup before them.
+typedef struct BackupChain {
+  int deltas;          // deltas since the last full backup, -1 before the first backup
+  uint64_t position;   // change log position the last backup covers
+} BackupChain;
+
+// Format of the full backups of the jobs.
+enum BackupFormat {
+  BACKUP_TEXT,     // job-N.bck, a "(key, value)" line per pair
+  BACKUP_BINARY,   // job-N.snap, a snapshot (see snapshot.h), exported as text by rebuild
+};
+
+/// Sets the format of the full backups. Must be called before the first
+/// backup.
+/// @param format Format of the server.
+void kvs_set_backup_format(enum BackupFormat format);
 
 /// Initializes the KVS state.
+/// @param num_stripes Number of locks guarding the buckets of the table.
+/// @param num_shards Number of shards with their own owner thread, 0 for the
+/// lock-based mode.
+/// @param max_bytes Memory the pairs may take before some are evicted, 0 for
+/// no limit.
+/// @param engine How the tables keep their nodes.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(size_t num_stripes, size_t num_shards, size_t max_bytes, enum TableEngine engine);
+
+/// Recovers the state the store had before the server stopped: loads the
+/// snapshot of the write-ahead log and replays the records the log got after
+/// it. The changes are grouped by the stripe they fall in and inserted by a
+/// few threads at once, each filling its stripes in log order. Keys written
+/// with a TTL get their timers back, and those whose TTL ran out while the
+/// server was down are dropped. Must be called
+/// after kvs_init, before the log is opened and before any client is served.
+/// @param wal_path Path of the write-ahead log.
+/// @return 0 if the store was recovered, or there was nothing to recover, 1
+/// otherwise.
+int kvs_recover(const char *wal_path);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
+/// Returns once the pairs are synced to the write-ahead log, if one is open.
 /// @param num_pairs Number of pairs being written.
 /// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param values Array of values' strings, of any length.
+/// @param ttls Array of times to live in milliseconds, 0 for keys that do not
+/// expire, or NULL if no key expires.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[]);
+
+/// Writes key value pairs whose keys are at expected versions. Each pair is
+/// checked on its own, in the order given; a missing key is at version 0.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param versions Array of expected versions. On return, versions[i] is the
+/// new version of keys[i], or its current version if failed[i] is not 0.
+/// @param values Array of values' strings, of any length.
+/// @param failed Array where failed[i] is set to 0 if keys[i] was written.
+/// @return 0 if the pairs were processed, 1 otherwise.
+int kvs_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t versions[],
+            char *values[], int failed[]);
+
+/// Writes the results of kvs_cas.
+/// @param fd File descriptor to write the output.
+void kvs_write_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t versions[], int failed[], int fd);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
@@ -36,25 +95,54 @@ int kvs_subscribe(const char *key, int client_fd);
 /// Unsubscribes a client from a key.
 /// @param key Key to be unsubscribed from.
 /// @param client_fd File descriptor of the client to be unsubscribed.
-/// @return 0 if the key was found and the client was unsubscribed, 1 otherwise.
+/// @return 0 if the client was subscribed to the key and was unsubscribed, 1 otherwise.
 int kvs_unsubscribe(const char *key, int client_fd);
 
-/// Deletes key value pairs from the KVS.
+/// Deletes key value pairs from the KVS. Returns once the removals are synced
+/// to the write-ahead log, if one is open.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
+/// Writes the pairs whose keys lie in a range, in key order. The range is
+/// read from the ordered index a page at a time.
+/// @param start First key of the range.
+/// @param end Last key of the range.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the range was scanned, 1 otherwise.
+int kvs_scan(const char *start, const char *end, int fd);
+
+/// Writes the pairs whose keys start with a prefix, in key order.
+/// @param prefix Prefix of the keys.
+/// @param fd File descriptor to write the output.
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_read_prefix(const char *prefix, int fd);
+
+/// Deletes the pairs whose keys start with a prefix.
+/// @param prefix Prefix of the keys.
+/// @return 0 if the keys were deleted, 1 otherwise.
+int kvs_delete_prefix(const char *prefix);
+
 /// Writes the state of the KVS.
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes the usage counters of the KVS.
+/// @param fd File descriptor to write the output.
+void kvs_stats(int fd);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(int max_backups, int *active_backups, int *total_backups, char* filename, pthread_mutex_t* active_backups_mutex);
+/// backup file: the whole state in job-N.bck, or only the keys changed since
+/// the previous backup of the job in job-N.delta. The state is taken as read
+/// views of the tables when the call is made, and the file is written by a
+/// thread of its own while the writers keep going.
+/// @param chain Backups of the job so far, updated for this one.
+/// @return 0 if the backup was started, 1 otherwise.
+int kvs_backup(int max_backups, int *active_backups, int *total_backups, BackupChain *chain, char* filename,
+               pthread_mutex_t* active_backups_mutex);
 
-/// Waits for the last backup to be called.
+/// Waits until fewer than max_backups backups are being written.
 void kvs_wait_backup(int max_backups, int *active_backups, pthread_mutex_t* active_backups_mutex);
 
 /// Waits for a given amount of time.
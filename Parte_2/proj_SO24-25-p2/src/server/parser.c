@@ -69,6 +69,49 @@ static int read_string(int fd, char *buffer, size_t max) {
   return value;
 }
 
+// Reads a string of any length, ended by the same delimiters as read_string.
+// @param buffer Set to the null terminated string, to be freed by the caller.
+static int read_long_string(int fd, char **buffer) {
+  size_t size = MAX_STRING_SIZE;
+  size_t i = 0;
+  char *str = malloc(size);
+  if (!str) {
+    return -1;
+  }
+
+  while (1) {
+    char ch;
+    if (read(fd, &ch, 1) <= 0 || ch == ' ') {
+      free(str);
+      return -1;
+    }
+
+    int value = ch == ',' ? 0 : ch == ')' ? 1 : ch == ']' ? 2 : -1;
+    if (value != -1) {
+      str[i] = '\0';
+      *buffer = str;
+      return value;
+    }
+
+    if (i + 1 == size) {
+      char *grown = realloc(str, size * 2);
+      if (!grown) {
+        free(str);
+        return -1;
+      }
+      str = grown;
+      size *= 2;
+    }
+    str[i++] = ch;
+  }
+}
+
+void free_values(char *values[], size_t num_values) {
+  for (size_t i = 0; i < num_values; i++) {
+    free(values[i]);
+  }
+}
+
 static int read_uint(int fd, unsigned int *value, char *next) {
   char buf[16];
 
@@ -125,23 +168,69 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[4] == ' ') {
+        return CMD_READ;
+      }
+
+      if (read(fd, buf + 5, 6) != 6 || strncmp(buf, "READPREFIX ", 11) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_READ;
+      return CMD_READ_PREFIX;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE", 6) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[6] == ' ') {
+        return CMD_DELETE;
+      }
+
+      if (read(fd, buf + 7, 6) != 6 || strncmp(buf, "DELETEPREFIX ", 13) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_DELETE;
+      return CMD_DELETE_PREFIX;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (read(fd, buf + 1, 3) != 3) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "STAT", 4) == 0) {
+        if (read(fd, buf + 4, 1) != 1 || buf[4] != 'S') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (read(fd, buf + 5, 1) != 0 && buf[5] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_STATS;
+      }
+
+      if (strncmp(buf, "SCAN", 4) == 0) {
+        if (read(fd, buf + 4, 1) != 1 || buf[4] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_SCAN;
+      }
+
+      if (strncmp(buf, "SHOW", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -153,6 +242,14 @@ enum Command get_next(int fd) {
 
       return CMD_SHOW;
 
+    case 'C':
+      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "CAS ", 4) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_CAS;
+
     case 'B':
       if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
@@ -192,13 +289,28 @@ enum Command get_next(int fd) {
   }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
+int parse_pair(int fd, char *key, char **value, unsigned int *ttl) {
+  if (read_string(fd, key, MAX_STRING_SIZE - 1) != 0) {
     cleanup(fd);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
+  *ttl = 0;
+  int output = read_long_string(fd, value);
+  if (output == 0) {
+    // the value is followed by a TTL
+    char ch;
+    if (read_uint(fd, ttl, &ch) != 0 || ch != ')') {
+      output = -1;
+    } else {
+      output = 1;
+    }
+  }
+
+  if (output != 1) {
+    if (output != -1) {
+      free(*value);
+    }
     cleanup(fd);
     return 0;
   }
@@ -206,7 +318,14 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+// Drops a command whose values were partly parsed.
+static size_t discard_values(int fd, char *values[], size_t num_values) {
+  free_values(values, num_values);
+  cleanup(fd);
+  return 0;
+}
+
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[], size_t max_pairs, size_t max_string_size) {
   char ch;
 
   if (read(fd, &ch, 1) != 1 || ch != '[') {
@@ -221,19 +340,17 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 
   size_t num_pairs = 0;
   char key[max_string_size];
-  char value[max_string_size];
+  char *value;
   while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
-      return 0;
+    if(parse_pair(fd, key, &value, &ttls[num_pairs]) == 0) {
+      return discard_values(fd, values, num_pairs);
     }
 
     strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
+    values[num_pairs++] = value;
 
     if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
-      return 0;
+      return discard_values(fd, values, num_pairs);
     }
 
     if (ch == ']') {
@@ -242,15 +359,64 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   }
 
   if (num_pairs == max_pairs) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  return num_pairs;
+}
+
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], uint64_t versions[], char *values[], size_t max_pairs) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
 
+  size_t num_pairs = 0;
+  char version[MAX_STRING_SIZE];
+  while (num_pairs < max_pairs) {
+    if (read_string(fd, keys[num_pairs], MAX_STRING_SIZE - 1) != 0 ||
+        read_string(fd, version, MAX_STRING_SIZE - 1) != 0) {
+      return discard_values(fd, values, num_pairs);
+    }
+    int output = read_long_string(fd, &values[num_pairs]);
+    if (output != 1) {
+      return discard_values(fd, values, num_pairs + (output != -1));
+    }
+
+    char *end;
+    versions[num_pairs++] = strtoull(version, &end, 10);
+    if (version[0] < '0' || version[0] > '9' || *end != '\0') {
+      return discard_values(fd, values, num_pairs);
+    }
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      return discard_values(fd, values, num_pairs);
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs) {
+    return discard_values(fd, values, num_pairs);
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    return discard_values(fd, values, num_pairs);
+  }
+
   return num_pairs;
 }
 
@@ -291,6 +457,29 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
   return num_keys;
 }
 
+int parse_scan(int fd, char start[MAX_STRING_SIZE], char end[MAX_STRING_SIZE]) {
+  char keys[3][MAX_STRING_SIZE];
+
+  if (parse_read_delete(fd, keys, 3, MAX_STRING_SIZE) != 2) {
+    return 1;
+  }
+
+  strcpy(start, keys[0]);
+  strcpy(end, keys[1]);
+  return 0;
+}
+
+int parse_prefix(int fd, char prefix[MAX_STRING_SIZE]) {
+  char keys[2][MAX_STRING_SIZE];
+
+  if (parse_read_delete(fd, keys, 2, MAX_STRING_SIZE) != 1) {
+    return 1;
+  }
+
+  strcpy(prefix, keys[0]);
+  return 0;
+}
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
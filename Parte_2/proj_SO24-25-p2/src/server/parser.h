@@ -2,13 +2,19 @@
 #define KVS_PARSER_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "constants.h"
 
 enum Command {
   CMD_WRITE,
+  CMD_CAS,
   CMD_READ,
+  CMD_READ_PREFIX,
   CMD_DELETE,
+  CMD_DELETE_PREFIX,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -28,14 +34,32 @@ char* is_job(char filename[], unsigned char type);
 /// @return The command read.
 enum Command get_next(int fd);
 
-/// Parses a WRITE command.
+/// Parses a WRITE command. A pair may carry a third field with its TTL.
+/// Values may be of any length.
 /// @param fd File descriptor to read from.
 /// @param keys Array of keys to be written.
-/// @param values Array of values to be written.
+/// @param values Array set to the values to be written, each allocated on
+/// the heap; release them with free_values.
+/// @param ttls Array of times to live in milliseconds, 0 when none is given.
 /// @param max_pairs number of pairs to be written.
-/// @param max_string_size maximum size for keys and values.
-/// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+/// @param max_string_size maximum size for keys.
+/// @return Number of pairs parsed. 0 on failure, with nothing left to free.
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char *values[], unsigned int ttls[], size_t max_pairs, size_t max_string_size);
+
+/// Parses a CAS command. Values may be of any length.
+/// @param fd File descriptor to read from.
+/// @param keys Array of keys to be written.
+/// @param versions Array of the versions the keys are expected at.
+/// @param values Array set to the values to be written, each allocated on
+/// the heap; release them with free_values.
+/// @param max_pairs number of pairs to be written.
+/// @return Number of pairs parsed. 0 on failure, with nothing left to free.
+size_t parse_cas(int fd, char keys[][MAX_STRING_SIZE], uint64_t versions[], char *values[], size_t max_pairs);
+
+/// Frees the values returned by parse_write or parse_cas.
+/// @param values Array of values.
+/// @param num_values Number of values parsed.
+void free_values(char *values[], size_t num_values);
 
 /// Parses a READ or DELETE command.
 /// @param fd File descriptor to read from.
@@ -45,6 +69,19 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 /// @return Number of keys read or deleted. 0 on failure.
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
+/// Parses a SCAN command.
+/// @param fd File descriptor to read from.
+/// @param start Variable to store the first key of the range in.
+/// @param end Variable to store the last key of the range in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_scan(int fd, char start[MAX_STRING_SIZE], char end[MAX_STRING_SIZE]);
+
+/// Parses a READPREFIX or DELETEPREFIX command.
+/// @param fd File descriptor to read from.
+/// @param prefix Variable to store the prefix in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_prefix(int fd, char prefix[MAX_STRING_SIZE]);
+
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
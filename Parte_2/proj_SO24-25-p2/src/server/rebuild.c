@@ -0,0 +1,225 @@
+// Rebuilds the state a job had at one of its backups, from the last full
+// backup before it and the deltas written since:
+//
+//     rebuild <job> <backup>
+//
+// where <job> is the path of the job file without its extension. The full
+// backup may be a text job-N.bck or a binary job-N.snap. The pairs are written
+// to the standard output, sorted by key, in the format of a text backup, which
+// also makes this the export of the binary backups.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+#define REBUILD_BUCKETS 65536  // buckets of the pair table (power of two)
+
+typedef struct Pair {
+    char *key;
+    char *value;
+    struct Pair *next;
+} Pair;
+
+static Pair *buckets[REBUILD_BUCKETS];
+static size_t num_pairs = 0;
+
+static size_t bucket_of(const char *key) {
+    size_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h & (REBUILD_BUCKETS - 1);
+}
+
+static Pair **find_pair(const char *key) {
+    Pair **link = &buckets[bucket_of(key)];
+    while (*link != NULL && strcmp((*link)->key, key) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static int set_pair(const char *key, const char *value) {
+    Pair **link = find_pair(key);
+    char *copy = strdup(value);
+    if (!copy) return 1;
+    if (*link != NULL) {
+        free((*link)->value);
+        (*link)->value = copy;
+        return 0;
+    }
+
+    Pair *pair = malloc(sizeof(Pair));
+    if (!pair || !(pair->key = strdup(key))) {
+        free(pair);
+        free(copy);
+        return 1;
+    }
+    pair->value = copy;
+    pair->next = NULL;
+    *link = pair;
+    num_pairs++;
+    return 0;
+}
+
+static void remove_pair(const char *key) {
+    Pair **link = find_pair(key);
+    if (*link != NULL) {
+        Pair *pair = *link;
+        *link = pair->next;
+        free(pair->key);
+        free(pair->value);
+        free(pair);
+        num_pairs--;
+    }
+}
+
+// Applies one line of a backup: "(key, value)" stores a pair, and in a
+// delta "-(key)" removes one.
+// @return 0 on success, 1 if the line is malformed or on failure.
+static int apply_line(char *line) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+        line[--len] = '\0';
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (line[0] == '-') {
+        if (len < 3 || line[1] != '(' || line[len - 1] != ')') {
+            return 1;
+        }
+        line[len - 1] = '\0';
+        remove_pair(line + 2);
+        return 0;
+    }
+
+    char *separator = strstr(line, ", ");
+    if (line[0] != '(' || line[len - 1] != ')' || separator == NULL) {
+        return 1;
+    }
+    *separator = '\0';
+    line[len - 1] = '\0';
+    return set_pair(line + 1, separator + 2);
+}
+
+static int apply_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    int result = 0;
+    for (size_t number = 1; getline(&line, &size, file) != -1; number++) {
+        if (apply_line(line) != 0) {
+            fprintf(stderr, "%s:%zu: malformed line\n", path, number);
+            result = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(file);
+    return result;
+}
+
+// The TTLs are left out: the state is rebuilt as it was at the backup.
+static void add_snapshot_pair(const char *key, size_t key_len, const char *value, size_t value_len,
+                              uint64_t deadline, void *arg) {
+    (void) deadline;
+    int *failed = arg;
+    char *key_copy = strndup(key, key_len);
+    char *value_copy = strndup(value, value_len);
+    if (!key_copy || !value_copy || set_pair(key_copy, value_copy) != 0) {
+        *failed = 1;
+    }
+    free(key_copy);
+    free(value_copy);
+}
+
+static int apply_snapshot(const char *path) {
+    uint64_t log_offset;
+    int failed = 0;
+    return snapshot_load(path, &log_offset, add_snapshot_pair, &failed) != 0 || failed;
+}
+
+enum FullBackup {NO_BACKUP, TEXT_BACKUP, BINARY_BACKUP};
+
+// Finds a full backup, in either format.
+// @param path Set to the path of the backup.
+// @return Format of the backup, NO_BACKUP if there is none.
+static enum FullBackup full_backup(const char *job, int number, char *path, size_t size) {
+    snprintf(path, size, "%s-%d.bck", job, number);
+    if (access(path, R_OK) == 0) {
+        return TEXT_BACKUP;
+    }
+    snprintf(path, size, "%s-%d.snap", job, number);
+    return access(path, R_OK) == 0 ? BINARY_BACKUP : NO_BACKUP;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp((*(Pair *const *) a)->key, (*(Pair *const *) b)->key);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <job> <backup>\n", argv[0]);
+        return 1;
+    }
+    const char *job = argv[1];
+    int target = atoi(argv[2]);
+    char path[FILENAME_MAX];
+
+    // walk back to the full backup the chain starts from
+    int base = target;
+    while (base > 0) {
+        if (full_backup(job, base, path, sizeof(path)) != NO_BACKUP) {
+            break;
+        }
+        snprintf(path, sizeof(path), "%s-%d.delta", job, base);
+        if (access(path, R_OK) != 0) {
+            fprintf(stderr, "Backup %d of %s is missing\n", base, job);
+            return 1;
+        }
+        base--;
+    }
+    if (base == 0) {
+        fprintf(stderr, "No full backup of %s before %d\n", job, target);
+        return 1;
+    }
+
+    int result = full_backup(job, base, path, sizeof(path)) == BINARY_BACKUP ? apply_snapshot(path)
+                                                                             : apply_file(path);
+    if (result != 0) {
+        return 1;
+    }
+    for (int number = base + 1; number <= target; number++) {
+        snprintf(path, sizeof(path), "%s-%d.delta", job, number);
+        if (apply_file(path) != 0) {
+            return 1;
+        }
+    }
+
+    Pair **pairs = malloc((num_pairs + 1) * sizeof(Pair *));
+    if (!pairs) {
+        perror("Failed to allocate pairs");
+        return 1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < REBUILD_BUCKETS; i++) {
+        for (Pair *pair = buckets[i]; pair != NULL; pair = pair->next) {
+            pairs[count++] = pair;
+        }
+    }
+    qsort(pairs, count, sizeof(Pair *), compare_pairs);
+    for (size_t i = 0; i < count; i++) {
+        printf("(%s, %s)\n", pairs[i]->key, pairs[i]->value);
+    }
+    free(pairs);
+    return 0;
+}
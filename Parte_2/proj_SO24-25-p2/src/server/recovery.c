@@ -0,0 +1,128 @@
+#include "recovery.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wal.h"
+
+// Copies a string into the strings of the log, null terminated.
+// @return Offset of the copy.
+static size_t add_string(RecoveryLog *log, const char *str, size_t len) {
+    if (log->strings_len + len + 1 > log->strings_capacity) {
+        size_t capacity = log->strings_capacity > 0 ? log->strings_capacity : 1 << 16;
+        while (capacity < log->strings_len + len + 1) {
+            capacity *= 2;
+        }
+        char *strings = realloc(log->strings, capacity);
+        if (!strings) {
+            log->failed = 1;
+            return 0;
+        }
+        log->strings = strings;
+        log->strings_capacity = capacity;
+    }
+    size_t offset = log->strings_len;
+    memcpy(log->strings + offset, str, len);
+    log->strings[offset + len] = '\0';
+    log->strings_len += len + 1;
+    return offset;
+}
+
+// Adds a change to the log.
+// @param value Offset of the value, in the snapshot if it came from there,
+// in the strings otherwise; RECOVERED_REMOVAL if the key was removed.
+static void add_change(RecoveryLog *log, const char *key, size_t key_len, size_t value, size_t value_len,
+                       uint64_t deadline) {
+    if (log->failed) {
+        return;
+    }
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity > 0 ? log->capacity * 2 : 1024;
+        RecoveredChange *changes = realloc(log->changes, capacity * sizeof(RecoveredChange));
+        if (!changes) {
+            log->failed = 1;
+            return;
+        }
+        log->changes = changes;
+        log->capacity = capacity;
+    }
+    RecoveredChange *change = &log->changes[log->count];
+    change->key = add_string(log, key, key_len);
+    change->value = value;
+    change->value_len = value_len;
+    change->deadline = deadline;
+    if (!log->failed) {
+        log->count++;
+    }
+}
+
+// The snapshot stays mapped, so its values are kept as their offsets in it.
+static void add_snapshot_pair(const char *key, size_t key_len, const char *value, size_t value_len,
+                              uint64_t deadline, void *arg) {
+    RecoveryLog *log = arg;
+    add_change(log, key, key_len, (size_t) (value - log->snapshot.data), value_len, deadline);
+}
+
+// The segments of the log are unmapped as the replay moves on, so its
+// values are copied.
+static void add_record(enum WalRecordType type, const char *key, size_t key_len, const char *value,
+                       size_t value_len, uint64_t deadline, void *arg) {
+    RecoveryLog *log = arg;
+    if (type == WAL_DELETE) {
+        add_change(log, key, key_len, RECOVERED_REMOVAL, 0, deadline);
+    } else {
+        add_change(log, key, key_len, add_string(log, value, value_len), value_len, deadline);
+    }
+}
+
+void recovery_snapshot_path(const char *wal_path, char *path, size_t size) {
+    snprintf(path, size, "%s.snap", wal_path);
+}
+
+int recovery_load(const char *wal_path, RecoveryLog *log) {
+    memset(log, 0, sizeof(*log));
+    char path[FILENAME_MAX];
+    recovery_snapshot_path(wal_path, path, sizeof(path));
+
+    uint64_t log_offset;
+    if (snapshot_map(path, &log->snapshot, &log_offset, add_snapshot_pair, log) != 0) {
+        // nothing was taken from it; the log may still hold every record
+        log_offset = 0;
+    }
+    log->from_snapshot = log->count;
+
+    // the segments before the snapshot may be compacted, so there is nothing
+    // to fall back on: the store is not loaded without every record after it
+    if (wal_replay(wal_path, log_offset, add_record, log) != 0) {
+        fprintf(stderr, "Failed to replay the log %s from offset %" PRIu64 "%s\n", wal_path, log_offset,
+                log_offset > 0 ? ", where its snapshot ends" : "");
+        recovery_free(log);
+        return 1;
+    }
+
+    if (log->failed) {
+        fprintf(stderr, "Failed to allocate the recovered pairs\n");
+        recovery_free(log);
+        return 1;
+    }
+    return 0;
+}
+
+const char *recovered_key(const RecoveryLog *log, const RecoveredChange *change) {
+    return log->strings + change->key;
+}
+
+const char *recovered_value(const RecoveryLog *log, const RecoveredChange *change) {
+    if (change->value == RECOVERED_REMOVAL) {
+        return NULL;
+    }
+    int from_snapshot = (size_t) (change - log->changes) < log->from_snapshot;
+    return (from_snapshot ? log->snapshot.data : log->strings) + change->value;
+}
+
+void recovery_free(RecoveryLog *log) {
+    free(log->changes);
+    free(log->strings);
+    snapshot_unmap(&log->snapshot);
+    memset(log, 0, sizeof(*log));
+}
@@ -0,0 +1,69 @@
+#ifndef KVS_RECOVERY_H
+#define KVS_RECOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "snapshot.h"
+
+#define RECOVERY_THREADS 4   // threads that insert the recovered pairs
+#define RECOVERY_CHUNK 256   // changes applied per lock of a stripe
+
+// State of the store recovered at startup: the snapshot next to the
+// write-ahead log, followed by the records the log got after it. Both are
+// read into a single list of changes, in the order they have to be applied,
+// before anything is inserted into the table. The values of the snapshot are
+// not copied: the snapshot stays mapped until the changes are freed.
+
+typedef struct RecoveredChange {
+    size_t key;                          // offset of the key in the strings
+    size_t value;                        // offset of the value, or RECOVERED_REMOVAL
+    size_t value_len;
+    uint64_t deadline;                   // time the key expires at, 0 if it does not
+} RecoveredChange;
+
+#define RECOVERED_REMOVAL SIZE_MAX
+
+typedef struct RecoveryLog {
+    RecoveredChange *changes;
+    size_t count;
+    size_t capacity;
+    char *strings;                       // null terminated keys, and the values of the log
+    size_t strings_len;
+    size_t strings_capacity;
+    SnapshotMap snapshot;                // values of the changes that came from the snapshot
+    size_t from_snapshot;                // changes that came from the snapshot
+    int failed;                          // memory ran out while reading
+} RecoveryLog;
+
+/// Gets the path of the snapshot kept next to a log.
+/// @param wal_path Path of the log.
+/// @param path Buffer for the path of the snapshot.
+/// @param size Size of the buffer.
+void recovery_snapshot_path(const char *wal_path, char *path, size_t size);
+
+/// Reads the snapshot of a log and the records after it. A damaged snapshot
+/// is ignored, and then the whole log is read.
+/// @param wal_path Path of the log.
+/// @param log Set to the changes to be applied, freed with recovery_free.
+/// @return 0 on success, 1 if the log lacks records the store needs, or
+/// could not be read.
+int recovery_load(const char *wal_path, RecoveryLog *log);
+
+/// Gets the key of a change.
+/// @param log Recovered changes.
+/// @param change Change of the log.
+/// @return Null terminated key.
+const char *recovered_key(const RecoveryLog *log, const RecoveredChange *change);
+
+/// Gets the value of a change.
+/// @param log Recovered changes.
+/// @param change Change of the log.
+/// @return Value, not null terminated, of change->value_len bytes; NULL if the
+/// key was removed.
+const char *recovered_value(const RecoveryLog *log, const RecoveredChange *change);
+
+/// Frees the memory of the recovered changes.
+/// @param log Recovered changes.
+void recovery_free(RecoveryLog *log);
+
+#endif  // KVS_RECOVERY_H
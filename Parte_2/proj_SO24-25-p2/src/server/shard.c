@@ -0,0 +1,382 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // pthread_setaffinity_np
+#endif
+#include "shard.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "epoch.h"
+#include "notify.h"
+#include "slab.h"
+
+enum ShardOp { SHARD_WRITE, SHARD_READ, SHARD_DELETE, SHARD_CAS, SHARD_EXPIRE, SHARD_CALL, SHARD_STOP };
+
+// Completion of a command split over several shards.
+typedef struct ShardBatch {
+    size_t pending;  // requests not yet executed
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} ShardBatch;
+
+// Part of a command that belongs to one shard.
+typedef struct ShardRequest {
+    enum ShardOp op;
+    size_t *indices;  // positions of the keys of this shard, in command order
+    size_t count;
+    char (*keys)[MAX_STRING_SIZE];
+    char **values;
+    int *missing;
+    uint64_t *versions;
+    uint64_t *deadlines;
+    ShardCall call;   // function run by SHARD_CALL
+    void *arg;
+    ShardBatch *batch;
+    struct ShardRequest *next;
+} ShardRequest;
+
+typedef struct Shard {
+    HashTable *table;
+    size_t index;
+    pthread_t owner;
+    ShardRequest stop;   // SHARD_STOP request, sent once
+    ShardRequest *head;  // queue of requests, oldest first
+    ShardRequest *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+} Shard;
+
+static Shard *shards = NULL;
+static size_t num_shards = 0;
+static int owners_running = 0;
+
+static void enqueue_request(Shard *shard, ShardRequest *request) {
+    request->next = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->tail == NULL) {
+        shard->head = request;
+    } else {
+        shard->tail->next = request;
+    }
+    shard->tail = request;
+    pthread_cond_signal(&shard->not_empty);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static ShardRequest *dequeue_request(Shard *shard) {
+    pthread_mutex_lock(&shard->mutex);
+    while (shard->head == NULL) {
+        pthread_cond_wait(&shard->not_empty, &shard->mutex);
+    }
+    ShardRequest *request = shard->head;
+    shard->head = request->next;
+    if (shard->head == NULL) {
+        shard->tail = NULL;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return request;
+}
+
+// Runs a request on the shard's table. The owner is the only thread that
+// touches the table, so it takes none of its locks.
+static void execute_request(Shard *shard, ShardRequest *request) {
+    HashTable *ht = shard->table;
+
+    // each subscriber gets the notifications of the request in one write
+    notify_hold();
+    switch (request->op) {
+        case SHARD_WRITE:
+            reserve_pairs(ht, request->count);
+            for (size_t i = 0; i < request->count; i++) {
+                size_t k = request->indices[i];
+                if (write_pair(ht, request->keys[k], request->values[k], request->deadlines[k]) != 0) {
+                    fprintf(stderr, "Failed to write keypair (%s,%s)\n", request->keys[k], request->values[k]);
+                }
+                if (request->versions != NULL) {
+                    request->versions[k] = pair_version(ht, request->keys[k]);
+                }
+            }
+            release_pairs(ht, request->count);
+            rehash_step(ht);
+            evict_pairs(ht);
+            break;
+
+        case SHARD_READ:
+            for (size_t i = 0; i < request->count; i++) {
+                size_t k = request->indices[i];
+                size_t len;
+                request->missing[k] = read_pair(ht, request->keys[k], request->values[k], MAX_STRING_SIZE, &len);
+                if (request->missing[k] == 0 && len >= MAX_STRING_SIZE) {
+                    // too long for the caller's buffer
+                    request->values[k] = copy_pair(ht, request->keys[k], NULL);
+                    request->missing[k] = request->values[k] == NULL;
+                }
+            }
+            break;
+
+        case SHARD_DELETE:
+            for (size_t i = 0; i < request->count; i++) {
+                size_t k = request->indices[i];
+                request->missing[k] = delete_pair(ht, request->keys[k]);
+            }
+            rehash_step(ht);
+            break;
+
+        case SHARD_CAS:
+            reserve_pairs(ht, request->count);
+            for (size_t i = 0; i < request->count; i++) {
+                size_t k = request->indices[i];
+                request->missing[k] = cas_pair(ht, request->keys[k], request->versions[k], request->values[k],
+                                               &request->versions[k]);
+            }
+            release_pairs(ht, request->count);
+            rehash_step(ht);
+            evict_pairs(ht);
+            break;
+
+        case SHARD_EXPIRE:
+            for (size_t i = 0; i < request->count; i++) {
+                size_t k = request->indices[i];
+                request->missing[k] = expire_pair(ht, request->keys[k], request->versions[k]);
+            }
+            rehash_step(ht);
+            break;
+
+        case SHARD_CALL:
+            request->call(ht, shard->index, request->arg);
+            break;
+
+        case SHARD_STOP:
+            break;
+    }
+    notify_flush();
+}
+
+static void *shard_owner(void *arg) {
+    Shard *shard = arg;
+
+    while (1) {
+        ShardRequest *request = dequeue_request(shard);
+        if (request->op == SHARD_STOP) {
+            break;
+        }
+        execute_request(shard, request);
+
+        ShardBatch *batch = request->batch;
+        pthread_mutex_lock(&batch->mutex);
+        if (--batch->pending == 0) {
+            pthread_cond_signal(&batch->done);
+        }
+        pthread_mutex_unlock(&batch->mutex);
+    }
+
+    epoch_thread_exit();
+    slab_thread_exit();
+    return NULL;
+}
+
+// Pins an owner thread to one core, round robin over the online cores.
+static void pin_owner(pthread_t owner, size_t index) {
+#ifdef __linux__
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % (size_t) cores, &set);
+    pthread_setaffinity_np(owner, sizeof(set), &set);
+#else
+    (void) owner;
+    (void) index;
+#endif
+}
+
+// Stops the first num_owners owner threads and frees the first count shards.
+static void free_shards(size_t count, size_t num_owners) {
+    for (size_t i = 0; i < num_owners; i++) {
+        shards[i].stop.op = SHARD_STOP;
+        enqueue_request(&shards[i], &shards[i].stop);
+    }
+    for (size_t i = 0; i < num_owners; i++) {
+        pthread_join(shards[i].owner, NULL);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free_table(shards[i].table);
+        pthread_mutex_destroy(&shards[i].mutex);
+        pthread_cond_destroy(&shards[i].not_empty);
+    }
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+}
+
+int shards_init(size_t count, enum TableEngine engine, size_t max_bytes) {
+    if (count == 0 || count > MAX_SHARDS) {
+        fprintf(stderr, "Number of shards must be between 1 and %d\n", MAX_SHARDS);
+        return 1;
+    }
+
+    shards = calloc(count, sizeof(Shard));
+    if (!shards) return 1;
+    num_shards = count;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        shards[i].table = create_hash_table(1, engine);
+        if (shards[i].table == NULL) {
+            free_shards(i, 0);
+            return 1;
+        }
+        // each shard gets an equal part of the memory limit
+        shards[i].table->max_bytes = max_bytes / count;
+        shards[i].table->owned = 1;
+        shards[i].index = i;
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        pthread_cond_init(&shards[i].not_empty, NULL);
+    }
+
+    for (size_t i = 0; i < num_shards; i++) {
+        if (pthread_create(&shards[i].owner, NULL, shard_owner, &shards[i]) != 0) {
+            fprintf(stderr, "Failed to create owner of shard %zu\n", i);
+            free_shards(num_shards, i);
+            return 1;
+        }
+        pin_owner(shards[i].owner, i);
+    }
+    owners_running = 1;
+    return 0;
+}
+
+void shards_terminate() {
+    free_shards(num_shards, owners_running ? num_shards : 0);
+    owners_running = 0;
+}
+
+size_t shard_count() {
+    return num_shards;
+}
+
+size_t shard_of(const char *key) {
+    // the high half of the hash, the low bits already pick the bucket inside the shard
+    return (size_t) ((hash(key) >> 32) % num_shards);
+}
+
+// Splits a command by shard with a stable counting sort, sends every non
+// empty part to its owner and waits for all of them to finish.
+static void run_batch(enum ShardOp op, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                      char *values[], int *missing, uint64_t *versions, uint64_t *deadlines) {
+    size_t *indices = malloc(num_keys * sizeof(size_t));
+    size_t *owner = malloc(num_keys * sizeof(size_t));
+    size_t *start = calloc(num_shards + 1, sizeof(size_t));
+    ShardRequest *requests = calloc(num_shards, sizeof(ShardRequest));
+    if (!indices || !owner || !start || !requests) {
+        perror("Failed to split command by shard");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < num_keys; i++) {
+        owner[i] = shard_of(keys[i]);
+        start[owner[i] + 1]++;
+    }
+    for (size_t s = 0; s < num_shards; s++) {
+        start[s + 1] += start[s];
+    }
+    for (size_t i = 0; i < num_keys; i++) {
+        indices[start[owner[i]] + requests[owner[i]].count++] = i;
+    }
+
+    ShardBatch batch = {.pending = 0};
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    for (size_t s = 0; s < num_shards; s++) {
+        if (requests[s].count > 0) {
+            batch.pending++;
+        }
+    }
+
+    for (size_t s = 0; s < num_shards; s++) {
+        if (requests[s].count == 0) {
+            continue;
+        }
+        requests[s].op = op;
+        requests[s].indices = indices + start[s];
+        requests[s].keys = keys;
+        requests[s].values = values;
+        requests[s].missing = missing;
+        requests[s].versions = versions;
+        requests[s].deadlines = deadlines;
+        requests[s].batch = &batch;
+        enqueue_request(&shards[s], &requests[s]);
+    }
+
+    pthread_mutex_lock(&batch.mutex);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.mutex);
+    }
+    pthread_mutex_unlock(&batch.mutex);
+
+    pthread_mutex_destroy(&batch.mutex);
+    pthread_cond_destroy(&batch.done);
+    free(requests);
+    free(start);
+    free(owner);
+    free(indices);
+}
+
+void shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[], uint64_t *deadlines,
+                 uint64_t *versions) {
+    run_batch(SHARD_WRITE, num_pairs, keys, values, NULL, versions, deadlines);
+}
+
+void shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE], char *values[], int *missing) {
+    run_batch(SHARD_READ, num_keys, keys, values, missing, NULL, NULL);
+}
+
+void shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE], int *missing) {
+    run_batch(SHARD_DELETE, num_keys, keys, NULL, missing, NULL, NULL);
+}
+
+void shard_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t *versions,
+               char *values[], int *failed) {
+    run_batch(SHARD_CAS, num_pairs, keys, values, failed, versions, NULL);
+}
+
+void shard_expire(size_t num_keys, char keys[][MAX_STRING_SIZE], uint64_t *versions, int *kept) {
+    run_batch(SHARD_EXPIRE, num_keys, keys, NULL, kept, versions, NULL);
+}
+
+// Sends a SHARD_CALL to the owners of the shards from first to last and
+// waits for all of them.
+static void run_calls(size_t first, size_t last, ShardCall call, void *arg) {
+    ShardRequest requests[last - first + 1];
+    ShardBatch batch = {.pending = last - first + 1};
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.done, NULL);
+
+    for (size_t s = first; s <= last; s++) {
+        ShardRequest *request = &requests[s - first];
+        request->op = SHARD_CALL;
+        request->call = call;
+        request->arg = arg;
+        request->batch = &batch;
+        enqueue_request(&shards[s], request);
+    }
+
+    pthread_mutex_lock(&batch.mutex);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.mutex);
+    }
+    pthread_mutex_unlock(&batch.mutex);
+
+    pthread_mutex_destroy(&batch.mutex);
+    pthread_cond_destroy(&batch.done);
+}
+
+void shard_call(size_t index, ShardCall call, void *arg) {
+    run_calls(index, index, call, arg);
+}
+
+void shard_each(ShardCall call, void *arg) {
+    run_calls(0, num_shards - 1, call, arg);
+}
@@ -0,0 +1,99 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <stddef.h>
+#include "constants.h"
+#include "kvs.h"
+
+#define MAX_SHARDS 256
+
+// Shared-nothing mode. The key space is split into shards, each with its own
+// table owned by one thread (pinned to a core where supported) that executes
+// the operations sent to its queue. Writers never contend on locks: a
+// multi-key command is split by shard and each owner applies its part in
+// order. Only the owner ever touches its table, so it takes none of the
+// table's locks; anything else that needs a shard table sends a function to
+// its owner with shard_call or shard_each. Unlike the lock-based mode, a
+// command spanning several shards is not atomic as a whole.
+
+/// Function run by the owner of a shard on its table.
+/// @param ht Table of the shard.
+/// @param index Index of the shard.
+/// @param arg Argument given to shard_call or shard_each.
+typedef void (*ShardCall)(HashTable *ht, size_t index, void *arg);
+
+/// Creates the shard tables and starts their owner threads.
+/// @param num_shards Number of shards, at most MAX_SHARDS.
+/// @param engine How the shard tables keep their nodes.
+/// @param max_bytes Memory limit of all the shards together, 0 for none.
+/// @return 0 on success, 1 otherwise, with nothing left running.
+int shards_init(size_t num_shards, enum TableEngine engine, size_t max_bytes);
+
+/// Stops the owner threads and frees the shard tables.
+void shards_terminate();
+
+/// Gets the number of shards.
+/// @return Number of shards, 0 if the sharded mode is not running.
+size_t shard_count();
+
+/// Gets the shard that owns a key.
+/// @param key Key to be located.
+/// @return Index of the shard.
+size_t shard_of(const char *key);
+
+/// Writes pairs through their owners, in the order they are given.
+/// @param num_pairs Number of pairs to be written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param deadlines Array with the time keys[i] expires at, as given to write_pair.
+/// @param versions Array where the new version of keys[i] is stored, or NULL.
+void shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *values[], uint64_t *deadlines,
+                 uint64_t *versions);
+
+/// Reads keys through their owners.
+/// @param num_keys Number of keys to be read.
+/// @param keys Array of keys' strings.
+/// @param values Array of buffers of MAX_STRING_SIZE characters where the
+/// value of keys[i] is copied to values[i]. A value too long for its buffer
+/// is copied to a new one instead, which replaces values[i] and is freed by
+/// the caller.
+/// @param missing Array where missing[i] is set to 1 if keys[i] does not exist, 0 otherwise.
+void shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE], char *values[], int *missing);
+
+/// Deletes keys through their owners.
+/// @param num_keys Number of keys to be deleted.
+/// @param keys Array of keys' strings.
+/// @param missing Array where missing[i] is set to 1 if keys[i] did not exist, 0 otherwise.
+void shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE], int *missing);
+
+/// Writes pairs through their owners if their keys are at the expected
+/// versions, in the order they are given.
+/// @param num_pairs Number of pairs to be written.
+/// @param keys Array of keys' strings.
+/// @param versions Array of expected versions, each replaced by the key's new
+/// version, or by its current one if it did not match.
+/// @param values Array of values' strings.
+/// @param failed Array where failed[i] is set to the result of cas_pair for keys[i].
+void shard_cas(size_t num_pairs, char keys[][MAX_STRING_SIZE], uint64_t *versions,
+               char *values[], int *failed);
+
+/// Deletes keys through their owners if they are still at given versions.
+/// @param num_keys Number of keys to be deleted.
+/// @param keys Array of keys' strings.
+/// @param versions Array of the versions the keys must be at.
+/// @param kept Array where kept[i] is set to 0 if keys[i] was deleted, 1 otherwise.
+void shard_expire(size_t num_keys, char keys[][MAX_STRING_SIZE], uint64_t *versions, int *kept);
+
+/// Runs a function on the owner of one shard and waits for it.
+/// @param index Index of the shard.
+/// @param call Function to be run on the shard's table.
+/// @param arg Argument passed to call.
+void shard_call(size_t index, ShardCall call, void *arg);
+
+/// Runs a function on the owners of all shards, in parallel, and waits for
+/// all of them.
+/// @param call Function to be run on every shard's table.
+/// @param arg Argument passed to call, shared by all the owners.
+void shard_each(ShardCall call, void *arg);
+
+#endif  // KVS_SHARD_H
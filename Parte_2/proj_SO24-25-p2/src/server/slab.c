@@ -0,0 +1,206 @@
+#include "slab.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Every page starts with this header, so the size class of an object is found
+// by rounding its address down to the page boundary.
+typedef struct SlabPage {
+    _Alignas(SLAB_CLASS_STEP) size_t class_index;
+} SlabPage;
+
+typedef struct FreeObject {
+    struct FreeObject *next;
+} FreeObject;
+
+// Shared free list of a size class, used to refill and drain thread caches.
+typedef struct SlabClass {
+    pthread_mutex_t mutex;
+    FreeObject *free;
+    size_t pages;
+} SlabClass;
+
+// Per-thread cache. Caches are never freed: a thread that exits gives its
+// cache back and the next thread to register reuses it, counters included.
+typedef struct SlabCache {
+    FreeObject *free[SLAB_NUM_CLASSES];
+    size_t count[SLAB_NUM_CLASSES];
+    atomic_size_t allocs[SLAB_NUM_CLASSES];
+    atomic_size_t frees[SLAB_NUM_CLASSES];
+    atomic_int in_use;
+    struct SlabCache *next;
+} SlabCache;
+
+static SlabClass classes[SLAB_NUM_CLASSES];
+static _Atomic(SlabCache *) caches = NULL;
+static _Thread_local SlabCache *self = NULL;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_classes() {
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].mutex, NULL);
+        classes[i].free = NULL;
+        classes[i].pages = 0;
+    }
+}
+
+static SlabCache *get_cache() {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&init_once, init_classes);
+
+    // reuse the cache of a thread that has exited
+    for (SlabCache *c = atomic_load(&caches); c != NULL; c = c->next) {
+        int expected = 0;
+        if (atomic_load(&c->in_use) == 0 && atomic_compare_exchange_strong(&c->in_use, &expected, 1)) {
+            self = c;
+            return self;
+        }
+    }
+
+    SlabCache *c = calloc(1, sizeof(SlabCache));
+    if (!c) {
+        perror("Failed to allocate slab cache");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&c->in_use, 1);
+    c->next = atomic_load(&caches);
+    while (!atomic_compare_exchange_weak(&caches, &c->next, c)) {
+    }
+    self = c;
+    return self;
+}
+
+static inline size_t class_size(size_t index) {
+    return (index + 1) * SLAB_CLASS_STEP;
+}
+
+// Carves a new page into objects of the class and adds them to the shared
+// list. Must be called with the class lock held.
+static int grow_class(size_t index) {
+    SlabPage *page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (!page) return 1;
+    page->class_index = index;
+
+    size_t size = class_size(index);
+    char *object = (char *) page + sizeof(SlabPage);
+    char *end = (char *) page + SLAB_PAGE_SIZE;
+    for (; object + size <= end; object += size) {
+        FreeObject *free_object = (FreeObject *) (void *) object;
+        free_object->next = classes[index].free;
+        classes[index].free = free_object;
+    }
+    classes[index].pages++;
+    return 0;
+}
+
+// Moves half a cache worth of objects from the shared list to the thread.
+static void refill(SlabCache *cache, size_t index) {
+    SlabClass *class = &classes[index];
+
+    pthread_mutex_lock(&class->mutex);
+    while (cache->count[index] < SLAB_CACHE_SIZE / 2) {
+        if (class->free == NULL && grow_class(index) != 0) {
+            break;
+        }
+        FreeObject *object = class->free;
+        class->free = object->next;
+        object->next = cache->free[index];
+        cache->free[index] = object;
+        cache->count[index]++;
+    }
+    pthread_mutex_unlock(&class->mutex);
+}
+
+// Moves objects from the thread back to the shared list until it keeps
+// at most keep of them.
+static void drain(SlabCache *cache, size_t index, size_t keep) {
+    SlabClass *class = &classes[index];
+
+    pthread_mutex_lock(&class->mutex);
+    while (cache->count[index] > keep) {
+        FreeObject *object = cache->free[index];
+        cache->free[index] = object->next;
+        object->next = class->free;
+        class->free = object;
+        cache->count[index]--;
+    }
+    pthread_mutex_unlock(&class->mutex);
+}
+
+void *slab_alloc(size_t size) {
+    if (size == 0 || size > SLAB_MAX_SIZE) {
+        return NULL;
+    }
+    SlabCache *cache = get_cache();
+    size_t index = (size - 1) / SLAB_CLASS_STEP;
+
+    if (cache->free[index] == NULL) {
+        refill(cache, index);
+        if (cache->free[index] == NULL) {
+            return NULL;
+        }
+    }
+    FreeObject *object = cache->free[index];
+    cache->free[index] = object->next;
+    cache->count[index]--;
+    atomic_fetch_add_explicit(&cache->allocs[index], 1, memory_order_relaxed);
+    return object;
+}
+
+void slab_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    SlabCache *cache = get_cache();
+    SlabPage *page = (SlabPage *) ((uintptr_t) ptr & ~((uintptr_t) SLAB_PAGE_SIZE - 1));
+    size_t index = page->class_index;
+
+    FreeObject *object = ptr;
+    object->next = cache->free[index];
+    cache->free[index] = object;
+    atomic_fetch_add_explicit(&cache->frees[index], 1, memory_order_relaxed);
+
+    if (++cache->count[index] >= SLAB_CACHE_SIZE) {
+        drain(cache, index, SLAB_CACHE_SIZE / 2);
+    }
+}
+
+void slab_stats(SlabStats *stats) {
+    pthread_once(&init_once, init_classes);
+    stats->objects_in_use = 0;
+    stats->bytes_in_use = 0;
+    stats->bytes_reserved = 0;
+
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        // an object may be freed by another thread than the one that allocated it,
+        // so only the sum over every cache is meaningful
+        size_t allocs = 0;
+        size_t frees = 0;
+        for (SlabCache *c = atomic_load(&caches); c != NULL; c = c->next) {
+            allocs += atomic_load_explicit(&c->allocs[i], memory_order_relaxed);
+            frees += atomic_load_explicit(&c->frees[i], memory_order_relaxed);
+        }
+        size_t in_use = allocs > frees ? allocs - frees : 0;
+        stats->objects_in_use += in_use;
+        stats->bytes_in_use += in_use * class_size(i);
+
+        pthread_mutex_lock(&classes[i].mutex);
+        stats->bytes_reserved += classes[i].pages * SLAB_PAGE_SIZE;
+        pthread_mutex_unlock(&classes[i].mutex);
+    }
+}
+
+void slab_thread_exit() {
+    if (self == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        drain(self, i, 0);
+    }
+    atomic_store(&self->in_use, 0);
+    self = NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE (64 * 1024)  // pages are aligned to their size
+#define SLAB_CLASS_STEP 16          // size classes are multiples of this
+#define SLAB_MAX_SIZE 256           // largest object served by the slabs
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_STEP)
+#define SLAB_CACHE_SIZE 64          // free objects kept per class by each thread
+
+typedef struct SlabStats {
+    size_t objects_in_use;  // objects handed out and not yet freed
+    size_t bytes_in_use;    // sum of the size classes of those objects
+    size_t bytes_reserved;  // memory taken from the system for slab pages
+} SlabStats;
+
+/// Allocates an object from the size class that fits it. Objects freed by
+/// the calling thread are reused first, so the common path takes no lock.
+/// @param size Size of the object, at most SLAB_MAX_SIZE.
+/// @return Pointer aligned to SLAB_CLASS_STEP, NULL on failure.
+void *slab_alloc(size_t size);
+
+/// Gives an object back to its size class. Any thread may free any object.
+/// @param ptr Object returned by slab_alloc, or NULL.
+void slab_free(void *ptr);
+
+/// Collects the usage counters of every thread.
+/// @param stats Structure to be filled.
+void slab_stats(SlabStats *stats);
+
+/// Returns the objects cached by the calling thread to the shared lists.
+/// Called by threads that exit while the server keeps running.
+void slab_thread_exit();
+
+#endif  // KVS_SLAB_H
@@ -0,0 +1,350 @@
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "wal.h"
+#include "../common/io.h"
+
+#define SNAPSHOT_HEADER 16          // magic and log offset
+#define SNAPSHOT_VARINT_MAX 10      // bytes of the longest varint
+#define SNAPSHOT_FOOTER_CHECKED 24  // bytes of the footer covered by its checksum
+
+// serializes putting snapshots in place, so that the check of the snapshot
+// being replaced and the rename are one step
+static pthread_mutex_t install_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Encodes a varint.
+// @return Number of bytes written to out.
+static size_t put_varint(unsigned char *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char) value;
+    return len;
+}
+
+// Decodes a varint that must end before a limit.
+// @param offset Offset of the varint, moved past it.
+// @return 0 on success, 1 if the varint is malformed.
+static int get_varint(const char *data, uint64_t limit, uint64_t *offset, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *offset < limit; shift += 7) {
+        unsigned char byte = (unsigned char) data[(*offset)++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int write_bytes(SnapshotWriter *writer, const void *data, size_t len) {
+    if (len > 0 && write_all(writer->fd, data, len) != 1) {
+        return 1;
+    }
+    writer->offset += len;
+    return 0;
+}
+
+static int add_block(SnapshotWriter *writer, uint64_t offset, uint64_t length, uint32_t pairs, uint32_t crc) {
+    if (writer->num_blocks == writer->blocks_capacity) {
+        size_t capacity = writer->blocks_capacity > 0 ? writer->blocks_capacity * 2 : 64;
+        SnapshotBlock *blocks = realloc(writer->blocks, capacity * sizeof(SnapshotBlock));
+        if (!blocks) {
+            return 1;
+        }
+        writer->blocks = blocks;
+        writer->blocks_capacity = capacity;
+    }
+    writer->blocks[writer->num_blocks++] = (SnapshotBlock){offset, length, pairs, crc};
+    return 0;
+}
+
+// Writes the block being filled and adds it to the index.
+static int flush_block(SnapshotWriter *writer) {
+    if (writer->len == 0) {
+        return 0;
+    }
+    uint64_t offset = writer->offset;
+    uint32_t crc = crc32c(0, writer->data, writer->len);
+    if (write_bytes(writer, writer->data, writer->len) != 0 ||
+        add_block(writer, offset, writer->len, writer->pairs, crc) != 0) {
+        return 1;
+    }
+    writer->len = 0;
+    writer->pairs = 0;
+    return 0;
+}
+
+int snapshot_begin(SnapshotWriter *writer, const char *path, uint64_t log_offset, int if_newer) {
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+    // backup threads writing the same path at the same time each get a file
+    // of their own
+    if ((size_t) snprintf(writer->temp_path, sizeof(writer->temp_path), "%s.XXXXXX", path) >=
+        sizeof(writer->temp_path)) {
+        fprintf(stderr, "The path %s is too long\n", path);
+        return 1;
+    }
+    writer->fd = mkstemp(writer->temp_path);
+    if (writer->fd < 0) {
+        perror(writer->temp_path);
+        return 1;
+    }
+    writer->log_offset = log_offset;
+    writer->if_newer = if_newer;
+    writer->offset = 0;
+    writer->num_pairs = 0;
+    writer->blocks = NULL;
+    writer->num_blocks = 0;
+    writer->blocks_capacity = 0;
+    writer->pairs = 0;
+    writer->len = 0;
+
+    char header[SNAPSHOT_HEADER];
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    memcpy(header + 8, &log_offset, sizeof(log_offset));
+    return write_bytes(writer, header, sizeof(header));
+}
+
+int snapshot_add(SnapshotWriter *writer, const char *key, const char *value, size_t value_len, uint64_t deadline) {
+    unsigned char lengths[3 * SNAPSHOT_VARINT_MAX];
+    size_t key_len = strlen(key);
+    size_t lengths_len = put_varint(lengths, key_len);
+    lengths_len += put_varint(lengths + lengths_len, value_len);
+    lengths_len += put_varint(lengths + lengths_len, deadline);
+    size_t size = lengths_len + key_len + value_len;
+    if (writer->len + size > SNAPSHOT_BLOCK && flush_block(writer) != 0) {
+        return 1;
+    }
+    writer->num_pairs++;
+
+    if (size > SNAPSHOT_BLOCK) {
+        // a pair larger than a block gets a block of its own
+        uint64_t offset = writer->offset;
+        uint32_t crc = crc32c(0, lengths, lengths_len);
+        crc = crc32c(crc, key, key_len);
+        crc = crc32c(crc, value, value_len);
+        if (write_bytes(writer, lengths, lengths_len) != 0 || write_bytes(writer, key, key_len) != 0 ||
+            write_bytes(writer, value, value_len) != 0) {
+            return 1;
+        }
+        return add_block(writer, offset, size, 1, crc);
+    }
+
+    char *pair = writer->data + writer->len;
+    memcpy(pair, lengths, lengths_len);
+    memcpy(pair + lengths_len, key, key_len);
+    memcpy(pair + lengths_len + key_len, value, value_len);
+    writer->len += size;
+    writer->pairs++;
+    return 0;
+}
+
+// Writes the index of the blocks and the footer.
+static int write_index(SnapshotWriter *writer) {
+    SnapshotFooter footer = {
+        .index_offset = writer->offset,
+        .num_blocks = writer->num_blocks,
+        .num_pairs = writer->num_pairs,
+        .crc = 0,
+        .unused = 0,
+    };
+    memcpy(footer.magic, SNAPSHOT_MAGIC, 8);
+
+    char header[SNAPSHOT_HEADER];
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    memcpy(header + 8, &writer->log_offset, sizeof(writer->log_offset));
+    uint32_t crc = crc32c(0, header, sizeof(header));
+    crc = crc32c(crc, writer->blocks, writer->num_blocks * sizeof(SnapshotBlock));
+    footer.crc = crc32c(crc, &footer, SNAPSHOT_FOOTER_CHECKED);
+
+    return write_bytes(writer, writer->blocks, writer->num_blocks * sizeof(SnapshotBlock)) != 0 ||
+           write_bytes(writer, &footer, sizeof(footer)) != 0;
+}
+
+// Reads the log offset in the header of a snapshot.
+// @return 0 on success, 1 if there is no snapshot at the path or its header
+// cannot be read.
+static int read_log_offset(const char *path, uint64_t *log_offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    char header[SNAPSHOT_HEADER];
+    int intr = 0;
+    int result = read_all(fd, header, sizeof(header), &intr) != 1 || memcmp(header, SNAPSHOT_MAGIC, 8) != 0;
+    close(fd);
+    if (result == 0) {
+        memcpy(log_offset, header + 8, sizeof(*log_offset));
+    }
+    return result;
+}
+
+int snapshot_end(SnapshotWriter *writer, int failed) {
+    if (!failed) {
+        failed = flush_block(writer) != 0 || write_index(writer) != 0 || fsync(writer->fd) != 0;
+    }
+    free(writer->blocks);
+    writer->blocks = NULL;
+    if (close(writer->fd) != 0) {
+        failed = 1;
+    }
+
+    int superseded = 0;
+    if (!failed) {
+        pthread_mutex_lock(&install_mutex);
+        uint64_t installed;
+        if (writer->if_newer && read_log_offset(writer->path, &installed) == 0 && installed > writer->log_offset) {
+            // a backup that started later finished first
+            superseded = 1;
+        } else if (rename(writer->temp_path, writer->path) != 0) {
+            failed = 1;
+        }
+        pthread_mutex_unlock(&install_mutex);
+        // the log may only be compacted once the rename survives a crash
+        if (!failed && !superseded && sync_directory(writer->path) != 0) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to write the snapshot %s\n", writer->path);
+    }
+    if (failed || superseded) {
+        unlink(writer->temp_path);
+    }
+    return failed;
+}
+
+// Checks that the pairs of a block fill it exactly.
+static int check_pairs(const char *data, uint64_t length, uint32_t pairs) {
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < pairs; i++) {
+        uint64_t key_len, value_len, deadline;
+        if (get_varint(data, length, &offset, &key_len) != 0 || get_varint(data, length, &offset, &value_len) != 0 ||
+            get_varint(data, length, &offset, &deadline) != 0 || key_len > length - offset ||
+            value_len > length - offset - key_len) {
+            return 1;
+        }
+        offset += key_len + value_len;
+    }
+    return offset != length;
+}
+
+// Checks the header, the index, and every block against its checksum.
+// @param footer Set to the footer of the snapshot.
+// @return 0 if the snapshot is intact, 1 otherwise.
+static int check_snapshot(const char *map, size_t size, SnapshotFooter *footer) {
+    if (size < SNAPSHOT_HEADER + sizeof(SnapshotFooter) || memcmp(map, SNAPSHOT_MAGIC, 8) != 0) {
+        return 1;
+    }
+    memcpy(footer, map + size - sizeof(SnapshotFooter), sizeof(SnapshotFooter));
+    size_t index_end = size - sizeof(SnapshotFooter);
+    if (memcmp(footer->magic, SNAPSHOT_MAGIC, 8) != 0 || footer->index_offset < SNAPSHOT_HEADER ||
+        footer->index_offset > index_end ||
+        footer->num_blocks != (index_end - footer->index_offset) / sizeof(SnapshotBlock) ||
+        (index_end - footer->index_offset) % sizeof(SnapshotBlock) != 0) {
+        return 1;
+    }
+    const char *index = map + footer->index_offset;
+    uint32_t crc = crc32c(0, map, SNAPSHOT_HEADER);
+    crc = crc32c(crc, index, index_end - footer->index_offset);
+    if (crc32c(crc, footer, SNAPSHOT_FOOTER_CHECKED) != footer->crc) {
+        return 1;
+    }
+
+    // the blocks follow each other from the header to the index
+    uint64_t expected = SNAPSHOT_HEADER;
+    uint64_t num_pairs = 0;
+    for (uint64_t i = 0; i < footer->num_blocks; i++) {
+        SnapshotBlock block;
+        memcpy(&block, index + i * sizeof(SnapshotBlock), sizeof(block));
+        if (block.offset != expected || block.length > footer->index_offset - block.offset ||
+            crc32c(0, map + block.offset, block.length) != block.crc ||
+            check_pairs(map + block.offset, block.length, block.pairs) != 0) {
+            return 1;
+        }
+        expected += block.length;
+        num_pairs += block.pairs;
+    }
+    return expected != footer->index_offset || num_pairs != footer->num_pairs;
+}
+
+int snapshot_load(const char *path, uint64_t *log_offset, snapshot_visit_fn visit, void *arg) {
+    SnapshotMap map;
+    int result = snapshot_map(path, &map, log_offset, visit, arg);
+    snapshot_unmap(&map);
+    return result;
+}
+
+int snapshot_map(const char *path, SnapshotMap *mapping, uint64_t *log_offset, snapshot_visit_fn visit, void *arg) {
+    mapping->data = NULL;
+    mapping->size = 0;
+    *log_offset = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        fprintf(stderr, "The snapshot %s is damaged\n", path);
+        return 1;
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    // nothing is handed over before the whole snapshot is checked
+    SnapshotFooter footer;
+    if (check_snapshot(map, size, &footer) != 0) {
+        fprintf(stderr, "The snapshot %s is damaged\n", path);
+        munmap(map, size);
+        return 1;
+    }
+
+    memcpy(log_offset, map + 8, sizeof(*log_offset));
+    mapping->data = map;
+    mapping->size = size;
+    uint64_t offset = SNAPSHOT_HEADER;
+    for (uint64_t i = 0; i < footer.num_pairs; i++) {
+        uint64_t key_len, value_len, deadline;
+        get_varint(map, footer.index_offset, &offset, &key_len);
+        get_varint(map, footer.index_offset, &offset, &value_len);
+        get_varint(map, footer.index_offset, &offset, &deadline);
+        const char *key = map + offset;
+        offset += key_len;
+        visit(key, key_len, map + offset, value_len, deadline, arg);
+        offset += value_len;
+    }
+    return 0;
+}
+
+void snapshot_unmap(SnapshotMap *map) {
+    if (map->data != NULL) {
+        munmap(map->data, map->size);
+        map->data = NULL;
+        map->size = 0;
+    }
+}
@@ -0,0 +1,149 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SNAPSHOT_MAGIC "KVSSNAP2"  // first and last bytes of a snapshot
+#define SNAPSHOT_BLOCK (1 << 16)   // bytes of pairs a block holds, unless a single pair is larger
+
+// Binary snapshot of the store. Full backups write one next to the
+// write-ahead log, so that a restart does not have to replay the log from its
+// start, and, in the binary backup format, one per backup of a job. The file
+// is laid out as
+//
+//     header | block | block | ... | index | footer
+//
+// in the byte order of the host. The header is the magic and the log offset
+// (8 each). A block holds the pairs the backup met while walking the buckets
+// of the table, each as its key length, its value length and its deadline, as
+// varints of 7 bits per byte with the lowest bits first, followed by the key
+// and the value; short pairs without a TTL thus take three bytes more than
+// their strings. The deadline is the one the write gave the pair, the wall
+// clock time in milliseconds since the Epoch its TTL runs out at, or 0. The
+// index has an entry per block with its offset (8), its length (8), its
+// number of pairs (4) and the crc32c of its bytes (4). The footer
+// gives the offset of the index (8), the number of blocks (8) and of pairs
+// (8), the crc32c of the header, the index and the footer before it (4), 4
+// unused bytes and the magic again.
+//
+// A loader maps the file, finds the index through the footer and checks each
+// block against its checksum, without parsing anything it does not trust. The
+// log offset is the length of the log that was on disk when the snapshot was
+// taken; every change the log held up to there is in the snapshot, and some
+// after it may be too, which is harmless since replaying a record again gives
+// the same result.
+//
+// A snapshot is written to a temporary file of its own, with a unique name,
+// that replaces the previous one only once it is complete and synced.
+
+typedef struct SnapshotBlock {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t pairs;
+    uint32_t crc;
+} SnapshotBlock;
+
+typedef struct SnapshotFooter {
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    uint64_t num_pairs;
+    uint32_t crc;
+    uint32_t unused;
+    char magic[8];
+} SnapshotFooter;
+
+typedef struct SnapshotWriter {
+    int fd;
+    char temp_path[FILENAME_MAX];
+    char path[FILENAME_MAX];
+    uint64_t log_offset;
+    int if_newer;                        // whether a snapshot in place that covers more of the log is kept
+    uint64_t offset;                     // bytes written to the file
+    uint64_t num_pairs;
+    SnapshotBlock *blocks;               // index of the blocks written
+    size_t num_blocks;
+    size_t blocks_capacity;
+    uint32_t pairs;                      // pairs of the block being filled
+    size_t len;                          // bytes of the block being filled
+    char data[SNAPSHOT_BLOCK];
+} SnapshotWriter;
+
+// Snapshot mapped into memory by snapshot_map.
+typedef struct SnapshotMap {
+    char *data;                          // NULL if no snapshot was mapped
+    size_t size;
+} SnapshotMap;
+
+/// Function called for every pair of a snapshot being loaded.
+/// @param key Key, not null terminated.
+/// @param key_len Length of the key.
+/// @param value Value, not null terminated.
+/// @param value_len Length of the value.
+/// @param deadline Time the pair expires at, 0 if it does not.
+/// @param arg Argument given to snapshot_load.
+typedef void (*snapshot_visit_fn)(const char *key, size_t key_len, const char *value, size_t value_len,
+                                  uint64_t deadline, void *arg);
+
+/// Starts writing a snapshot.
+/// @param writer Writer to be set up.
+/// @param path Path the snapshot will have once it is complete.
+/// @param log_offset Length of the log the snapshot covers.
+/// @param if_newer 1 to only replace a snapshot at path that covers less of
+/// the log, so that backups finishing out of order leave the newest one.
+/// @return 0 on success, 1 otherwise.
+int snapshot_begin(SnapshotWriter *writer, const char *path, uint64_t log_offset, int if_newer);
+
+/// Adds a pair to a snapshot.
+/// @param writer Writer of the snapshot.
+/// @param key Null terminated key.
+/// @param value Value of the key.
+/// @param value_len Length of the value.
+/// @param deadline Time the pair expires at, in milliseconds since the Epoch,
+/// 0 if it does not.
+/// @return 0 on success, 1 otherwise.
+int snapshot_add(SnapshotWriter *writer, const char *key, const char *value, size_t value_len, uint64_t deadline);
+
+/// Completes a snapshot, syncs it and puts it in place of the previous one.
+/// On failure the previous snapshot is kept, and so it is when the writer was
+/// started with if_newer and the previous snapshot covers more of the log.
+/// @param writer Writer of the snapshot.
+/// @param failed Whether adding the pairs failed, in which case the snapshot
+/// is only discarded.
+/// @return 0 on success, including when the snapshot was dropped for a newer
+/// one, 1 otherwise; also when the snapshot was put in place but its
+/// directory could not be synced, so a crash may still bring back the
+/// previous one.
+int snapshot_end(SnapshotWriter *writer, int failed);
+
+/// Loads a snapshot, handing its pairs to a function in the order they were
+/// added. Nothing is handed over unless the whole snapshot is intact.
+/// @param path Path of the snapshot.
+/// @param log_offset Set to the length of the log the snapshot covers, 0 if
+/// there is no snapshot.
+/// @param visit Function called for every pair.
+/// @param arg Argument passed to visit.
+/// @return 0 if the snapshot was loaded or does not exist, 1 if it is damaged
+/// or could not be read.
+int snapshot_load(const char *path, uint64_t *log_offset, snapshot_visit_fn visit, void *arg);
+
+/// Loads a snapshot like snapshot_load, but keeps it mapped, so that the keys
+/// and values handed to visit stay readable until snapshot_unmap. The
+/// mapping is set before the first pair is handed over.
+/// @param path Path of the snapshot.
+/// @param mapping Set to the mapping, with no data if there is no snapshot or
+/// it could not be loaded.
+/// @param log_offset Set to the length of the log the snapshot covers, 0 if
+/// there is no snapshot.
+/// @param visit Function called for every pair.
+/// @param arg Argument passed to visit.
+/// @return 0 if the snapshot was loaded or does not exist, 1 if it is damaged
+/// or could not be read.
+int snapshot_map(const char *path, SnapshotMap *mapping, uint64_t *log_offset, snapshot_visit_fn visit, void *arg);
+
+/// Releases a mapping made by snapshot_map. Does nothing if it has no data.
+/// @param map Mapping to be released.
+void snapshot_unmap(SnapshotMap *map);
+
+#endif  // KVS_SNAPSHOT_H
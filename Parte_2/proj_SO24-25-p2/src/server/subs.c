@@ -0,0 +1,152 @@
+#include "subs.h"
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+
+static inline SubscriptionBucket *bucket_of(SubscriptionIndex *index, uint64_t h) {
+    return &index->buckets[(h >> 40) & (SUBS_BUCKETS - 1)];
+}
+
+// Finds the set of a key. Must be called with the bucket locked.
+// @param prev If not NULL, set to the link that points to the set.
+static Subscription *find_set(SubscriptionBucket *bucket, const char *key, uint64_t h,
+                              _Atomic(Subscription *) **prev) {
+    _Atomic(Subscription *) *link = &bucket->head;
+    Subscription *sub = atomic_load_explicit(link, memory_order_relaxed);
+    while (sub != NULL && (sub->hash != h || strcmp(sub->key, key) != 0)) {
+        link = &sub->next;
+        sub = atomic_load_explicit(link, memory_order_relaxed);
+    }
+    if (prev != NULL) {
+        *prev = link;
+    }
+    return sub;
+}
+
+static void free_set(Subscription *sub) {
+    free(sub->fds);
+    free(sub);
+}
+
+SubscriptionIndex *subs_create() {
+    SubscriptionIndex *index = malloc(sizeof(SubscriptionIndex));
+    if (!index) return NULL;
+    for (size_t i = 0; i < SUBS_BUCKETS; i++) {
+        pthread_mutex_init(&index->buckets[i].mutex, NULL);
+        atomic_init(&index->buckets[i].head, NULL);
+    }
+    return index;
+}
+
+int subs_add(SubscriptionIndex *index, const char *key, uint64_t h, int fd) {
+    SubscriptionBucket *bucket = bucket_of(index, h);
+
+    pthread_mutex_lock(&bucket->mutex);
+    Subscription *sub = find_set(bucket, key, h, NULL);
+    if (sub == NULL) {
+        sub = malloc(sizeof(Subscription));
+        int *fds = malloc(SUBS_MIN_FDS * sizeof(int));
+        if (!sub || !fds) {
+            free(sub);
+            free(fds);
+            pthread_mutex_unlock(&bucket->mutex);
+            return 1;
+        }
+        sub->hash = h;
+        strncpy(sub->key, key, MAX_STRING_SIZE - 1);
+        sub->key[MAX_STRING_SIZE - 1] = '\0';
+        sub->count = 0;
+        sub->capacity = SUBS_MIN_FDS;
+        sub->fds = fds;
+        atomic_init(&sub->next, atomic_load_explicit(&bucket->head, memory_order_relaxed));
+        atomic_store_explicit(&bucket->head, sub, memory_order_relaxed);
+    }
+
+    size_t i = 0;
+    while (i < sub->count && sub->fds[i] != fd) {
+        i++;
+    }
+    if (i == sub->count) {
+        if (sub->count == sub->capacity) {
+            int *fds = realloc(sub->fds, 2 * sub->capacity * sizeof(int));
+            if (!fds) {
+                pthread_mutex_unlock(&bucket->mutex);
+                return 1;
+            }
+            sub->fds = fds;
+            sub->capacity *= 2;
+        }
+        sub->fds[sub->count++] = fd;
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+    return 0;
+}
+
+int subs_remove(SubscriptionIndex *index, const char *key, uint64_t h, int fd) {
+    SubscriptionBucket *bucket = bucket_of(index, h);
+    _Atomic(Subscription *) *prev;
+
+    pthread_mutex_lock(&bucket->mutex);
+    Subscription *sub = find_set(bucket, key, h, &prev);
+    size_t i = 0;
+    while (sub != NULL && i < sub->count && sub->fds[i] != fd) {
+        i++;
+    }
+    if (sub == NULL || i == sub->count) {
+        pthread_mutex_unlock(&bucket->mutex);
+        return 1;
+    }
+
+    // the order of the subscribers does not matter
+    sub->fds[i] = sub->fds[--sub->count];
+    if (sub->count == 0) {
+        atomic_store_explicit(prev, atomic_load_explicit(&sub->next, memory_order_relaxed), memory_order_relaxed);
+        free_set(sub);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+    return 0;
+}
+
+void subs_notify(SubscriptionIndex *index, const char *key, uint64_t h, const char *value) {
+    SubscriptionBucket *bucket = bucket_of(index, h);
+    if (atomic_load_explicit(&bucket->head, memory_order_relaxed) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&bucket->mutex);
+    Subscription *sub = find_set(bucket, key, h, NULL);
+    if (sub != NULL) {
+        notify_send(sub->fds, sub->count, sub->key, h, value);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+void subs_drop(SubscriptionIndex *index, const char *key, uint64_t h, const char *notice) {
+    SubscriptionBucket *bucket = bucket_of(index, h);
+    _Atomic(Subscription *) *prev;
+    if (atomic_load_explicit(&bucket->head, memory_order_relaxed) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&bucket->mutex);
+    Subscription *sub = find_set(bucket, key, h, &prev);
+    if (sub != NULL) {
+        notify_send(sub->fds, sub->count, sub->key, h, notice);
+        atomic_store_explicit(prev, atomic_load_explicit(&sub->next, memory_order_relaxed), memory_order_relaxed);
+        free_set(sub);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+void subs_free(SubscriptionIndex *index) {
+    for (size_t i = 0; i < SUBS_BUCKETS; i++) {
+        Subscription *sub = atomic_load(&index->buckets[i].head);
+        while (sub != NULL) {
+            Subscription *next = atomic_load(&sub->next);
+            free_set(sub);
+            sub = next;
+        }
+        pthread_mutex_destroy(&index->buckets[i].mutex);
+    }
+    free(index);
+}
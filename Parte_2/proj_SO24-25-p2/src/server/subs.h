@@ -0,0 +1,80 @@
+#ifndef KVS_SUBS_H
+#define KVS_SUBS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+
+#define SUBS_BUCKETS 256  // buckets of a subscription index (power of two)
+#define SUBS_MIN_FDS 4    // subscribers a new set has room for
+
+// Subscribers of one key: the notification pipes of the clients, in a vector
+// that doubles when it fills up.
+typedef struct Subscription {
+    _Atomic(struct Subscription *) next;
+    uint64_t hash;                       // hash of the key
+    char key[MAX_STRING_SIZE];
+    size_t count;
+    size_t capacity;
+    int *fds;
+} Subscription;
+
+typedef struct SubscriptionBucket {
+    pthread_mutex_t mutex;               // guards the chain and the sets in it
+    _Atomic(Subscription *) head;
+} SubscriptionBucket;
+
+// Subscriptions of a table, kept apart from its nodes: only the keys that
+// have subscribers take memory here, and a key can have any number of them.
+// Writes and deletes of keys nobody subscribed to only check that their
+// bucket is empty, without taking its lock.
+//
+// The callers hold the stripe lock of the key, in read mode to subscribe and
+// unsubscribe and in write mode to change or remove it, so the set of a key
+// cannot change while its subscribers are notified.
+typedef struct SubscriptionIndex {
+    SubscriptionBucket buckets[SUBS_BUCKETS];
+} SubscriptionIndex;
+
+/// Creates an empty index.
+/// @return Newly created index, NULL on failure.
+SubscriptionIndex *subs_create();
+
+/// Subscribes a client to a key; subscribing twice has no effect.
+/// @param index Index to be modified.
+/// @param key Key to be subscribed to.
+/// @param h Hash of the key.
+/// @param fd Notification pipe of the client.
+/// @return 0 if the client is subscribed, 1 on failure.
+int subs_add(SubscriptionIndex *index, const char *key, uint64_t h, int fd);
+
+/// Unsubscribes a client from a key.
+/// @param index Index to be modified.
+/// @param key Key to be unsubscribed from.
+/// @param h Hash of the key.
+/// @param fd Notification pipe of the client.
+/// @return 0 if the client was subscribed, 1 otherwise.
+int subs_remove(SubscriptionIndex *index, const char *key, uint64_t h, int fd);
+
+/// Queues a notification for the subscribers of a key.
+/// @param index Index of the key's table.
+/// @param key Key that changed.
+/// @param h Hash of the key.
+/// @param value New value of the key, or the reason it was removed.
+void subs_notify(SubscriptionIndex *index, const char *key, uint64_t h, const char *value);
+
+/// Queues a notification for the subscribers of a removed key and forgets them, so that they
+/// are not notified if the key is written again.
+/// @param index Index of the key's table.
+/// @param key Key that was removed.
+/// @param h Hash of the key.
+/// @param notice Value sent to the subscribers.
+void subs_drop(SubscriptionIndex *index, const char *key, uint64_t h, const char *notice);
+
+/// Frees an index and its sets.
+/// @param index Index to be freed.
+void subs_free(SubscriptionIndex *index);
+
+#endif  // KVS_SUBS_H
@@ -0,0 +1,191 @@
+#include "swiss.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+_Static_assert(sizeof(SwissSlot) == 64, "a slot should fill one cache line");
+
+// The top 7 bits of the hash go to the control bytes; the low bits already
+// pick the stripe of the key, so the group is taken from the bits above them.
+static inline uint8_t hash_tag(uint64_t h) {
+    return (uint8_t) (h >> 57);
+}
+
+static inline size_t first_group(SwissTable *table, uint64_t h) {
+    return (size_t) (h >> 16) & (table->num_slots / SWISS_GROUP - 1);
+}
+
+#define GROUP_WORDS (SWISS_GROUP / 8)
+
+// Loads the control bytes of a group. The words are read separately, which
+// is enough: a key is only ever in one slot, and it is published after the
+// overflow counts of the groups its probe went past.
+static inline void load_group(SwissTable *table, size_t group, uint64_t words[GROUP_WORDS]) {
+    for (size_t i = 0; i < GROUP_WORDS; i++) {
+        words[i] = atomic_load_explicit(&table->ctrl[group * GROUP_WORDS + i], memory_order_acquire);
+    }
+}
+
+// Gets a bitmask of the slots of a group whose control byte is a given one.
+static inline unsigned match_group(const uint64_t words[GROUP_WORDS], uint8_t byte) {
+#if defined(__AVX2__)
+    __m256i ctrl = _mm256_set_epi64x((long long) words[3], (long long) words[2], (long long) words[1],
+                                     (long long) words[0]);
+    return (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char) byte)));
+#elif defined(__SSE2__)
+    __m128i ctrl = _mm_set_epi64x((long long) words[1], (long long) words[0]);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte)));
+#else
+    unsigned mask = 0;
+    for (unsigned i = 0; i < SWISS_GROUP; i++) {
+        if ((uint8_t) (words[i / 8] >> (i % 8 * 8)) == byte) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+// Replaces the control byte of a slot if it still holds an expected one.
+static int swap_ctrl(SwissTable *table, size_t index, uint8_t expected, uint8_t byte, memory_order order) {
+    _Atomic uint64_t *word = &table->ctrl[index / 8];
+    unsigned shift = (unsigned) (index % 8) * 8;
+    uint64_t old = atomic_load_explicit(word, memory_order_relaxed);
+
+    while ((uint8_t) (old >> shift) == expected) {
+        uint64_t replaced = (old & ~(0xFFULL << shift)) | ((uint64_t) byte << shift);
+        if (atomic_compare_exchange_weak_explicit(word, &old, replaced, order, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+SwissTable *swiss_create(size_t num_slots) {
+    size_t slots_size = sizeof(SwissTable) + num_slots * sizeof(SwissSlot);
+    size_t num_groups = num_slots / SWISS_GROUP;
+    size_t size = slots_size + num_slots + num_groups * sizeof(atomic_uint);
+    // slots on cache line boundaries, followed by the control bytes and the
+    // overflow counts
+    SwissTable *table = aligned_alloc(64, (size + 63) / 64 * 64);
+    if (!table) return NULL;
+    table->num_slots = num_slots;
+    atomic_init(&table->used, 0);
+    table->ctrl = (_Atomic uint64_t *) ((char *) table + slots_size);
+    for (size_t i = 0; i < num_slots / 8; i++) {
+        atomic_init(&table->ctrl[i], 0x8080808080808080ULL);
+    }
+    table->overflow = (atomic_uint *) ((char *) table + slots_size + num_slots);
+    for (size_t i = 0; i < num_groups; i++) {
+        atomic_init(&table->overflow[i], 0);
+    }
+    return table;
+}
+
+SwissSlot *swiss_find(SwissTable *table, const char *key, uint64_t h) {
+    size_t mask = table->num_slots / SWISS_GROUP - 1;
+    size_t group = first_group(table, h);
+    uint8_t tag = hash_tag(h);
+
+    for (size_t probe = 1; probe <= mask + 1; probe++) {
+        uint64_t words[GROUP_WORDS];
+        load_group(table, group, words);
+        for (unsigned match = match_group(words, tag); match != 0; match &= match - 1) {
+            SwissSlot *slot = &table->slots[group * SWISS_GROUP + (size_t) __builtin_ctz(match)];
+            if (slot->hash == (uint32_t) h && strcmp(slot->key, key) == 0) {
+                return slot;
+            }
+        }
+        if (atomic_load_explicit(&table->overflow[group], memory_order_acquire) == 0) {
+            return NULL;
+        }
+        // triangular probing visits every group of a power of two table
+        group = (group + probe) & mask;
+    }
+    return NULL;
+}
+
+SwissSlot *swiss_insert(SwissTable *table, uint64_t h, KeyNode *node, int referenced) {
+    size_t mask = table->num_slots / SWISS_GROUP - 1;
+    size_t group = first_group(table, h);
+
+    for (size_t probe = 1; probe <= mask + 1; probe++) {
+        uint64_t words[GROUP_WORDS];
+        load_group(table, group, words);
+        // another writer may claim the same empty slot first
+        for (unsigned empty = match_group(words, SWISS_EMPTY); empty != 0; empty &= empty - 1) {
+            size_t index = group * SWISS_GROUP + (size_t) __builtin_ctz(empty);
+            if (!swap_ctrl(table, index, SWISS_EMPTY, SWISS_BUSY, memory_order_relaxed)) {
+                continue;
+            }
+            atomic_fetch_add_explicit(&table->used, 1, memory_order_relaxed);
+            SwissSlot *slot = &table->slots[index];
+            slot->hash = (uint32_t) h;
+            atomic_init(&slot->referenced, referenced);
+            atomic_init(&slot->value, atomic_load_explicit(&node->value, memory_order_relaxed));
+            slot->node = node;
+            memcpy(slot->key, node->key, node->key_len + 1);
+            swap_ctrl(table, index, SWISS_BUSY, hash_tag(h), memory_order_release);
+            return slot;
+        }
+        // counted before the key is published, so that its readers go on
+        atomic_fetch_add_explicit(&table->overflow[group], 1, memory_order_release);
+        group = (group + probe) & mask;
+    }
+    // the key was counted in every group, none of which it is stored past
+    group = first_group(table, h);
+    for (size_t probe = 1; probe <= mask + 1; probe++) {
+        atomic_fetch_sub_explicit(&table->overflow[group], 1, memory_order_relaxed);
+        group = (group + probe) & mask;
+    }
+    return NULL;
+}
+
+void swiss_erase(SwissTable *table, SwissSlot *slot) {
+    size_t index = (size_t) (slot - table->slots);
+    uint64_t h = slot->node->hash;
+    swap_ctrl(table, index, hash_tag(h), SWISS_DELETED, memory_order_release);
+
+    // the groups the probe of the key went past no longer count it
+    size_t mask = table->num_slots / SWISS_GROUP - 1;
+    size_t group = first_group(table, h);
+    for (size_t probe = 1; group != index / SWISS_GROUP; probe++) {
+        atomic_fetch_sub_explicit(&table->overflow[group], 1, memory_order_relaxed);
+        group = (group + probe) & mask;
+    }
+}
+
+void swiss_retire_deleted(SwissTable *table) {
+    for (size_t i = 0; i < table->num_slots; i++) {
+        swap_ctrl(table, i, SWISS_DELETED, SWISS_RETIRED, memory_order_relaxed);
+    }
+}
+
+void swiss_free_retired(SwissTable *table) {
+    size_t freed = 0;
+    for (size_t i = 0; i < table->num_slots; i++) {
+        freed += (size_t) swap_ctrl(table, i, SWISS_RETIRED, SWISS_EMPTY, memory_order_relaxed);
+    }
+    atomic_fetch_sub(&table->used, freed);
+}
+
+SwissSlot *swiss_slot(SwissTable *table, size_t index) {
+    uint64_t word = atomic_load_explicit(&table->ctrl[index / 8], memory_order_acquire);
+    // hash tags are the control bytes with the top bit clear
+    if ((uint8_t) (word >> (index % 8 * 8)) & 0x80) {
+        return NULL;
+    }
+    return &table->slots[index];
+}
+
+int swiss_overloaded(SwissTable *table, size_t extra) {
+    return (atomic_load(&table->used) + extra) * 8 > table->num_slots * SWISS_MAX_LOAD;
+}
+
+void swiss_prefetch(SwissTable *table, uint64_t h) {
+    __builtin_prefetch(&table->ctrl[first_group(table, h) * GROUP_WORDS]);
+}
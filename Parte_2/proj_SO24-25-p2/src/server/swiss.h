@@ -0,0 +1,111 @@
+#ifndef KVS_SWISS_H
+#define KVS_SWISS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "kvs.h"
+
+#ifdef __AVX2__
+#define SWISS_GROUP 32         // slots probed at once, one AVX2 register of control bytes
+#else
+#define SWISS_GROUP 16         // slots probed at once, one SSE2 register of control bytes
+#endif
+#define SWISS_MIN_SLOTS 64     // slots of a new table (power of two)
+#define SWISS_MAX_LOAD 7       // eighths of the slots that may be claimed before the table grows
+
+#define SWISS_EMPTY 0x80       // control byte of a slot never claimed
+#define SWISS_DELETED 0xFE     // control byte of a slot whose key was removed
+#define SWISS_RETIRED 0xFD     // control byte of a deleted slot waiting for its readers to leave
+#define SWISS_BUSY 0xFF        // control byte of a slot being filled by a writer
+
+// Slot of the open addressing table, one cache line. The key is stored
+// inline next to the value and the CLOCK mark, so that a read that finds its
+// key never touches the node, which is only needed by writers.
+typedef struct SwissSlot {
+    uint32_t hash;                       // low half of the hash of the key
+    atomic_int referenced;               // set by accesses, cleared by the eviction hand
+    _Atomic(Value *) value;              // same value as node->value
+    KeyNode *node;
+    char key[MAX_STRING_SIZE];
+} SwissSlot;
+
+// Swiss table: every slot has a control byte, holding either one of the
+// states above or 7 bits of the hash of its key, and lookups compare the
+// control bytes of a whole group of slots against those bits with one
+// vector instruction, only looking at the slots that match. Groups are
+// probed in triangular order. Every group counts the stored keys whose
+// probe went past it because it was full, and a lookup stops at the first
+// group with no such key, so deleted slots never make probes longer.
+//
+// Readers take no lock. A writer claims an empty slot by swapping its
+// control byte to SWISS_BUSY, fills it and then publishes the hash bits with
+// release semantics; the control bytes are kept in 64 bit words so that all
+// of these are plain atomic operations. Removed slots become SWISS_DELETED,
+// as readers may still be reading them. A cleanup marks them SWISS_RETIRED
+// and makes them empty again once every reader that could have found them
+// is gone.
+typedef struct SwissTable {
+    size_t num_slots;                    // power of two, multiple of SWISS_GROUP
+    atomic_size_t used;                  // slots claimed, including the deleted ones
+    _Atomic uint64_t *ctrl;              // control bytes, eight per word
+    atomic_uint *overflow;               // keys stored past each group
+    _Alignas(64) SwissSlot slots[];
+} SwissTable;
+
+/// Creates an empty table.
+/// @param num_slots Number of slots, a power of two multiple of SWISS_GROUP.
+/// @return Newly created table, NULL on failure.
+SwissTable *swiss_create(size_t num_slots);
+
+/// Looks for a key. Takes no lock.
+/// @param table Table to search.
+/// @param key Key to look for.
+/// @param h Hash of the key.
+/// @return Slot of the key, NULL if it is not in the table.
+SwissSlot *swiss_find(SwissTable *table, const char *key, uint64_t h);
+
+/// Stores a key that is not in the table in an empty slot. Writers of
+/// different keys may insert at the same time.
+/// @param table Table to be modified.
+/// @param h Hash of the key.
+/// @param node Node of the key, whose key is copied into the slot.
+/// @param referenced Initial CLOCK mark of the slot.
+/// @return Slot of the key, NULL if the table has no empty slot left.
+SwissSlot *swiss_insert(SwissTable *table, uint64_t h, KeyNode *node, int referenced);
+
+/// Marks the slot of a removed key as deleted. Readers that already found
+/// the slot may still read it.
+/// @param table Table the slot belongs to.
+/// @param slot Slot to be released.
+void swiss_erase(SwissTable *table, SwissSlot *slot);
+
+/// Marks the deleted slots as retired, the first step of a cleanup. Only one
+/// cleanup may run at a time.
+/// @param table Table to be cleaned.
+void swiss_retire_deleted(SwissTable *table);
+
+/// Makes the retired slots empty, the last step of a cleanup. Must be called
+/// once no reader that started before swiss_retire_deleted can still run.
+/// @param table Table being cleaned.
+void swiss_free_retired(SwissTable *table);
+
+/// Gets a slot that holds a key.
+/// @param table Table to look at.
+/// @param index Index of the slot.
+/// @return The slot, NULL if it is empty, deleted or being filled.
+SwissSlot *swiss_slot(SwissTable *table, size_t index);
+
+/// Checks whether the table must grow before taking more keys.
+/// @param table Table to check.
+/// @param extra Keys about to be inserted.
+/// @return 1 if the claimed slots would go past SWISS_MAX_LOAD eighths, 0 otherwise.
+int swiss_overloaded(SwissTable *table, size_t extra);
+
+/// Starts loading the control bytes a lookup of a key probes first. Must be
+/// called inside an epoch.
+/// @param table Table the key belongs to.
+/// @param h Hash of the key.
+void swiss_prefetch(SwissTable *table, uint64_t h);
+
+#endif  // KVS_SWISS_H
@@ -0,0 +1,616 @@
+#include "wal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "crc32c.h"
+#include "../common/io.h"
+
+typedef struct WalBuffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+} WalBuffer;
+
+// While the log writer writes one buffer, records are appended to the other.
+static WalBuffer buffers[2];
+static WalBuffer *filling = &buffers[0];
+static uint64_t appended = 0;  // offset in the log after the last record appended
+static uint64_t synced = 0;    // offset in the log up to which it is on disk
+static uint64_t requested = 0; // offset in the log a command waits to see synced
+static int failed = 0;         // a write or sync of the log failed
+static int stopping = 0;
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;    // records to write, or stopping
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;  // synced moved on
+
+static int wal_fd = -1;                // open segment, written by the log writer only
+static char log_path[FILENAME_MAX];
+static uint64_t segment_base = 0;      // offset of the first record of the open segment
+static uint64_t *retired = NULL;       // offsets of the first records of the retired segments, in order
+static size_t num_retired = 0;
+static pthread_mutex_t segments_mutex = PTHREAD_MUTEX_INITIALIZER;  // guards the three above
+static atomic_int logging = 0;
+static pthread_t writer_thread;
+static atomic_size_t records = 0;
+static atomic_size_t commits = 0;
+
+// Gets the path of the retired segment whose first record is at an offset.
+// @return 0 on success, 1 if the path does not fit.
+static int segment_path(const char *path, uint64_t base, char *segment, size_t size) {
+    return (size_t) snprintf(segment, size, "%s.%016" PRIx64, path, base) >= size;
+}
+
+// Gets the directory a file is in.
+// @return Name of the file within the directory.
+static const char *directory_of(const char *path, char *dir, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        snprintf(dir, size, ".");
+        return path;
+    }
+    snprintf(dir, size, "%.*s", slash == path ? 1 : (int) (slash - path), path);
+    return slash + 1;
+}
+
+int sync_directory(const char *path) {
+    char dir[FILENAME_MAX];
+    directory_of(path, dir, sizeof(dir));
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    int result = fd < 0 || fsync(fd) != 0;
+    if (result != 0) {
+        perror(dir);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return result;
+}
+
+static int compare_bases(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Finds the retired segments of a log: the files next to it named after the
+// log and 16 hexadecimal digits.
+// @param bases Set to the offsets of their first records, in increasing
+// order, to be freed by the caller.
+// @param count Set to the number of segments.
+// @return 0 on success, 1 if the directory could not be read.
+static int find_segments(const char *path, uint64_t **bases, size_t *count) {
+    char dir[FILENAME_MAX];
+    const char *name = directory_of(path, dir, sizeof(dir));
+    size_t name_len = strlen(name);
+
+    *bases = NULL;
+    *count = 0;
+    DIR *stream = opendir(dir);
+    if (stream == NULL) {
+        perror(dir);
+        return 1;
+    }
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        const char *suffix = entry->d_name + name_len + 1;
+        if (strncmp(entry->d_name, name, name_len) != 0 || entry->d_name[name_len] != '.' ||
+            strlen(suffix) != 16 || strspn(suffix, "0123456789abcdef") != 16) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            uint64_t *grown = realloc(*bases, capacity * sizeof(uint64_t));
+            if (!grown) {
+                free(*bases);
+                closedir(stream);
+                return 1;
+            }
+            *bases = grown;
+        }
+        (*bases)[(*count)++] = strtoull(suffix, NULL, 16);
+    }
+    closedir(stream);
+    qsort(*bases, *count, sizeof(uint64_t), compare_bases);
+    return 0;
+}
+
+// Creates a segment holding only its header and syncs it.
+// @return File descriptor of the segment, -1 on failure.
+static int create_segment(const char *path, uint64_t base) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    char header[WAL_SEGMENT_HEADER];
+    memcpy(header, WAL_MAGIC, 8);
+    memcpy(header + 8, &base, sizeof(base));
+    if (write_all(fd, header, sizeof(header)) != 1 || fdatasync(fd) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads the header of a segment.
+// @param base Set to the offset of its first record.
+// @return 0 on success, 1 if the file is too short to hold a header, -1 if
+// the header is not the one of a segment.
+static int read_segment_header(int fd, uint64_t *base) {
+    char header[WAL_SEGMENT_HEADER];
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    if (got != (ssize_t) sizeof(header)) {
+        return got >= 0 ? 1 : -1;
+    }
+    if (memcmp(header, WAL_MAGIC, 8) != 0) {
+        return -1;
+    }
+    memcpy(base, header + 8, sizeof(*base));
+    return 0;
+}
+
+// Retires the open segment and starts a new one whose first record will be at
+// an offset. The new segment is made in full under a temporary name first.
+// Called by the log writer, between two writes.
+// @return 0 on success or if the open segment was kept, 1 if the log can no
+// longer be written.
+static int rotate_segment(uint64_t base) {
+    char next_path[FILENAME_MAX];
+    char retired_path[FILENAME_MAX];
+    if ((size_t) snprintf(next_path, sizeof(next_path), "%s.next", log_path) >= sizeof(next_path) ||
+        segment_path(log_path, segment_base, retired_path, sizeof(retired_path)) != 0) {
+        return 0;
+    }
+    int fd = create_segment(next_path, base);
+    if (fd < 0) {
+        // the open segment keeps growing
+        return 0;
+    }
+
+    pthread_mutex_lock(&segments_mutex);
+    uint64_t *grown = realloc(retired, (num_retired + 1) * sizeof(uint64_t));
+    if (!grown || rename(log_path, retired_path) != 0) {
+        pthread_mutex_unlock(&segments_mutex);
+        perror("Failed to retire a log segment");
+        if (grown) {
+            retired = grown;
+        }
+        close(fd);
+        unlink(next_path);
+        return 0;
+    }
+    retired = grown;
+    retired[num_retired++] = segment_base;
+    if (rename(next_path, log_path) != 0) {
+        pthread_mutex_unlock(&segments_mutex);
+        perror(log_path);
+        close(fd);
+        return 1;
+    }
+    segment_base = base;
+    pthread_mutex_unlock(&segments_mutex);
+
+    sync_directory(log_path);
+    close(wal_fd);
+    wal_fd = fd;
+    return 0;
+}
+
+// Writes the buffered records, a buffer at a time, until the log is closed.
+static void *run_writer(void *arg) {
+    (void) arg;
+    // the signals of the server are handled by the host thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&wal_mutex);
+    while (1) {
+        // records wait until a command needs them synced, so that a sync
+        // covers whatever every thread appended in the meantime
+        while (!stopping && (filling->len == 0 || (requested <= synced && filling->len < WAL_FLUSH_BYTES))) {
+            pthread_cond_wait(&work_cond, &wal_mutex);
+        }
+        if (filling->len == 0) {
+            break;
+        }
+        WalBuffer *batch = filling;
+        filling = batch == &buffers[0] ? &buffers[1] : &buffers[0];
+        uint64_t end = appended;
+        int write_failed = failed;
+        pthread_mutex_unlock(&wal_mutex);
+
+        if (!write_failed) {
+            if (write_all(wal_fd, batch->data, batch->len) != 1) {
+                perror("Failed to write the log");
+                write_failed = 1;
+            } else if (fdatasync(wal_fd) != 0) {
+                perror("Failed to sync the log");
+                write_failed = 1;
+            }
+            atomic_fetch_add_explicit(&commits, 1, memory_order_relaxed);
+        }
+        batch->len = 0;
+
+        pthread_mutex_lock(&wal_mutex);
+        // the waiters of a failed log are released too, with an error
+        if (write_failed) {
+            failed = 1;
+        }
+        synced = end;
+        pthread_cond_broadcast(&synced_cond);
+
+        // segments are only switched between writes, after the waiters are released
+        if (!failed && end - segment_base >= WAL_SEGMENT_BYTES) {
+            pthread_mutex_unlock(&wal_mutex);
+            int rotate_failed = rotate_segment(end);
+            pthread_mutex_lock(&wal_mutex);
+            if (rotate_failed) {
+                failed = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    return NULL;
+}
+
+// Gets the offset just past the last record of a retired segment.
+// @return 0 on success, 1 if the segment could not be looked at.
+static int retired_end(const char *path, uint64_t base, uint64_t *end) {
+    char segment[FILENAME_MAX];
+    struct stat st;
+    if (segment_path(path, base, segment, sizeof(segment)) != 0 || stat(segment, &st) != 0 ||
+        st.st_size < WAL_SEGMENT_HEADER) {
+        fprintf(stderr, "Failed to read the log segment %s\n", segment);
+        return 1;
+    }
+    *end = base + (uint64_t) st.st_size - WAL_SEGMENT_HEADER;
+    return 0;
+}
+
+int wal_open(const char *path) {
+    if (atomic_load(&logging)) {
+        return 1;
+    }
+
+    uint64_t *bases;
+    size_t count;
+    if (find_segments(path, &bases, &count) != 0) {
+        return 1;
+    }
+    // the open segment carries on from the last retired one
+    uint64_t base = 0;
+    if (count > 0 && retired_end(path, bases[count - 1], &base) != 0) {
+        free(bases);
+        return 1;
+    }
+    int fd = open(path, O_RDWR | O_APPEND);
+    if (fd < 0 && errno != ENOENT) {
+        perror(path);
+        free(bases);
+        return 1;
+    }
+    int header = fd >= 0 ? read_segment_header(fd, &base) : 1;
+    if (header < 0) {
+        fprintf(stderr, "%s is not a log\n", path);
+        close(fd);
+        free(bases);
+        return 1;
+    }
+    if (header > 0) {
+        // no open segment, or one a crash cut short as it was being created
+        if (fd >= 0) {
+            close(fd);
+        }
+        fd = create_segment(path, base);
+        if (fd < 0) {
+            free(bases);
+            return 1;
+        }
+        sync_directory(path);
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        perror(path);
+        close(fd);
+        free(bases);
+        return 1;
+    }
+
+    wal_fd = fd;
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    retired = bases;
+    num_retired = count;
+    segment_base = base;
+    appended = synced = requested = base + (uint64_t) size - WAL_SEGMENT_HEADER;
+    failed = 0;
+    stopping = 0;
+    if (pthread_create(&writer_thread, NULL, run_writer, NULL) != 0) {
+        close(fd);
+        wal_fd = -1;
+        free(retired);
+        retired = NULL;
+        num_retired = 0;
+        return 1;
+    }
+    atomic_store(&logging, 1);
+    return 0;
+}
+
+void wal_close() {
+    if (!atomic_load(&logging)) {
+        return;
+    }
+    atomic_store(&logging, 0);
+
+    pthread_mutex_lock(&wal_mutex);
+    stopping = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&wal_mutex);
+    pthread_join(writer_thread, NULL);
+
+    close(wal_fd);
+    wal_fd = -1;
+    pthread_mutex_lock(&segments_mutex);
+    free(retired);
+    retired = NULL;
+    num_retired = 0;
+    pthread_mutex_unlock(&segments_mutex);
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i].data);
+        buffers[i] = (WalBuffer){NULL, 0, 0};
+    }
+    filling = &buffers[0];
+}
+
+void wal_append(enum WalRecordType type, const char *key, const char *value, uint64_t deadline) {
+    if (!atomic_load_explicit(&logging, memory_order_acquire)) {
+        return;
+    }
+
+    char header[WAL_HEADER_SIZE];
+    uint32_t key_len = (uint32_t) strlen(key);
+    uint32_t value_len = value != NULL ? (uint32_t) strlen(value) : 0;
+    memcpy(header + 4, &key_len, sizeof(key_len));
+    memcpy(header + 8, &value_len, sizeof(value_len));
+    header[12] = (char) type;
+    memcpy(header + 13, &deadline, sizeof(deadline));
+    // the checksum is taken before the record is in the buffer, outside the lock
+    uint32_t crc = crc32c(0, header + 4, WAL_HEADER_SIZE - 4);
+    crc = crc32c(crc, key, key_len);
+    crc = crc32c(crc, value, value_len);
+    memcpy(header, &crc, sizeof(crc));
+    size_t size = WAL_HEADER_SIZE + key_len + value_len;
+
+    pthread_mutex_lock(&wal_mutex);
+    // a log writer that fell this far behind holds back the writers
+    while (filling->len > 0 && filling->len + size > WAL_BUFFER_MAX && !failed) {
+        pthread_cond_wait(&synced_cond, &wal_mutex);
+    }
+    if (filling->len + size > filling->capacity) {
+        size_t capacity = filling->capacity > 0 ? filling->capacity : 4096;
+        while (capacity < filling->len + size) {
+            capacity *= 2;
+        }
+        char *data = realloc(filling->data, capacity);
+        if (!data) {
+            fprintf(stderr, "Failed to buffer a log record\n");
+            failed = 1;
+            pthread_mutex_unlock(&wal_mutex);
+            return;
+        }
+        filling->data = data;
+        filling->capacity = capacity;
+    }
+
+    char *record = filling->data + filling->len;
+    memcpy(record, header, WAL_HEADER_SIZE);
+    memcpy(record + WAL_HEADER_SIZE, key, key_len);
+    if (value_len > 0) {
+        memcpy(record + WAL_HEADER_SIZE + key_len, value, value_len);
+    }
+    filling->len += size;
+    appended += size;
+    if (filling->len >= WAL_FLUSH_BYTES && filling->len - size < WAL_FLUSH_BYTES) {
+        pthread_cond_signal(&work_cond);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    atomic_fetch_add_explicit(&records, 1, memory_order_relaxed);
+}
+
+// Reads the records of a segment from an offset on. The segment is mapped
+// rather than read, so a replay needs no memory for the log.
+// @param fd Segment, open for reading and writing.
+// @param size Size of the file, cut to the end of its last intact record.
+// @param skip Bytes of records before the first one to read.
+// @param last Whether the segment is the open one, the only one a crash can
+// leave torn; the torn tail is cut off the file.
+// @return 0 on success, 1 if the segment could not be read or a retired one
+// is damaged.
+static int replay_segment(int fd, const char *path, size_t *size, size_t skip, int last, wal_visit_fn visit,
+                          void *arg) {
+    char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return 1;
+    }
+    posix_madvise(map, *size, POSIX_MADV_SEQUENTIAL);
+
+    size_t offset = WAL_SEGMENT_HEADER + skip;
+    while (*size - offset >= WAL_HEADER_SIZE) {
+        const char *record = map + offset;
+        uint32_t crc, key_len, value_len;
+        memcpy(&crc, record, sizeof(crc));
+        memcpy(&key_len, record + 4, sizeof(key_len));
+        memcpy(&value_len, record + 8, sizeof(value_len));
+        enum WalRecordType type = (enum WalRecordType) record[12];
+        uint64_t deadline;
+        memcpy(&deadline, record + 13, sizeof(deadline));
+        size_t size_left = *size - offset - WAL_HEADER_SIZE;
+        if ((type != WAL_WRITE && type != WAL_DELETE) || (size_t) key_len + value_len > size_left ||
+            crc32c(0, record + 4, WAL_HEADER_SIZE - 4 + (size_t) key_len + value_len) != crc) {
+            break;
+        }
+        const char *key = record + WAL_HEADER_SIZE;
+        visit(type, key, key_len, key + key_len, value_len, deadline, arg);
+        offset += WAL_HEADER_SIZE + (size_t) key_len + value_len;
+    }
+    munmap(map, *size);
+
+    if (offset < *size) {
+        if (!last) {
+            fprintf(stderr, "The log segment %s is damaged\n", path);
+            return 1;
+        }
+        fprintf(stderr, "Dropping %zu bytes torn off the end of the log\n", *size - offset);
+        if (ftruncate(fd, (off_t) offset) != 0 || fsync(fd) != 0) {
+            perror(path);
+        }
+        *size = offset;
+    }
+    return 0;
+}
+
+int wal_replay(const char *path, uint64_t from, wal_visit_fn visit, void *arg) {
+    uint64_t *bases;
+    size_t count;
+    if (find_segments(path, &bases, &count) != 0) {
+        return 1;
+    }
+
+    int result = 0;
+    int found = 0;
+    uint64_t end = 0;  // offset past the records of the segments read so far
+    // the retired segments in order, then the open one
+    for (size_t i = 0; i <= count && result == 0; i++) {
+        char segment[FILENAME_MAX];
+        if (i < count ? segment_path(path, bases[i], segment, sizeof(segment)) != 0
+                      : (size_t) snprintf(segment, sizeof(segment), "%s", path) >= sizeof(segment)) {
+            result = 1;
+            break;
+        }
+        int fd = open(segment, O_RDWR);
+        if (fd < 0) {
+            // a crash between the renames of a rotation leaves no open segment
+            if (errno != ENOENT || i < count) {
+                perror(segment);
+                result = 1;
+            }
+            break;
+        }
+
+        uint64_t base;
+        struct stat st;
+        int header = read_segment_header(fd, &base);
+        if (header > 0 && i == count) {
+            // the open segment, cut short as it was being created
+            close(fd);
+            break;
+        }
+        if (header != 0 || fstat(fd, &st) != 0 || (i < count && base != bases[i])) {
+            fprintf(stderr, "The log segment %s is damaged\n", segment);
+            result = 1;
+        } else if (found && base != end) {
+            fprintf(stderr, "The log has no records from offset %" PRIu64 " to %" PRIu64 "\n", end, base);
+            result = 1;
+        } else if (!found && base > from) {
+            // the records before were compacted into a snapshot
+            fprintf(stderr, "The log starts at offset %" PRIu64 ", after %" PRIu64 "\n", base, from);
+            result = 1;
+        } else {
+            found = 1;
+            size_t size = (size_t) st.st_size;
+            if (base + size - WAL_SEGMENT_HEADER > from) {
+                result = replay_segment(fd, segment, &size, from > base ? (size_t) (from - base) : 0, i == count,
+                                        visit, arg);
+            }
+            end = base + size - WAL_SEGMENT_HEADER;
+        }
+        close(fd);
+    }
+    free(bases);
+
+    // the log must reach the offset the replay started from
+    if (result == 0 && from > end) {
+        fprintf(stderr, "The log ends at offset %" PRIu64 ", before %" PRIu64 "\n", end, from);
+        result = 1;
+    }
+    return result;
+}
+
+int wal_sync() {
+    if (!atomic_load_explicit(&logging, memory_order_acquire)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t target = appended;
+    if (requested < target) {
+        requested = target;
+        pthread_cond_signal(&work_cond);
+    }
+    while (synced < target) {
+        pthread_cond_wait(&synced_cond, &wal_mutex);
+    }
+    int result = failed;
+    pthread_mutex_unlock(&wal_mutex);
+    return result;
+}
+
+void wal_compact(uint64_t offset) {
+    if (!atomic_load(&logging)) {
+        return;
+    }
+
+    pthread_mutex_lock(&segments_mutex);
+    size_t dropped = 0;
+    while (dropped < num_retired) {
+        uint64_t end = dropped + 1 < num_retired ? retired[dropped + 1] : segment_base;
+        char segment[FILENAME_MAX];
+        if (end > offset || segment_path(log_path, retired[dropped], segment, sizeof(segment)) != 0) {
+            break;
+        }
+        if (unlink(segment) != 0 && errno != ENOENT) {
+            perror(segment);
+            break;
+        }
+        dropped++;
+    }
+    if (dropped > 0) {
+        num_retired -= dropped;
+        memmove(retired, retired + dropped, num_retired * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&segments_mutex);
+}
+
+const char *wal_path() {
+    return atomic_load(&logging) ? log_path : NULL;
+}
+
+uint64_t wal_synced() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t offset = synced;
+    pthread_mutex_unlock(&wal_mutex);
+    return offset;
+}
+
+size_t wal_records() {
+    return atomic_load(&records);
+}
+
+size_t wal_commits() {
+    return atomic_load(&commits);
+}
@@ -0,0 +1,126 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_BUFFER_MAX (64 << 20)  // bytes of records that may wait for the log writer
+#define WAL_FLUSH_BYTES (1 << 20)  // bytes of records written even if no command waits for them
+#define WAL_SEGMENT_BYTES (64 << 20)  // bytes of records after which the log moves to a new segment
+
+// Write-ahead log of the changes to the store. Every pair that is written or
+// removed, whether by a command, an expired TTL or an eviction, appends a
+// record to a buffer in memory, in the order the changes were applied to its
+// key. A command that changes the store waits for its records to be synced
+// before it completes; the log-writer thread then takes the whole buffer and
+// writes it with one write followed by one fdatasync, so a single sync covers
+// the records of every job and session thread that changed the store in the
+// meantime (group commit).
+//
+// Each record is laid out as
+//
+//     crc32c (4) | key length (4) | value length (4) | type (1) | deadline (8) | key | value
+//
+// in the byte order of the host, with the checksum covering everything after
+// it, so that a record torn by a crash is found when the log is read. The
+// deadline of a write is the wall clock time its TTL runs out at, in
+// milliseconds since the Epoch, or 0 if the key does not expire; a recovery
+// that replays the write after that time drops the key.
+//
+// The log is kept in segments. Records are appended to the file at the path
+// of the log; once it holds WAL_SEGMENT_BYTES of records, the log writer
+// renames it to <path>.<offset>, the offset of its first record in 16 hex
+// digits, and starts a new one. Each segment begins with a header holding
+// the magic and that offset, so offsets count records across all of the
+// segments. Once a snapshot of the store is installed, the segments whose
+// records all come before its offset are deleted (wal_compact), so the log
+// only keeps what the last snapshot does not hold.
+
+enum WalRecordType {
+    WAL_WRITE = 1,    // the key was given the value
+    WAL_DELETE = 2,   // the key was removed; the record has no value
+};
+
+#define WAL_MAGIC "KVSWAL02"      // first bytes of every segment
+#define WAL_SEGMENT_HEADER 16      // bytes of the magic and offset before the records of a segment
+#define WAL_HEADER_SIZE 21         // bytes of a record before its key
+
+/// Function called for every record of a log being replayed.
+/// @param type Type of the record.
+/// @param key Key of the record, not null terminated.
+/// @param key_len Length of the key.
+/// @param value Value of the record, not null terminated.
+/// @param value_len Length of the value, 0 for a removal.
+/// @param deadline Time the key expires at, 0 if it does not.
+/// @param arg Argument given to wal_replay.
+typedef void (*wal_visit_fn)(enum WalRecordType type, const char *key, size_t key_len, const char *value,
+                             size_t value_len, uint64_t deadline, void *arg);
+
+/// Reads the records of a log from an offset on, mapping one segment at a
+/// time. The log ends at the first record of the open segment that is
+/// incomplete or fails its checksum, the tail a crash left behind, and the
+/// file is cut there so that new records follow the intact ones. Must be
+/// called before the log is opened.
+/// @param path Path of the log file.
+/// @param from Offset of the first record to read.
+/// @param visit Function called for every record.
+/// @param arg Argument passed to visit.
+/// @return 0 on success or if the log does not exist, 1 if the log is
+/// shorter than from, no longer holds the records from it on, has a damaged
+/// or missing segment, or could not be read.
+int wal_replay(const char *path, uint64_t from, wal_visit_fn visit, void *arg);
+
+/// Opens the log, appending to its last segment if it exists, and starts the
+/// log writer.
+/// Must be called before the store changes.
+/// @param path Path of the log file.
+/// @return 0 on success, 1 otherwise.
+int wal_open(const char *path);
+
+/// Writes out the records still buffered, stops the log writer and closes
+/// the log. Does nothing if the log is not open.
+void wal_close();
+
+/// Appends a record to the log, if it is open. Must be called with the key
+/// locked against other writers, so that its records follow its changes.
+/// @param type Type of the record.
+/// @param key Key that changed.
+/// @param value New value of the key, NULL for a removal.
+/// @param deadline Time the key expires at, in milliseconds since the Epoch,
+/// 0 if it does not.
+void wal_append(enum WalRecordType type, const char *key, const char *value, uint64_t deadline);
+
+/// Waits until every record appended before the call is on disk.
+/// @return 0 on success or if the log is not open, 1 if the log could not be
+/// written.
+int wal_sync();
+
+/// Deletes the segments of the log whose records all come before an offset.
+/// Called once a snapshot holding the store up to that offset is installed.
+/// Does nothing if the log is not open.
+/// @param offset Offset the snapshot was taken at.
+void wal_compact(uint64_t offset);
+
+/// Syncs the directory of a file, so that a rename or a new file in it
+/// survives a crash.
+/// @param path Path of the file.
+/// @return 0 on success, 1 otherwise.
+int sync_directory(const char *path);
+
+/// Gets the path of the log.
+/// @return Path given to wal_open, NULL if the log is not open.
+const char *wal_path();
+
+/// Gets the length of the log known to be on disk.
+/// @return Offset up to which the log is synced.
+uint64_t wal_synced();
+
+/// Gets the number of records appended to the log.
+/// @return Number of records appended since the log was opened.
+size_t wal_records();
+
+/// Gets the number of syncs of the log.
+/// @return Number of write and fdatasync pairs the log writer did.
+size_t wal_commits();
+
+#endif  // KVS_WAL_H